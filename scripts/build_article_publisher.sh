@@ -31,11 +31,45 @@ else
   echo "[+] GCS authentication key found"
 fi
 
+# zstd-compressed archive uploads are accepted when libzstd is installed
+ZSTD_LIBS=""
+if [ -f /usr/include/zstd.h ]; then
+  ZSTD_LIBS="-lzstd"
+fi
+
+# JPEG and PNG originals are recompressed losslessly when libjpeg and
+# libpng are installed
+IMAGE_LIBS=""
+if [ -f /usr/include/jpeglib.h ]; then
+  IMAGE_LIBS="$IMAGE_LIBS -ljpeg"
+fi
+if [ -f /usr/include/png.h ]; then
+  IMAGE_LIBS="$IMAGE_LIBS -lpng"
+fi
+
 echo "[*] Compiling to $BUILD_PATH..."
 g++ -std=c++17 -O2 -o "$BUILD_PATH" \
+  "$SRC_DIR/archive.cpp" \
   "$SRC_DIR/article_publisher.cpp" \
+  "$SRC_DIR/content_api.cpp" \
+  "$SRC_DIR/db.cpp" \
+  "$SRC_DIR/db_writer.cpp" \
+  "$SRC_DIR/feed.cpp" \
   "$SRC_DIR/https_server.cpp" \
-  -lsqlite3 -pthread
+  "$SRC_DIR/imagemagick.cpp" \
+  "$SRC_DIR/images.cpp" \
+  "$SRC_DIR/maintenance.cpp" \
+  "$SRC_DIR/manifest.cpp" \
+  "$SRC_DIR/migrations.cpp" \
+  "$SRC_DIR/process.cpp" \
+  "$SRC_DIR/recompress.cpp" \
+  "$SRC_DIR/related.cpp" \
+  "$SRC_DIR/resilience.cpp" \
+  "$SRC_DIR/search.cpp" \
+  "$SRC_DIR/storage.cpp" \
+  "$SRC_DIR/tags.cpp" \
+  "$SRC_DIR/watcher.cpp" \
+  -lsqlite3 -lz $ZSTD_LIBS $IMAGE_LIBS -pthread
 
 echo "[*] Moving binary to $OUT_PATH..."
 sudo mv "$BUILD_PATH" "$OUT_PATH"
@@ -0,0 +1,17 @@
+#!/bin/bash
+set -e
+
+# Builds and runs the tests in tests/; needs only g++
+ROOT_DIR="$(cd "$(dirname "$0")/.." && pwd)"
+BUILD_DIR="$(mktemp -d)"
+trap 'rm -rf "$BUILD_DIR"' EXIT
+
+echo "[*] Compiling storage_test..."
+g++ -std=c++17 -O2 -o "$BUILD_DIR/storage_test" \
+  "$ROOT_DIR/tests/storage_test.cpp" \
+  "$ROOT_DIR/src/process.cpp" \
+  "$ROOT_DIR/src/resilience.cpp" \
+  -pthread
+
+echo "[*] Running storage_test..."
+"$BUILD_DIR/storage_test"
@@ -0,0 +1,555 @@
+#include "archive.hpp"
+#include "publisher.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <vector>
+#include <zlib.h>
+
+#if __has_include(<zstd.h>)
+#include <zstd.h>
+#define PUBLISHER_HAVE_ZSTD 1
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const size_t CHUNK = 64 * 1024;
+const size_t TAR_BLOCK = 512;
+const size_t MAX_ENTRIES = 20000;
+// Long names and pax headers are tiny; anything larger is not an upload
+const unsigned long long MAX_HEADER_DATA = 1024 * 1024;
+
+// Buffered view of a reader with exact-size reads
+class Input {
+public:
+  explicit Input(ByteReader read) : read(std::move(read)), buf(CHUNK) {}
+
+  // Buffered bytes not consumed yet, refilling when empty; 0 at the end
+  size_t available() {
+    if (pos == end && !eof) {
+      long long n = read(buf.data(), buf.size());
+      if (n < 0)
+        failed = true;
+      if (n <= 0) {
+        eof = true;
+      } else {
+        pos = 0;
+        end = (size_t)n;
+      }
+    }
+    return end - pos;
+  }
+
+  // Makes at least n bytes available (n <= CHUNK) without consuming them
+  bool ensure(size_t n) {
+    if (end - pos >= n)
+      return true;
+    std::memmove(buf.data(), buf.data() + pos, end - pos);
+    end -= pos;
+    pos = 0;
+    while (end < n && !eof) {
+      long long got = read(buf.data() + end, buf.size() - end);
+      if (got < 0)
+        failed = true;
+      if (got <= 0)
+        eof = true;
+      else
+        end += (size_t)got;
+    }
+    return end >= n;
+  }
+
+  const char *data() const { return buf.data() + pos; }
+  void consume(size_t n) { pos += n; }
+
+  bool read_exact(char *out, size_t n) {
+    while (n) {
+      size_t got = std::min(n, available());
+      if (!got)
+        return false;
+      std::memcpy(out, data(), got);
+      consume(got);
+      out += got;
+      n -= got;
+    }
+    return true;
+  }
+
+  bool skip(unsigned long long n) {
+    while (n) {
+      size_t got = (size_t)std::min<unsigned long long>(n, available());
+      if (!got)
+        return false;
+      consume(got);
+      n -= got;
+    }
+    return true;
+  }
+
+  bool failed = false;
+
+private:
+  ByteReader read;
+  std::vector<char> buf;
+  size_t pos = 0;
+  size_t end = 0;
+  bool eof = false;
+};
+
+struct Inflater {
+  z_stream z{};
+  bool ok;
+  // 15 + 32 detects gzip/zlib headers, -15 is a raw deflate stream
+  explicit Inflater(int window_bits) {
+    ok = inflateInit2(&z, window_bits) == Z_OK;
+  }
+  ~Inflater() {
+    if (ok)
+      inflateEnd(&z);
+  }
+};
+
+// Decompressed view of a gzip stream; concatenated members (pigz) are read
+// back to back
+ByteReader gzip_reader(std::shared_ptr<Input> in) {
+  auto gz = std::make_shared<Inflater>(15 + 32);
+  auto mid_member = std::make_shared<bool>(false);
+  return [in, gz, mid_member](char *out, size_t n) -> long long {
+    if (!gz->ok)
+      return -1;
+    z_stream &z = gz->z;
+    z.next_out = reinterpret_cast<Bytef *>(out);
+    z.avail_out = (uInt)n;
+    while (z.avail_out == n) {
+      size_t avail = in->available();
+      if (!avail && !*mid_member)
+        return in->failed ? -1 : 0;
+      z.next_in = (Bytef *)in->data();
+      z.avail_in = (uInt)avail;
+      int rc = inflate(&z, Z_NO_FLUSH);
+      in->consume(avail - z.avail_in);
+      if (rc == Z_STREAM_END) {
+        inflateReset(&z);
+        *mid_member = false;
+      } else if (rc == Z_OK) {
+        *mid_member = true;
+      } else {
+        return -1; // corrupt, or Z_BUF_ERROR on a truncated member
+      }
+    }
+    return (long long)(n - z.avail_out);
+  };
+}
+
+#ifdef PUBLISHER_HAVE_ZSTD
+ByteReader zstd_reader(std::shared_ptr<Input> in) {
+  std::shared_ptr<ZSTD_DStream> ds(ZSTD_createDStream(), ZSTD_freeDStream);
+  if (ds)
+    ZSTD_initDStream(ds.get());
+  // Last ZSTD_decompressStream hint; 0 when a frame just ended
+  auto pending = std::make_shared<size_t>(0);
+  return [in, ds, pending](char *out, size_t n) -> long long {
+    if (!ds)
+      return -1;
+    ZSTD_outBuffer output{out, n, 0};
+    while (output.pos == 0) {
+      size_t avail = in->available();
+      if (!avail && !*pending)
+        return in->failed ? -1 : 0;
+      ZSTD_inBuffer input{in->data(), avail, 0};
+      size_t rc = ZSTD_decompressStream(ds.get(), &output, &input);
+      in->consume(input.pos);
+      if (ZSTD_isError(rc))
+        return -1;
+      *pending = rc;
+      if (!avail && output.pos == 0)
+        return -1; // truncated frame
+    }
+    return (long long)output.pos;
+  };
+}
+#endif
+
+// Entry name as a path below the destination; false for names that would
+// escape it
+bool entry_path(const std::string &name, fs::path &rel) {
+  if (name.empty() || name[0] == '/' || name.find('\\') != std::string::npos)
+    return false;
+  rel = fs::path(name).lexically_normal();
+  if (rel.has_root_path())
+    return false;
+  for (const auto &part : rel) {
+    if (part == "..")
+      return false;
+  }
+  if (rel.filename().empty())
+    rel = rel.parent_path();
+  return true;
+}
+
+// macOS resource forks that Finder adds to zips and tars
+bool ignored_entry(const fs::path &rel) {
+  return rel.empty() || rel == "." || *rel.begin() == "__MACOSX" ||
+         rel.filename().string().rfind("._", 0) == 0;
+}
+
+// Writes entries below dest, enforcing the size and entry limits
+class Extractor {
+public:
+  Extractor(const fs::path &dest, unsigned long long max_bytes,
+            const std::function<void(const fs::path &)> &on_file,
+            std::string &error)
+      : dest(dest), max_bytes(max_bytes), on_file(on_file), error(error) {}
+
+  bool fail(const std::string &message) {
+    error = message;
+    return false;
+  }
+
+  // Starts a regular file; `skip` is set for entries that are not kept
+  bool open(const std::string &name, bool &skip) {
+    fs::path rel;
+    if (!entry_path(name, rel))
+      return fail("Unsafe path in archive: " + name);
+    skip = ignored_entry(rel);
+    if (skip)
+      return true;
+    if (++entries > MAX_ENTRIES)
+      return fail("Archive has too many entries");
+
+    std::error_code ec;
+    fs::create_directories((dest / rel).parent_path(), ec);
+    file.open(dest / rel, std::ios::binary | std::ios::trunc);
+    if (ec || !file)
+      return fail("Cannot write archive entry: " + name);
+    current = rel;
+    return true;
+  }
+
+  bool write(const char *data, size_t n) {
+    written += n;
+    if (written > max_bytes)
+      return fail("Upload exceeds " + std::to_string(max_bytes) +
+                  " bytes unpacked");
+    file.write(data, (std::streamsize)n);
+    return file.good() || fail("Cannot write archive entry: " +
+                               current.string());
+  }
+
+  bool close() {
+    file.close();
+    if (!file)
+      return fail("Cannot write archive entry: " + current.string());
+    on_file(current);
+    return true;
+  }
+
+  bool directory(const std::string &name) {
+    fs::path rel;
+    if (!entry_path(name, rel))
+      return fail("Unsafe path in archive: " + name);
+    if (ignored_entry(rel))
+      return true;
+    std::error_code ec;
+    fs::create_directories(dest / rel, ec);
+    return !ec || fail("Cannot create directory: " + name);
+  }
+
+private:
+  fs::path dest;
+  unsigned long long max_bytes;
+  const std::function<void(const fs::path &)> &on_file;
+  std::string &error;
+  std::ofstream file;
+  fs::path current;
+  unsigned long long written = 0;
+  size_t entries = 0;
+};
+
+std::string truncated(const Input &in) {
+  return in.failed ? "Upload interrupted or corrupt" : "Archive is truncated";
+}
+
+// Streams n bytes of entry data from in to sink
+template <typename Sink>
+bool copy_entry(Input &in, unsigned long long n, Sink sink) {
+  while (n) {
+    size_t got = (size_t)std::min<unsigned long long>(n, in.available());
+    if (!got || !sink(in.data(), got))
+      return false;
+    in.consume(got);
+    n -= got;
+  }
+  return true;
+}
+
+unsigned long long tar_number(const char *field, size_t len) {
+  unsigned long long value = 0;
+  if ((unsigned char)field[0] & 0x80) {
+    // GNU base-256 for sizes past 8 GiB
+    for (size_t i = 1; i < len; ++i)
+      value = (value << 8) | (unsigned char)field[i];
+    return value;
+  }
+  for (size_t i = 0; i < len && field[i]; ++i) {
+    if (field[i] == ' ')
+      continue;
+    if (field[i] < '0' || field[i] > '7')
+      break;
+    value = value * 8 + (field[i] - '0');
+  }
+  return value;
+}
+
+std::string tar_field(const char *field, size_t len) {
+  return std::string(field, strnlen(field, len));
+}
+
+bool tar_checksum_ok(const char *block) {
+  unsigned long long sum = 0;
+  for (size_t i = 0; i < TAR_BLOCK; ++i)
+    sum += (i >= 148 && i < 156) ? ' ' : (unsigned char)block[i];
+  return sum == tar_number(block + 148, 8);
+}
+
+// "path" record of a pax extended header ("<len> path=<value>\n" records)
+std::string pax_path(const std::string &data) {
+  size_t pos = 0;
+  while (pos < data.size()) {
+    size_t space = data.find(' ', pos);
+    if (space == std::string::npos)
+      break;
+    size_t len = std::strtoull(data.c_str() + pos, nullptr, 10);
+    if (len == 0 || pos + len > data.size())
+      break;
+    std::string record = data.substr(space + 1, pos + len - space - 2);
+    if (record.rfind("path=", 0) == 0)
+      return record.substr(5);
+    pos += len;
+  }
+  return "";
+}
+
+bool extract_tar(Input &in, Extractor &out) {
+  char block[TAR_BLOCK];
+  std::string long_name;
+  while (true) {
+    if (!in.read_exact(block, TAR_BLOCK))
+      return out.fail(truncated(in));
+    if (std::all_of(block, block + TAR_BLOCK, [](char c) { return !c; }))
+      return true; // end-of-archive marker
+    if (!tar_checksum_ok(block))
+      return out.fail("Not a tar, gzip, zstd or zip archive");
+
+    unsigned long long size = tar_number(block + 124, 12);
+    unsigned long long padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    char type = block[156];
+    std::string name = tar_field(block, 100);
+    if (std::memcmp(block + 257, "ustar", 5) == 0 && block[345])
+      name = tar_field(block + 345, 155) + "/" + name;
+    if (!long_name.empty()) {
+      name = long_name;
+      long_name.clear();
+    }
+
+    if (type == 'L' || type == 'x') {
+      // Name of the next entry: GNU long name or pax extended header
+      if (size > MAX_HEADER_DATA)
+        return out.fail("Malformed tar archive");
+      std::string data(size, '\0');
+      if (!in.read_exact(&data[0], size) || !in.skip(padding))
+        return out.fail(truncated(in));
+      long_name = type == 'L' ? tar_field(data.data(), data.size())
+                              : pax_path(data);
+      continue;
+    }
+
+    if (type == '0' || type == '\0' || type == '7') {
+      bool skip = false;
+      if (!out.open(name, skip))
+        return false;
+      bool failed_write = false;
+      if (!copy_entry(in, size, [&](const char *data, size_t n) {
+            failed_write = !skip && !out.write(data, n);
+            return !failed_write;
+          }))
+        return failed_write ? false : out.fail(truncated(in));
+      if (!in.skip(padding))
+        return out.fail(truncated(in));
+      if (!skip && !out.close())
+        return false;
+    } else {
+      if (type == '5' && !out.directory(name))
+        return false;
+      // Links, devices and global pax headers are never written
+      if (type != '5' && type != 'g')
+        log_to_file("Skipped tar entry of type '" + std::string(1, type) +
+                    "': " + name);
+      if (!in.skip(size + padding))
+        return out.fail(truncated(in));
+    }
+  }
+}
+
+uint32_t le16(const char *p) {
+  return (unsigned char)p[0] | (unsigned char)p[1] << 8;
+}
+
+uint32_t le32(const char *p) {
+  return le16(p) | le16(p + 2) << 16;
+}
+
+// Inflates a raw deflate stream from in, stopping exactly at its end so the
+// next zip header can be read
+template <typename Sink> bool inflate_entry(Input &in, Sink sink) {
+  Inflater inflater(-15);
+  if (!inflater.ok)
+    return false;
+  z_stream &z = inflater.z;
+  std::vector<char> buf(CHUNK);
+  int rc = Z_OK;
+  while (rc != Z_STREAM_END) {
+    size_t avail = in.available();
+    z.next_in = (Bytef *)in.data();
+    z.avail_in = (uInt)avail;
+    z.next_out = reinterpret_cast<Bytef *>(buf.data());
+    z.avail_out = (uInt)buf.size();
+    rc = inflate(&z, Z_NO_FLUSH);
+    in.consume(avail - z.avail_in);
+    if (rc != Z_OK && rc != Z_STREAM_END)
+      return false;
+    if (!sink(buf.data(), buf.size() - z.avail_out))
+      return false;
+  }
+  return true;
+}
+
+// Zip read front to back through the local file headers; the central
+// directory at the end is not needed
+bool extract_zip(Input &in, Extractor &out) {
+  while (true) {
+    char sig[4];
+    if (!in.read_exact(sig, 4))
+      return out.fail(truncated(in));
+    uint32_t signature = le32(sig);
+    if (signature == 0x02014b50 || signature == 0x06054b50)
+      return true; // central directory: every entry has been read
+    if (signature != 0x04034b50)
+      return out.fail("Malformed zip archive");
+
+    char header[26];
+    if (!in.read_exact(header, sizeof(header)))
+      return out.fail(truncated(in));
+    uint32_t flags = le16(header + 2);
+    uint32_t method = le16(header + 4);
+    uint32_t crc = le32(header + 10);
+    uint32_t compressed = le32(header + 14);
+    uint32_t size = le32(header + 18);
+    std::string name(le16(header + 22), '\0');
+    if (!in.read_exact(&name[0], name.size()) ||
+        !in.skip(le16(header + 24)))
+      return out.fail(truncated(in));
+    if (flags & 1)
+      return out.fail("Encrypted zip entries are not supported");
+    if (compressed == 0xFFFFFFFF || size == 0xFFFFFFFF)
+      return out.fail("Zip64 archives are not supported");
+    bool descriptor = flags & 8;
+
+    if (!name.empty() && name.back() == '/' && compressed == 0 &&
+        !descriptor) {
+      if (!out.directory(name))
+        return false;
+      continue;
+    }
+
+    bool skip = false;
+    if (!out.open(name, skip))
+      return false;
+    uint32_t actual_crc = crc32(0, nullptr, 0);
+    bool failed_write = false;
+    auto sink = [&](const char *data, size_t n) {
+      actual_crc = crc32(actual_crc, (const Bytef *)data, (uInt)n);
+      failed_write = !skip && !out.write(data, n);
+      return !failed_write;
+    };
+    bool ok;
+    if (method == 0) {
+      if (descriptor)
+        return out.fail("Stored zip entries with a data descriptor are not "
+                        "supported");
+      ok = copy_entry(in, compressed, sink);
+    } else if (method == 8) {
+      ok = inflate_entry(in, sink);
+    } else {
+      return out.fail("Unsupported zip compression method " +
+                      std::to_string(method) + " for " + name);
+    }
+    if (!ok)
+      return failed_write ? false : out.fail(truncated(in));
+
+    if (descriptor) {
+      // crc, sizes, optionally preceded by a signature
+      char data[16];
+      if (!in.read_exact(data, 12))
+        return out.fail(truncated(in));
+      if (le32(data) == 0x08074b50) {
+        if (!in.read_exact(data + 12, 4))
+          return out.fail(truncated(in));
+        crc = le32(data + 4);
+      } else {
+        crc = le32(data);
+      }
+    }
+    if (actual_crc != crc)
+      return out.fail("Checksum mismatch in zip entry " + name);
+    if (!skip && !out.close())
+      return false;
+  }
+}
+
+} // namespace
+
+bool extract_archive(const ByteReader &read, const fs::path &dest,
+                     unsigned long long max_bytes,
+                     const std::function<void(const fs::path &)> &on_file,
+                     std::string &error) {
+  Extractor out(dest, max_bytes, on_file, error);
+  auto raw = std::make_shared<Input>(read);
+  if (!raw->ensure(4))
+    return out.fail(raw->failed ? "Upload interrupted" : "Upload is empty");
+
+  const unsigned char *magic = (const unsigned char *)raw->data();
+  if (magic[0] == 0x50 && magic[1] == 0x4b)
+    return extract_zip(*raw, out);
+  if (magic[0] == 0x1f && magic[1] == 0x8b) {
+    Input tar(gzip_reader(raw));
+    return extract_tar(tar, out);
+  }
+  if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f &&
+      magic[3] == 0xfd) {
+#ifdef PUBLISHER_HAVE_ZSTD
+    Input tar(zstd_reader(raw));
+    return extract_tar(tar, out);
+#else
+    return out.fail("zstd uploads are not supported by this build");
+#endif
+  }
+  return extract_tar(*raw, out);
+}
+
+fs::path archive_root(const fs::path &dest) {
+  std::error_code ec;
+  if (fs::exists(dest / "metadata.txt", ec))
+    return dest;
+  fs::path only;
+  for (const auto &entry : fs::directory_iterator(dest, ec)) {
+    if (!only.empty() || !entry.is_directory(ec))
+      return dest;
+    only = entry.path();
+  }
+  return only.empty() ? dest : only;
+}
@@ -0,0 +1,38 @@
+// archive.hpp
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <set>
+#include <string>
+
+// Streaming unpacker for article and sochee uploads sent as the request
+// body. Entries are written to disk as their bytes arrive, so nothing is
+// buffered beyond one read. The format is sniffed from the first bytes:
+// tar (optionally gzip, or zstd when built with libzstd) or zip with stored
+// and deflated entries. Absolute paths, ".." components, links and devices
+// are never written.
+
+// Pulls up to n bytes; returns 0 at the end of the stream and -1 on error
+using ByteReader = std::function<long long(char *, size_t)>;
+
+// Content-Types routed to the unpacker instead of being read as a path
+inline const std::set<std::string> ARCHIVE_CONTENT_TYPES = {
+    "application/x-tar",  "application/tar",
+    "application/gzip",   "application/x-gzip",
+    "application/x-gtar", "application/zstd",
+    "application/x-zstd", "application/zip",
+    "application/x-zip-compressed", "application/octet-stream"};
+
+// Unpacks into dest, calling on_file with the path (relative to dest) of
+// each regular file once it is completely written. Stops with `error` set
+// on malformed input or when more than max_bytes would be written.
+bool extract_archive(const ByteReader &read, const std::filesystem::path &dest,
+                     unsigned long long max_bytes,
+                     const std::function<void(const std::filesystem::path &)>
+                         &on_file,
+                     std::string &error);
+
+// Directory to publish inside an unpacked upload: dest itself, or its only
+// top-level directory when the bundle was made with `tar -C .. my-article`.
+std::filesystem::path archive_root(const std::filesystem::path &dest);
@@ -1,9 +1,37 @@
+#include "archive.hpp"
+#include "content_api.hpp"
+#include "db.hpp"
+#include "db_writer.hpp"
+#include "feed.hpp"
 #include "http_server.hpp"
+#include "imagemagick.hpp"
+#include "images.hpp"
+#include "json.hpp"
+#include "maintenance.hpp"
+#include "manifest.hpp"
+#include "migrations.hpp"
+#include "publisher.hpp"
+#include "recompress.hpp"
+#include "related.hpp"
+#include "resilience.hpp"
+#include "search.hpp"
+#include "storage.hpp"
+#include "tags.hpp"
+#include "watcher.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
 #include <climits>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <mutex>
 #include <random>
 #include <regex>
 #include <sqlite3.h>
@@ -15,24 +43,10 @@
 #include <vector>
 
 namespace fs = std::filesystem;
-const std::string DB_PATH = "/var/lib/grabbiel-db/content.db";
-const std::string STORAGE_ROOT = "/var/lib/article-content/";
-const std::string GCS_PUBLIC_BUCKET = "grabbiel-media-public";
-const std::string GCS_PUBLIC_URL = "https://storage.googleapis.com/";
-const std::string LOG_FILE = "/tmp/article-publisher.log";
-const std::unordered_set<std::string> VM_ALLOWED = {"html", "css", "js"};
-const std::unordered_set<std::string> IMAGE_EXTENSIONS = {
-    ".jpg", ".jpeg", ".png", ".gif", ".webp", ".heic", ".bmp", ".tiff"};
-const std::unordered_set<std::string> VIDEO_EXTENSIONS = {
-    ".mp4", ".mov", ".webm", ".avi", ".mkv"};
-const std::vector<std::string> REQUIRED_FILES = {"index.html", "style.css",
-                                                 "script.js"};
-struct ImageDimensions {
-  int width;
-  int height;
-};
 
 void log_to_file(const std::string &message) {
+  static std::mutex log_mutex;
+  std::lock_guard<std::mutex> lock(log_mutex);
   std::ofstream log_file(LOG_FILE, std::ios::app);
   if (log_file) {
     log_file << "[" << time(nullptr) << "] " << message << std::endl;
@@ -43,6 +57,8 @@ void log_to_file(const std::string &message) {
 }
 
 std::string generate_uuid() {
+  static std::mutex uuid_mutex;
+  std::lock_guard<std::mutex> lock(uuid_mutex);
   static std::random_device rd;
   static std::mt19937 gen(rd());
   static std::uniform_int_distribution<> dis(0, 15);
@@ -54,43 +70,22 @@ std::string generate_uuid() {
   return uuid;
 }
 
-bool validate_article_structure(const fs::path &article_dir) {
-  for (const auto &filename : REQUIRED_FILES) {
-    fs::path full_path = article_dir / filename;
-    if (!fs::exists(full_path)) {
-      log_to_file("Validation failed: missing required file " + filename);
-      return false;
-    }
-  }
-  log_to_file("Validation passed: all required files present");
-  return true;
+std::string env_or(const char *name, const std::string &fallback) {
+  const char *value = std::getenv(name);
+  return (value && *value) ? std::string(value) : fallback;
 }
 
-std::string exec_command(const std::string &cmd) {
-  std::string result;
-  char buffer[128];
-
-  log_to_file("Executing command: " + cmd);
-
-  FILE *pipe = popen(cmd.c_str(), "r");
-  if (!pipe) {
-    log_to_file("Error executing command: popen() failed");
-    return "Error executing command";
-  }
-
-  while (fgets(buffer, sizeof(buffer), pipe) != nullptr) {
-    result += buffer;
-  }
-
-  int status = pclose(pipe);
-  if (status != 0) {
-    log_to_file("Command execution failed with status: " +
-                std::to_string(status));
-  } else {
-    log_to_file("Command executed successfully");
+long long env_or(const char *name, long long fallback) {
+  const char *value = std::getenv(name);
+  if (!value || !*value)
+    return fallback;
+  try {
+    return std::stoll(value);
+  } catch (const std::exception &) {
+    log_to_file(std::string("Ignoring invalid value for ") + name + ": " +
+                value);
+    return fallback;
   }
-
-  return result;
 }
 
 // Parses metadata.txt (simple key = value format)
@@ -134,26 +129,16 @@ std::string regex_escape(const std::string &s) {
   return std::regex_replace(s, esc, R"(\$&)");
 }
 
-// Rewrites references like "media/photo.jpg" to their full GCS URL
+// Rewrites references like "media/photo.jpg" or "../media/gallery/1.jpg"
+// (from a nested stylesheet) to their full GCS URL in the staged copies of
+// the page files
 void rewrite_media_references(
-    const fs::path &article_dir,
-    const std::unordered_map<std::string, std::string> &media_map,
-    int content_id) {
-
-  std::vector<std::string> target_ext = {".html", ".js", ".css"};
-  std::string base_url =
-      "https://server.grabbiel.com/article/" + std::to_string(content_id) + "/";
+    const fs::path &staging_dir,
+    const std::vector<std::pair<std::string, std::string>> &staged_files,
+    const std::unordered_map<std::string, std::string> &media_map) {
 
-  for (const auto &entry : fs::directory_iterator(article_dir)) {
-    if (entry.is_directory())
-      continue;
-    std::string ext = entry.path().extension().string();
-
-    if (std::find(target_ext.begin(), target_ext.end(), ext) ==
-        target_ext.end())
-      continue;
-
-    fs::path file_path = entry.path();
+  for (const auto &staged : staged_files) {
+    fs::path file_path = staging_dir / staged.first;
     std::ifstream in(file_path);
     if (!in) {
       std::cerr << "[rewrite] Failed to open " << file_path << " for reading\n";
@@ -169,7 +154,7 @@ void rewrite_media_references(
 
     // 🖼️ Replace all media/xxx with their full GCS URL
     for (const auto &[local_path, gcs_url] : media_map) {
-      std::regex pattern(regex_escape(local_path));
+      std::regex pattern(R"((?:\.\.?/)*)" + regex_escape(local_path));
       std::string new_content = std::regex_replace(content, pattern, gcs_url);
       if (new_content != content) {
         content = new_content;
@@ -177,24 +162,6 @@ void rewrite_media_references(
       }
     }
 
-    // 📄 Replace local script and style references with article URL-based ones
-    if (entry.path().filename() == "index.html") {
-      // Handle CSS files
-      std::regex css_pattern(R"(href\s*=\s*["'](?:\.\/)?([^"']*\.css)["'])");
-      std::string new_content = std::regex_replace(
-          content, css_pattern, "href=\"" + base_url + "$1\"");
-
-      // Handle ALL JavaScript files (not just script.js)
-      std::regex js_pattern(R"(src\s*=\s*["'](?:\.\/)?([^"']*\.js)["'])");
-      new_content = std::regex_replace(new_content, js_pattern,
-                                       "src=\"" + base_url + "$1\"");
-
-      if (new_content != content) {
-        content = new_content;
-        modified = true;
-      }
-    }
-
     if (modified) {
       std::ofstream out(file_path);
       if (!out) {
@@ -203,157 +170,305 @@ void rewrite_media_references(
         continue;
       }
       out << content;
-      std::cout << "[rewrite] Rewrote media references in: " << file_path
+      std::cerr << "[rewrite] Rewrote media references in: " << file_path
                 << "\n";
     }
   }
 }
 
-// Store file reference in database
-bool store_file_reference(int content_id, const std::string &file_type,
-                          const std::string &file_path) {
-  sqlite3 *db;
-  if (sqlite3_open(DB_PATH.c_str(), &db) != SQLITE_OK) {
-    log_to_file("Failed to open database: " + std::string(sqlite3_errmsg(db)));
-    sqlite3_close(db);
-    return false;
-  }
-
-  sqlite3_stmt *stmt;
-  const char *sql = "INSERT INTO content_files (content_id, file_type, "
-                    "file_path, is_main) VALUES (?, ?, ?, 0);";
+// 📄 Replace local script and style references in index.html with article
+// URL-based ones. Needs the content ID, so it runs once the DB has assigned it.
+bool rewrite_article_urls(const fs::path &article_dir, int content_id) {
+  std::string base_url =
+      "https://server.grabbiel.com/article/" + std::to_string(content_id) + "/";
+  fs::path file_path = article_dir / "index.html";
 
-  if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-    log_to_file("Error preparing insert statement: " +
-                std::string(sqlite3_errmsg(db)));
-    sqlite3_close(db);
+  std::ifstream in(file_path);
+  if (!in) {
+    std::cerr << "[rewrite] Failed to open " << file_path << " for reading\n";
     return false;
   }
+  std::stringstream buffer;
+  buffer << in.rdbuf();
+  in.close();
+  std::string content = buffer.str();
+
+  // Handle CSS files
+  std::regex css_pattern(R"(href\s*=\s*["'](?:\.\/)?([^"']*\.css)["'])");
+  std::string new_content = std::regex_replace(content, css_pattern,
+                                               "href=\"" + base_url + "$1\"");
+
+  // Handle ALL JavaScript files (not just script.js)
+  std::regex js_pattern(R"(src\s*=\s*["'](?:\.\/)?([^"']*\.js)["'])");
+  new_content =
+      std::regex_replace(new_content, js_pattern, "src=\"" + base_url + "$1\"");
+
+  if (new_content == content)
+    return true;
 
-  sqlite3_bind_int(stmt, 1, content_id);
-  sqlite3_bind_text(stmt, 2, file_type.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 3, file_path.c_str(), -1, SQLITE_STATIC);
-
-  if (sqlite3_step(stmt) != SQLITE_DONE) {
-    log_to_file("Error inserting file reference: " +
-                std::string(sqlite3_errmsg(db)));
-    sqlite3_finalize(stmt);
-    sqlite3_close(db);
+  std::ofstream out(file_path);
+  if (!out) {
+    std::cerr << "[rewrite] Failed to open " << file_path << " for writing\n";
     return false;
   }
-
-  sqlite3_finalize(stmt);
-  sqlite3_close(db);
+  out << new_content;
+  std::cerr << "[rewrite] Rewrote article URLs in: " << file_path << "\n";
   return true;
 }
 
-// Copies article files to both local storage and GCS
-bool store_article_files(const fs::path &article_dir, int content_id) {
-  log_to_file("Storing article files from " + article_dir.string() +
-              " for content ID " + std::to_string(content_id));
-  fs::path local_dest = STORAGE_ROOT + std::to_string(content_id);
-
+// Everything the slow part of a publish produces. Nothing here touches the
+// database; apply_article_writes() turns it into rows in one transaction.
+struct ArticleUploads {
+  struct Image {
+    std::string url;
+    std::string filename;
+    std::string mime_type;
+    int width;
+    int height;
+    long long bytes;
+    ImagePlaceholder placeholder;
+  };
+  std::string thumbnail_url;
+  std::vector<Image> thumbnails; // every size and format
   std::unordered_map<std::string, std::string> media_url_map;
+  // How much smaller the media was stored than its source files
+  long long media_bytes_saved = 0;
+  // Patched copies of the VM-served files, installed once the ID is known
+  fs::path staging_dir;
+  std::vector<std::pair<std::string, std::string>> local_files; // rel, type
+};
 
-  try {
-    fs::create_directories(local_dest);
-    log_to_file("Created local directory: " + local_dest.string());
+// Record a locally served file for the article
+bool store_file_reference(WriteTxn &txn, int content_id,
+                          const std::string &file_type,
+                          const std::string &file_path) {
+  return txn.exec("INSERT INTO content_files (content_id, file_type, "
+                  "file_path, is_main) VALUES (?, ?, ?, 0);",
+                  {(long long)content_id, file_type, file_path});
+}
 
-    fs::path media_dir = article_dir / "media";
-    for (const auto &entry : fs::directory_iterator(media_dir)) {
-      if (entry.is_directory())
-        continue;
+// A media file as uploaded to GCS
+struct StoredMedia {
+  std::string url; // "" for types that are not published
+  long long bytes_saved = 0;
+};
 
-      fs::path rel_path = fs::relative(entry.path(), article_dir);
-      std::string ext = entry.path().extension().string();
-      std::string file_type;
-      if (!ext.empty())
-        file_type = ext.substr(1);
-      else
-        file_type = "bin";
-
-      std::string category;
-      if (IMAGE_EXTENSIONS.count(ext)) {
-        category = "images/originals/";
-      } else if (VIDEO_EXTENSIONS.count(ext)) {
-        category = "videos/originals/";
-      } else {
-        log_to_file("Unsupported media type skipped: " + entry.path().string());
-        continue;
-      }
+// Caps how many media files are stored at once across every publish in
+// the process, at PUBLISHER_BATCH_JOBS: each may hold a whole decoded image
+// in memory while it is recompressed. Batch workers and the threads of
+// each article draw from the same slots.
+class MediaSlots {
+public:
+  // False when the deadline passes first
+  bool acquire(Deadline deadline) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto free = [&] { return used < limit(); };
+    if (deadline == Deadline::max())
+      cv.wait(lock, free);
+    else if (!cv.wait_until(lock, deadline, free))
+      return false;
+    ++used;
+    return true;
+  }
 
-      std::string random_name = generate_uuid() + ext;
-      std::string gcs_key = category + random_name;
-      std::string tmp_path = "/tmp/" + random_name;
-      fs::copy_file(entry.path(), tmp_path,
-                    fs::copy_options::overwrite_existing);
+  bool try_acquire() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (used >= limit())
+      return false;
+    ++used;
+    return true;
+  }
 
-      std::string cmd = "gsutil cp \"" + tmp_path + "\" gs://" +
-                        GCS_PUBLIC_BUCKET + "/" + gcs_key;
-      log_to_file("Uploading media file to GCS: " + cmd);
-      std::string result = exec_command(cmd);
-      log_to_file("GCS upload result: " + result);
+  void release() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      --used;
+    }
+    cv.notify_one();
+  }
 
-      fs::remove(tmp_path);
+private:
+  static long long limit() {
+    return std::max(1LL, env_or("PUBLISHER_BATCH_JOBS", 4LL));
+  }
 
-      std::string gcs_url = GCS_PUBLIC_URL + GCS_PUBLIC_BUCKET + "/" + gcs_key;
-      media_url_map["media/" + entry.path().filename().string()] = gcs_url;
-    }
+  std::mutex mutex;
+  std::condition_variable cv;
+  long long used = 0;
+};
 
-    // 🧠 Patch references in-place before saving static files
-    rewrite_media_references(article_dir, media_url_map, content_id);
+MediaSlots &media_slots() {
+  static MediaSlots slots;
+  return slots;
+}
 
-    // ⬇️ Now copy HTML/JS/CSS files AFTER they were patched
-    for (const auto &entry : fs::directory_iterator(article_dir)) {
-      if (entry.is_directory())
-        continue;
-      if (entry.path().filename() == "metadata.txt")
-        continue;
+struct MediaSlotGuard {
+  ~MediaSlotGuard() { media_slots().release(); }
+};
+
+// Uploads one media file to GCS. Images may be stored losslessly
+// recompressed (see recompress_original) or transcoded (see
+// transcode_original), under the extension of the stored format. Throws
+// when the upload fails.
+StoredMedia upload_media_file(const fs::path &file) {
+  std::string ext = file.extension().string();
+  std::string category;
+  fs::path recompressed, transcoded;
+  if (IMAGE_EXTENSIONS.count(ext)) {
+    category = "images/originals/";
+    // Transcoding has to beat the recompressed copy to replace it
+    recompressed = recompress_original(file);
+    transcoded =
+        transcode_original(recompressed.empty() ? file : recompressed);
+  } else if (VIDEO_EXTENSIONS.count(ext)) {
+    category = "videos/originals/";
+  } else {
+    log_to_file("Unsupported media type skipped: " + file.string());
+    return {};
+  }
+
+  const fs::path &stored = !transcoded.empty()     ? transcoded
+                           : !recompressed.empty() ? recompressed
+                                                   : file;
+  std::error_code ec;
+  StoredMedia media;
+  if (stored != file)
+    media.bytes_saved = (long long)fs::file_size(file, ec) -
+                        (long long)fs::file_size(stored, ec);
+  CallResult upload = upload_public_file(
+      stored, category + generate_uuid() + stored.extension().string());
+  if (!recompressed.empty())
+    fs::remove(recompressed, ec);
+  if (!transcoded.empty())
+    fs::remove(transcoded, ec);
+  if (!upload)
+    throw std::runtime_error("Upload of " + file.string() + " failed (" +
+                             call_status_name(upload.status) +
+                             "): " + upload.error);
+  media.url = upload.value;
+  return media;
+}
 
-      fs::path rel_path = fs::relative(entry.path(), article_dir);
-      std::string ext = entry.path().extension().string();
-      std::string file_type;
-      if (!ext.empty())
-        file_type = ext.substr(1);
-      else
-        file_type = "bin";
-
-      if (VM_ALLOWED.count(file_type)) {
-        fs::path dest = local_dest / rel_path;
-        fs::create_directories(dest.parent_path());
-        fs::copy_file(entry.path(), dest, fs::copy_options::overwrite_existing);
-        if (!store_file_reference(content_id, file_type, dest.string())) {
-          log_to_file("Failed to store in DB reference to local-only file: " +
-                      rel_path.string());
-          return false;
-        }
-        log_to_file("Copied local-only file: " + rel_path.string());
+// Uploads media/ and its subdirectories to GCS on up to
+// PUBLISHER_BATCH_JOBS threads, each file in one of the process-wide media
+// slots, recording the local path -> URL rewrite map and the bytes saved.
+// Files already in the map (uploaded while an archive was arriving) are not
+// uploaded again.
+bool upload_article_media(const ContentManifest &manifest,
+                          ArticleUploads &uploads) {
+  std::vector<const ContentManifest::Entry *> pending;
+  for (const auto *entry :
+       manifest.files_of(ContentManifest::Category::Media)) {
+    if (!uploads.media_url_map.count(entry->rel))
+      pending.push_back(entry);
+  }
+
+  // Each thread pulls the next file until one upload has failed
+  std::vector<StoredMedia> stored(pending.size());
+  std::atomic<size_t> next{0};
+  std::atomic<bool> failed{false};
+  Deadline deadline = current_deadline();
+  auto work = [&] {
+    DeadlineScope scope(deadline);
+    for (size_t i; !failed && (i = next++) < pending.size();) {
+      if (!media_slots().acquire(deadline)) {
+        log_to_file("Timed out waiting for a media slot for " +
+                    pending[i]->path.string());
+        failed = true;
+        break;
+      }
+      MediaSlotGuard slot;
+      try {
+        stored[i] = upload_media_file(pending[i]->path);
+      } catch (const std::exception &e) {
+        log_to_file("Error uploading article media: " +
+                    std::string(e.what()));
+        failed = true;
       }
     }
+  };
+  size_t jobs = (size_t)std::max(1LL, env_or("PUBLISHER_BATCH_JOBS", 4LL));
+  std::vector<std::thread> helpers;
+  for (size_t t = 1; t < std::min(jobs, pending.size()); ++t)
+    helpers.emplace_back(work);
+  work();
+  for (auto &helper : helpers)
+    helper.join();
+  if (failed)
+    return false;
 
-    // 🧹 Clean up /tmp/ folder if article_dir was a temp upload
-    if (article_dir.string().rfind("/tmp/", 0) == 0) {
-      std::error_code ec;
-      fs::remove_all(article_dir, ec);
-      if (ec) {
-        log_to_file("⚠️ Failed to clean up temp folder: " +
-                    article_dir.string());
-      } else {
-        log_to_file("🧹 Cleaned up temp folder: " + article_dir.string());
-      }
+  for (size_t i = 0; i < pending.size(); ++i) {
+    if (stored[i].url.empty())
+      continue;
+    uploads.media_url_map[pending[i]->rel] = stored[i].url;
+    uploads.media_bytes_saved += stored[i].bytes_saved;
+  }
+  return true;
+}
+
+// Copies HTML/JS/CSS into a staging directory next to STORAGE_ROOT and
+// patches media references there, leaving the source tree untouched
+bool stage_article_files(const ContentManifest &manifest,
+                         ArticleUploads &uploads) {
+  uploads.staging_dir = fs::path(STORAGE_ROOT) / ".staging" / generate_uuid();
+
+  try {
+    fs::create_directories(uploads.staging_dir);
+    log_to_file("Created staging directory: " + uploads.staging_dir.string());
+
+    // Nested css/, js/ and assets/ keep their relative paths
+    for (const auto *entry :
+         manifest.files_of(ContentManifest::Category::Page)) {
+      fs::path staged = uploads.staging_dir / entry->rel;
+      fs::create_directories(staged.parent_path());
+      fs::copy_file(entry->path, staged, fs::copy_options::overwrite_existing);
+      uploads.local_files.emplace_back(entry->rel, entry->type);
+      log_to_file("Staged local-only file: " + entry->rel);
     }
 
+    // 🧠 Patch references in the staged copies
+    rewrite_media_references(uploads.staging_dir, uploads.local_files,
+                             uploads.media_url_map);
     return true;
+  } catch (const std::exception &e) {
+    log_to_file("Error staging article files: " + std::string(e.what()));
+    return false;
+  }
+}
+
+// Moves the staged files to STORAGE_ROOT/<content_id>. A previous version
+// of the article is swapped out with renameat2(RENAME_EXCHANGE), so the
+// directory the committed content_files rows point at always exists; on a
+// failure the previous version stays installed.
+bool install_article_files(const ArticleUploads &uploads, int content_id) {
+  fs::path local_dest = STORAGE_ROOT + std::to_string(content_id);
+  try {
+    if (!rewrite_article_urls(uploads.staging_dir, content_id))
+      return false;
+
+    if (renameat2(AT_FDCWD, uploads.staging_dir.c_str(), AT_FDCWD,
+                  local_dest.c_str(), RENAME_EXCHANGE) == 0) {
+      // The staging path now holds the previous version
+      fs::remove_all(uploads.staging_dir);
+    } else if (errno == ENOENT) {
+      fs::rename(uploads.staging_dir, local_dest);
+    } else {
+      throw fs::filesystem_error("renameat2", uploads.staging_dir, local_dest,
+                                 std::error_code(errno, std::generic_category()));
+    }
 
+    log_to_file("Installed article files in " + local_dest.string());
+    return true;
   } catch (const std::exception &e) {
-    log_to_file("Error storing article files: " + std::string(e.what()));
+    log_to_file("Error installing article files: " + std::string(e.what()));
     return false;
   }
 }
 
-// Inserts or updates content_blocks and articles
+// Inserts or finds the content_blocks row and its tags
 bool update_article_metadata(
-    const std::unordered_map<std::string, std::string> &meta, int &content_id) {
+    WriteTxn &txn, const std::unordered_map<std::string, std::string> &meta,
+    int &content_id) {
   log_to_file("Updating article metadata");
 
   // Extract required values
@@ -364,8 +479,6 @@ bool update_article_metadata(
   const std::string type_id = meta.at("type_id");
   const std::string tags = meta.at("tags");
   const std::string lang = meta.at("language");
-  std::istringstream tags_stream(tags);
-  std::string tag;
 
   // Print metadata for debugging
   log_to_file("Processing metadata:");
@@ -377,202 +490,507 @@ bool update_article_metadata(
   log_to_file("\tlanguage: " + lang);
   log_to_file("\ttags: " + tags);
 
-  sqlite3 *db;
-  if (sqlite3_open(DB_PATH.c_str(), &db) != SQLITE_OK) {
-    log_to_file("Failed to open database at " + DB_PATH + ": " +
-                std::string(sqlite3_errmsg(db)));
-    sqlite3_close(db);
+  long long existing_id = -1;
+  bool found = false;
+  if (!txn.query_int("SELECT id FROM content_blocks WHERE url_slug = ? "
+                     "AND site_id = ? AND type_id = ?",
+                     {slug, site_id, type_id}, existing_id, found))
     return false;
+  if (found) {
+    // Content already exists, keep its ID and refresh its tags
+    content_id = (int)existing_id;
+    log_to_file("Found existing content with ID: " +
+                std::to_string(content_id));
+  } else {
+    // Insert new content block
+    if (!txn.exec("INSERT INTO content_blocks (title, url_slug, type_id, "
+                  "site_id, language, status) VALUES (?, ?, ?, ?, ?, ?);",
+                  {title, slug, type_id, site_id, lang, status}, true))
+      return false;
+    content_id = (int)txn.result.row_ids.back();
+    log_to_file("Creating content with new ID: " + std::to_string(content_id));
   }
 
-  // Begin transaction
-  if (sqlite3_exec(db, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr) !=
-      SQLITE_OK) {
-    log_to_file("Failed to begin transaction: " +
-                std::string(sqlite3_errmsg(db)));
-    sqlite3_close(db);
+  // tag processing
+  return write_content_tags(txn, content_id, parse_tag_list(tags));
+}
+
+// Every DB mutation of an article publish, in a single transaction
+bool apply_article_writes(
+    WriteTxn &txn, const std::unordered_map<std::string, std::string> &meta,
+    const ArticleUploads &uploads, int &content_id) {
+  if (!update_article_metadata(txn, meta, content_id))
+    return false;
+  txn.on_commit.push_back(
+      [content_id] { content_cache().invalidate(content_id); });
+
+  // Update content_blocks with thumbnail_url and record every variant
+  if (!txn.exec("UPDATE content_blocks SET thumbnail_url = ? WHERE id = ?",
+                {uploads.thumbnail_url, (long long)content_id}))
+    return false;
+  // A republish renders new variants; the previous ones are no longer used
+  if (!txn.exec("DELETE FROM images WHERE content_id = ? AND image_type = "
+                "'thumbnail'",
+                {(long long)content_id}))
     return false;
+  for (const auto &image : uploads.thumbnails) {
+    if (!txn.exec("INSERT INTO images (original_url, filename, mime_type, "
+                  "content_id, image_type, processing_status, width, height, "
+                  "byte_size, blurhash, dominant_color) VALUES (?, ?, ?, ?, "
+                  "'thumbnail', 'complete', ?, ?, ?, NULLIF(?, ''), "
+                  "NULLIF(?, ''))",
+                  {image.url, image.filename, image.mime_type,
+                   (long long)content_id, (long long)image.width,
+                   (long long)image.height, image.bytes,
+                   image.placeholder.blurhash, image.placeholder.color}))
+      return false;
   }
 
-  sqlite3_stmt *stmt;
+  // A republish rewrites the same paths, so replace the previous references
+  if (!txn.exec("DELETE FROM content_files WHERE content_id = ? AND "
+                "is_main = 0",
+                {(long long)content_id}))
+    return false;
+  fs::path local_dest = STORAGE_ROOT + std::to_string(content_id);
+  for (const auto &[rel_path, file_type] : uploads.local_files) {
+    if (!store_file_reference(txn, content_id, file_type,
+                              (local_dest / rel_path).string())) {
+      log_to_file("Failed to store in DB reference to local-only file: " +
+                  rel_path);
+      return false;
+    }
+  }
+  return refresh_feed_entry(txn, content_id);
+}
 
-  const char *select_sql = "SELECT id FROM content_blocks WHERE url_slug = ? "
-                           "AND site_id = ? AND type_id = ?";
+// Search index columns of an article: metadata plus the visible page text
+SearchDocument article_search_document(
+    const fs::path &article_dir,
+    const std::unordered_map<std::string, std::string> &meta) {
+  SearchDocument doc;
+  doc.title = meta.at("title");
+  for (const auto &tag : parse_tag_list(meta.at("tags")))
+    doc.tags += (doc.tags.empty() ? "" : " ") + tag;
+
+  std::ifstream in(article_dir / "index.html");
+  std::stringstream buffer;
+  buffer << in.rdbuf();
+  doc.body = extract_visible_text(buffer.str());
+  return doc;
+}
 
-  if (sqlite3_prepare_v2(db, select_sql, -1, &stmt, nullptr) != SQLITE_OK) {
-    log_to_file("SQL prepare error: " + std::string(sqlite3_errmsg(db)));
-    sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-    sqlite3_close(db);
+bool process_thumbnail(const ContentManifest &manifest,
+                       ArticleUploads &uploads) {
+  if (!manifest.has_dir("thumbnail")) {
+    log_to_file("No thumbnail directory found");
+    return false; // Optional feature
+  }
+  // Find single image in thumbnail folder
+  std::string image_file;
+  for (const auto *entry : manifest.files_in("thumbnail")) {
+    if (IMAGE_EXTENSIONS.count(entry->ext)) {
+      image_file = entry->path.string();
+    }
+  }
+
+  if (image_file.empty()) {
+    log_to_file("No valid images in thumbnail directory");
+    return false; // No thumbnail
+  }
+
+  std::vector<ImageVariant> variants;
+  CallResult made = make_thumbnail_variants(image_file, variants);
+  if (!made) {
+    log_to_file("Thumbnail processing failed: " + made.error);
     return false;
   }
 
-  sqlite3_bind_text(stmt, 1, slug.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 2, site_id.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 3, type_id.c_str(), -1, SQLITE_STATIC);
+  // Upload to GCS; the smallest JPEG is the thumbnail every client can show
+  CallResult upload;
+  for (const auto &variant : variants) {
+    std::string filename = variant.path.filename().string();
+    if (upload)
+      upload = upload_public_file(variant.path,
+                                  "images/thumbnails/" + filename);
+    fs::remove(variant.path);
+    if (!upload)
+      continue; // only removing the remaining files
+    uploads.thumbnails.push_back({upload.value, filename, variant.mime_type,
+                                  variant.width, variant.height,
+                                  (long long)variant.bytes,
+                                  variant.placeholder});
+    if (uploads.thumbnail_url.empty() && variant.mime_type == "image/jpeg")
+      uploads.thumbnail_url = upload.value;
+  }
+  if (!upload) {
+    log_to_file("Thumbnail upload failed: " + upload.error);
+    return false;
+  }
+  return true;
+}
 
-  if (sqlite3_step(stmt) == SQLITE_ROW) {
-    // Content already exists, just return the existing ID
-    content_id = sqlite3_column_int(stmt, 0);
-    sqlite3_finalize(stmt);
-    log_to_file("Found existing content with ID: " +
-                std::to_string(content_id));
+// Outcome of one publish. status/message mirror the HTTP response a single
+// /publish or /sochee request would have sent.
+struct PublishOutcome {
+  std::string path;
+  int content_id = -1;
+  int status = 200;
+  std::string message;
+  double prepare_ms = 0;
+  long long media_bytes_saved = 0; // media stored smaller than its source
+  // Retries and uploads for this publish give up after this
+  Deadline deadline = request_deadline();
+
+  bool fail(int code, const std::string &text) {
+    status = code;
+    message = text;
+    return false;
+  }
+};
 
-    // Commit transaction (even though we didn't change anything)
-    if (sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr) != SQLITE_OK) {
-      log_to_file("Failed to commit transaction: " +
-                  std::string(sqlite3_errmsg(db)));
-      sqlite3_close(db);
-      return false;
-    }
-  } else {
-    sqlite3_finalize(stmt);
-    log_to_file("Creating new content entry");
+// One article moving through the publish pipeline
+struct ArticleJob : PublishOutcome {
+  std::unordered_map<std::string, std::string> metadata;
+  ArticleUploads uploads;
+  SearchDocument search_doc;
+  ContentManifest manifest;
+  // media/ uploads started while an archive upload was still arriving
+  std::vector<std::pair<fs::path, std::future<StoredMedia>>> early_media;
+  // URLs of finished early_media uploads (see discard_early_media)
+  std::vector<std::string> early_urls;
+  bool committed = false; // the article's rows are in the database
+};
 
-    // Insert new content block
-    const char *insert_cb_sql =
-        "INSERT INTO content_blocks (title, url_slug, type_id, site_id, "
-        "language, status) VALUES (?, ?, ?, ?, ?, ?);";
-
-    if (sqlite3_prepare_v2(db, insert_cb_sql, -1, &stmt, nullptr) !=
-        SQLITE_OK) {
-      log_to_file("SQL prepare error: " + std::string(sqlite3_errmsg(db)));
-      sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-      sqlite3_close(db);
-      return false;
-    }
+// Cheap checks that need no uploads: required files and metadata. The one
+// directory walk of the publish happens here.
+bool validate_article(ArticleJob &job) {
+  // Validate metadata.txt exists
+  fs::path meta_file = fs::path(job.path) / "metadata.txt";
+  if (!job.manifest.scan(job.path) || !job.manifest.find("metadata.txt")) {
+    log_to_file("Metadata file not found at: " + meta_file.string());
+    return job.fail(400, "Missing metadata.txt at path: " + job.path);
+  }
 
-    sqlite3_bind_text(stmt, 1, title.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, slug.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 3, type_id.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 4, site_id.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 5, lang.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 6, status.c_str(), -1, SQLITE_STATIC);
-
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
-      log_to_file("SQL execution error: " + std::string(sqlite3_errmsg(db)));
-      sqlite3_finalize(stmt);
-      sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-      sqlite3_close(db);
-      return false;
-    }
+  // ✅ Validate required article file: index.html only
+  if (!job.manifest.find("index.html")) {
+    log_to_file("Missing index.html at: " + job.path + "/index.html");
+    return job.fail(400, "Article is missing required file: index.html");
+  }
 
-    sqlite3_finalize(stmt);
-
-    content_id = (int)sqlite3_last_insert_rowid(db);
-    log_to_file("Created content with new ID: " + std::to_string(content_id));
-
-    // tag processing
-    while (std::getline(tags_stream, tag, ',')) {
-      tag.erase(0, tag.find_first_not_of(" \t"));
-      tag.erase(tag.find_last_not_of(" \t") + 1);
-      const char *insert_tag_sql =
-          "INSERT OR IGNORE INTO tags (name) VALUES (?)";
-      if (sqlite3_prepare_v2(db, insert_tag_sql, -1, &stmt, nullptr) !=
-          SQLITE_OK) {
-        log_to_file("SQL prepare error: " + std::string(sqlite3_errmsg(db)));
-        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-        sqlite3_close(db);
-        return false;
-      }
-      sqlite3_bind_text(stmt, 1, tag.c_str(), -1, SQLITE_STATIC);
-      sqlite3_step(stmt);
-      sqlite3_finalize(stmt);
-
-      const char *insert_tags_sql = "INSERT INTO content_tags (content_id, "
-                                    "tag_id) SELECT ?, id FROM tags "
-                                    "WHERE name = ?";
-      if (sqlite3_prepare_v2(db, insert_tags_sql, -1, &stmt, nullptr) !=
-          SQLITE_OK) {
-        log_to_file("SQL prepare error: " + std::string(sqlite3_errmsg(db)));
-        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-        sqlite3_close(db);
-        return false;
+  // Proceed with metadata parsing
+  job.metadata = parse_metadata(
+      meta_file, {"title", "slug", "language", "status", "tags", "type_id"});
+  if (job.metadata.empty()) {
+    log_to_file("Not enough metadata for article at " + job.path);
+    return job.fail(500, "Metadata fetching failed");
+  }
+  return true;
+}
+
+// Slow work: uploads and staging, no database writes yet
+bool prepare_article_files(ArticleJob &job) {
+  for (auto &[file, upload] : job.early_media) {
+    try {
+      StoredMedia media = upload.get();
+      if (!media.url.empty())
+        job.early_urls.push_back(media.url);
+      const auto *entry = job.manifest.find(
+          file.lexically_relative(job.manifest.root).generic_string());
+      if (!media.url.empty() && entry &&
+          entry->category == ContentManifest::Category::Media) {
+        job.uploads.media_url_map[entry->rel] = media.url;
+        job.uploads.media_bytes_saved += media.bytes_saved;
       }
-      sqlite3_bind_int(stmt, 1, content_id);
-      sqlite3_bind_text(stmt, 2, tag.c_str(), -1, SQLITE_STATIC);
-      sqlite3_step(stmt);
-      sqlite3_finalize(stmt);
+    } catch (const std::exception &e) {
+      // Uploaded again below
+      log_to_file("Early media upload failed: " + std::string(e.what()));
     }
+  }
+  job.early_media.clear();
 
-    // Commit the transaction
-    if (sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr) != SQLITE_OK) {
-      log_to_file("Failed to commit transaction: " +
-                  std::string(sqlite3_errmsg(db)));
-      sqlite3_close(db);
-      return false;
-    }
+  if (!process_thumbnail(job.manifest, job.uploads)) {
+    log_to_file("Thumbnail processing failed for article at: " + job.path);
+    return job.fail(500, "Thumbnail processing failed");
   }
 
-  sqlite3_close(db);
+  if (!upload_article_media(job.manifest, job.uploads) ||
+      !stage_article_files(job.manifest, job.uploads)) {
+    log_to_file("File storage failed for article at: " + job.path);
+    if (!job.uploads.staging_dir.empty())
+      fs::remove_all(job.uploads.staging_dir);
+    return job.fail(500, "File storage failed");
+  }
+  job.media_bytes_saved = job.uploads.media_bytes_saved;
+  log_to_file("Media for " + job.path + " stored " +
+              std::to_string(job.media_bytes_saved) +
+              " bytes smaller than its source files");
+
+  job.search_doc = article_search_document(job.path, job.metadata);
   return true;
 }
 
-bool process_thumbnail(const fs::path &article_dir, int content_id) {
-  fs::path thumbnail_dir = article_dir / "thumbnail";
-  if (!fs::exists(thumbnail_dir)) {
-    log_to_file("No thumbnail directory found");
-    return false; // Optional feature
+// Every DB mutation of the article, applied as one write batch
+WriteBatch article_write_batch(ArticleJob &job) {
+  return [&job](WriteTxn &txn) {
+    return apply_article_writes(txn, job.metadata, job.uploads,
+                                job.content_id) &&
+           index_search_document(txn, job.content_id, job.search_doc) &&
+           related_index().update(txn, job.content_id);
+  };
+}
+
+// Installs the staged files once the rows are committed
+bool finish_article(ArticleJob &job, const WriteResult &result) {
+  if (!result.ok) {
+    log_to_file("Database update failed for article at: " + job.path + ": " +
+                result.error);
+    fs::remove_all(job.uploads.staging_dir);
+    return job.fail(500, "Database update failed");
   }
-  // Find single image in thumbnail folder
-  std::string image_file;
-  for (const auto &entry : fs::directory_iterator(thumbnail_dir)) {
-    std::string ext = entry.path().extension().string();
-    if (IMAGE_EXTENSIONS.count(ext)) {
-      image_file = entry.path().string();
+  job.committed = true;
+
+  if (!install_article_files(job.uploads, job.content_id)) {
+    log_to_file("File storage failed for article at: " + job.path);
+    return job.fail(500, "File storage failed");
+  }
+
+  // 🧹 Clean up /tmp/ folder if article_dir was a temp upload
+  if (job.path.rfind("/tmp/", 0) == 0) {
+    std::error_code ec;
+    fs::remove_all(job.path, ec);
+    if (ec) {
+      log_to_file("⚠️ Failed to clean up temp folder: " + job.path);
+    } else {
+      log_to_file("🧹 Cleaned up temp folder: " + job.path);
     }
   }
 
-  if (image_file.empty()) {
-    log_to_file("No valid images in thumbnail directory");
-    return false; // No thumbnail
+  log_to_file("Article published successfully with ID: " +
+              std::to_string(job.content_id));
+  job.status = 200;
+  job.message = "Article published with ID: " + std::to_string(job.content_id);
+  return true;
+}
+
+bool publish_article(ArticleJob &job) {
+  // The job may have waited for its upload; the deadline covers the publish
+  job.deadline = request_deadline();
+  DeadlineScope scope(job.deadline);
+  if (!validate_article(job) || !prepare_article_files(job))
+    return false;
+  // Then every DB mutation in one short transaction
+  WriteResult result = write_sync(article_write_batch(job));
+  return finish_article(job, result);
+}
+
+double ms_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+struct BatchReport {
+  std::vector<PublishOutcome> results;
+  double validate_ms = 0;
+  double prepare_ms = 0; // wall time of the parallel upload phase
+  double commit_ms = 0;  // wall time until every write committed and finished
+};
+
+// Runs many publishes: all jobs are validated before any upload starts, the
+// uploads run on `workers` threads, and each job's write batch is queued as
+// soon as its files are ready so the DB writer folds them into large group
+// commits.
+template <typename Job, typename Validate, typename Prepare, typename Batch,
+          typename Finish>
+BatchReport run_batch(std::vector<Job> &jobs, size_t workers,
+                      Validate validate, Prepare prepare, Batch write_batch,
+                      Finish finish) {
+  BatchReport report;
+  auto phase = std::chrono::steady_clock::now();
+  std::vector<size_t> valid;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    if (validate(jobs[i]))
+      valid.push_back(i);
   }
-  // Upload to GCS
-  std::string uuid = generate_uuid();
-  std::string ext = fs::path(image_file).extension().string();
-  std::string gcs_key = "images/thumbnails/" + uuid + ext;
-  std::string tmp_path = "/tmp/" + uuid + ext;
+  report.validate_ms = ms_since(phase);
+  log_to_file("Batch publish: " + std::to_string(valid.size()) + "/" +
+              std::to_string(jobs.size()) + " items passed validation");
+
+  phase = std::chrono::steady_clock::now();
+  std::vector<std::future<WriteResult>> writes(jobs.size());
+  std::atomic<size_t> next{0};
+  std::vector<std::thread> pool;
+  for (size_t w = 0; w < std::max<size_t>(1, std::min(workers, valid.size()));
+       ++w) {
+    pool.emplace_back([&] {
+      for (size_t n = next++; n < valid.size(); n = next++) {
+        Job &job = jobs[valid[n]];
+        // Each job gets a full deadline from when a worker picks it up, not
+        // from when the batch was read
+        job.deadline = request_deadline();
+        DeadlineScope scope(job.deadline);
+        auto started = std::chrono::steady_clock::now();
+        bool prepared = prepare(job);
+        job.prepare_ms = ms_since(started);
+        if (prepared)
+          writes[valid[n]] = db_writer().submit(write_batch(job));
+      }
+    });
+  }
+  for (auto &thread : pool)
+    thread.join();
+  report.prepare_ms = ms_since(phase);
+
+  phase = std::chrono::steady_clock::now();
+  for (size_t i : valid) {
+    if (writes[i].valid())
+      finish(jobs[i], writes[i].get());
+  }
+  report.commit_ms = ms_since(phase);
 
-  fs::copy_file(image_file, tmp_path);
-  std::string cmd = "gsutil cp \"" + tmp_path + "\" gs://" + GCS_PUBLIC_BUCKET +
-                    "/" + gcs_key;
-  exec_command(cmd);
-  fs::remove(tmp_path);
+  report.results.assign(jobs.begin(), jobs.end());
+  return report;
+}
 
-  std::string gcs_url = GCS_PUBLIC_URL + GCS_PUBLIC_BUCKET + "/" + gcs_key;
+BatchReport publish_articles(const std::vector<std::string> &paths,
+                             size_t workers) {
+  std::vector<ArticleJob> jobs(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i)
+    jobs[i].path = paths[i];
+  return run_batch(jobs, workers, validate_article, prepare_article_files,
+                   article_write_batch, finish_article);
+}
 
-  // Update content_blocks with thumbnail_url
-  sqlite3 *db;
-  sqlite3_open(DB_PATH.c_str(), &db);
-  sqlite3_stmt *stmt;
-  const char *sql = "UPDATE content_blocks SET thumbnail_url = ? WHERE id = ?";
-  sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
-  sqlite3_bind_text(stmt, 1, gcs_url.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 2, content_id);
-  sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
-
-  // Insert into images table
-  const char *img_sql =
-      "INSERT INTO images (original_url, filename, mime_type, content_id, "
-      "image_type, processing_status) VALUES (?, ?, ?, ?, "
-      "'thumbnail', 'complete')";
-  sqlite3_prepare_v2(db, img_sql, -1, &stmt, nullptr);
-  sqlite3_bind_text(stmt, 1, gcs_url.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 2, (uuid + ext).c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 3, ("image/" + ext.substr(1)).c_str(), -1,
-                    SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 4, content_id);
-  sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
-  sqlite3_close(db);
+// Summary shared by /publish/batch and the CLI
+std::string batch_report_json(const std::string &command, size_t workers,
+                              const BatchReport &report) {
+  std::string results;
+  size_t succeeded = 0;
+  for (const auto &item : report.results) {
+    if (item.status == 200)
+      ++succeeded;
+    if (!results.empty())
+      results += ",";
+    results +=
+        "{\"path\":" + json_string(item.path) +
+        ",\"status\":" + std::to_string(item.status) + ",\"content_id\":" +
+        (item.status == 200 ? std::to_string(item.content_id) : "null") +
+        ",\"message\":" + json_string(item.message) +
+        ",\"prepare_ms\":" + json_ms(item.prepare_ms) +
+        ",\"media_bytes_saved\":" + std::to_string(item.media_bytes_saved) +
+        "}";
+  }
+  return "{\"command\":" + json_string(command) +
+         ",\"jobs\":" + std::to_string(workers) +
+         ",\"succeeded\":" + std::to_string(succeeded) +
+         ",\"failed\":" + std::to_string(report.results.size() - succeeded) +
+         ",\"timings_ms\":{\"validate\":" + json_ms(report.validate_ms) +
+         ",\"prepare\":" + json_ms(report.prepare_ms) +
+         ",\"commit\":" + json_ms(report.commit_ms) + ",\"total\":" +
+         json_ms(report.validate_ms + report.prepare_ms + report.commit_ms) +
+         "},\"results\":[" + results + "]}";
+}
+
+// Unpacks a streamed archive body into a private directory under /tmp and
+// points `path` at the directory to publish. on_file sees each unpacked
+// file (relative to upload_dir) as soon as it is complete. The caller
+// removes upload_dir, also after a failure.
+bool receive_upload(const HttpRequest &req, HttpResponse &res,
+                    fs::path &upload_dir, std::string &path,
+                    const std::function<void(const fs::path &)> &on_file) {
+  unsigned long long max_bytes = (unsigned long long)std::max(
+      1LL, env_or("PUBLISHER_MAX_UPLOAD_BYTES", 2LL * 1024 * 1024 * 1024));
+  if (req.header("Content-Length").empty()) {
+    res.send(411, "Archive uploads need a Content-Length");
+    return false;
+  }
+  if (std::strtoull(req.header("Content-Length").c_str(), nullptr, 10) >
+      max_bytes) {
+    res.send(413, "Archive exceeds " + std::to_string(max_bytes) + " bytes");
+    return false;
+  }
 
+  upload_dir = fs::path("/tmp") / ("publish-upload-" + generate_uuid());
+  std::error_code ec;
+  fs::create_directory(upload_dir, ec);
+  if (!ec)
+    fs::permissions(upload_dir, fs::perms::owner_all, ec);
+  if (ec) {
+    log_to_file("Cannot create upload directory " + upload_dir.string() +
+                ": " + ec.message());
+    res.send(500, "Cannot store upload");
+    return false;
+  }
+
+  std::string error;
+  if (!extract_archive(req.read_body, upload_dir, max_bytes, on_file,
+                       error)) {
+    log_to_file("Archive upload rejected: " + error);
+    res.send(400, error);
+    return false;
+  }
+  path = archive_root(upload_dir).string();
+  log_to_file("Unpacked archive upload into " + path);
   return true;
 }
 
+// Starts uploading an unpacked media/ file while later archive entries are
+// still arriving, when one of the process-wide media slots is free; other
+// files are uploaded by prepare_article_files as usual.
+void start_early_media_upload(ArticleJob &job, const fs::path &file) {
+  // The archive root is not known yet; anything below a media/ directory
+  // qualifies and prepare_article_files() drops what falls outside it
+  const fs::path parent = file.parent_path();
+  if (std::find(parent.begin(), parent.end(), "media") == parent.end())
+    return;
+  if (!media_slots().try_acquire())
+    return;
+  job.early_media.emplace_back(
+      file, std::async(std::launch::async, [file, deadline = job.deadline] {
+        DeadlineScope scope(deadline);
+        MediaSlotGuard slot; // also when the upload throws
+        return upload_media_file(file);
+      }));
+}
+
+// Waits for the early uploads still running, then deletes the ones nothing
+// points at: all of them unless the article's rows were committed, and
+// otherwise those that fell outside its media/ directory
+void discard_early_media(ArticleJob &job) {
+  for (auto &[file, upload] : job.early_media) {
+    try {
+      StoredMedia media = upload.get();
+      if (!media.url.empty())
+        job.early_urls.push_back(media.url);
+    } catch (const std::exception &) {
+      // Nothing was stored
+    }
+  }
+  job.early_media.clear();
+
+  std::unordered_set<std::string> referenced;
+  if (job.committed) {
+    for (const auto &entry : job.uploads.media_url_map)
+      referenced.insert(entry.second);
+  }
+  std::vector<std::string> unused;
+  for (const auto &url : job.early_urls) {
+    if (!referenced.count(url))
+      unused.push_back(url);
+  }
+  remove_public_objects(unused);
+}
+
+void remove_upload(const fs::path &upload_dir) {
+  std::error_code ec;
+  if (!upload_dir.empty())
+    fs::remove_all(upload_dir, ec);
+}
+
 void handle_publish_request(const HttpRequest &req, HttpResponse &res) {
   log_to_file("Received publish request");
 
-  std::string article_path;
+  ArticleJob job;
 
   // Log headers for debugging
   log_to_file("Request headers:");
@@ -586,14 +1004,29 @@ void handle_publish_request(const HttpRequest &req, HttpResponse &res) {
     log_to_file("[Query] " + pair.first + ": " + pair.second);
   }
 
+  // Archive uploads are unpacked first, then published from /tmp
+  if (req.read_body) {
+    fs::path upload_dir;
+    if (receive_upload(req, res, upload_dir, job.path,
+                       [&](const fs::path &rel) {
+                         start_early_media_upload(job, upload_dir / rel);
+                       })) {
+      publish_article(job);
+      res.send(job.status, job.message);
+    }
+    discard_early_media(job); // waits for uploads still reading the files
+    remove_upload(upload_dir);
+    return;
+  }
+
   // Determine article path
   auto it = req.query_params.find("path");
   if (it != req.query_params.end()) {
-    article_path = it->second;
-    log_to_file("Using path from query parameter: " + article_path);
+    job.path = it->second;
+    log_to_file("Using path from query parameter: " + job.path);
   } else if (!req.body.empty()) {
-    article_path = req.body;
-    log_to_file("Using path from request body: " + article_path);
+    job.path = req.body;
+    log_to_file("Using path from request body: " + job.path);
   } else {
     log_to_file("No path provided in query parameters or request body");
     res.send(400, "Missing path parameter. Provide it either as a query "
@@ -601,146 +1034,123 @@ void handle_publish_request(const HttpRequest &req, HttpResponse &res) {
     return;
   }
 
-  // Validate metadata.txt exists
-  fs::path meta_file = fs::path(article_path) / "metadata.txt";
-  if (!fs::exists(meta_file)) {
-    log_to_file("Metadata file not found at: " + meta_file.string());
-    res.send(400, "Missing metadata.txt at path: " + article_path);
-    return;
-  }
-
-  // ✅ Validate required article file: index.html only
-  fs::path index_file = fs::path(article_path) / "index.html";
-  if (!fs::exists(index_file)) {
-    log_to_file("Missing index.html at: " + index_file.string());
-    res.send(400, "Article is missing required file: index.html");
-    return;
-  }
-
-  // Proceed with metadata parsing and database update
-  auto metadata = parse_metadata(
-      meta_file, {"title", "slug", "language", "status", "tags", "type_id"});
-  if (metadata.empty()) {
-    log_to_file("Not enough metadata for article at " + article_path);
-    res.send(500, "Metadata fetching failed");
-    return;
-  }
-  int content_id = -1;
-
-  if (!update_article_metadata(metadata, content_id)) {
-    log_to_file("Database update failed for article at: " + article_path);
-    res.send(500, "Database update failed");
-    return;
-  }
+  publish_article(job);
+  res.send(job.status, job.message);
+}
 
-  if (!process_thumbnail(article_path, content_id)) {
-    log_to_file("Thumbnail processing failed for article at: " + article_path);
-    res.send(500, "Thumbnail processing failed");
-    return;
+// Article directories, one per line
+std::vector<std::string> parse_path_list(const std::string &text) {
+  std::vector<std::string> paths;
+  std::istringstream in(text);
+  std::string line;
+  while (std::getline(in, line)) {
+    line.erase(0, line.find_first_not_of(" \t"));
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    if (!line.empty())
+      paths.push_back(line);
   }
+  return paths;
+}
 
-  if (!store_article_files(article_path, content_id)) {
-    log_to_file("File storage failed for article at: " + article_path);
-    res.send(500, "File storage failed");
+// POST /publish/batch with one article directory per line in the body
+void handle_publish_batch_request(const HttpRequest &req, HttpResponse &res) {
+  std::vector<std::string> paths = parse_path_list(req.body);
+  long long workers = env_or("PUBLISHER_BATCH_JOBS", 4LL);
+  if (paths.empty() || (!req.param("jobs").empty() &&
+                        !parse_id(req.param("jobs"), workers))) {
+    res.send(400, "Expected one article path per line in the request body");
     return;
   }
+  log_to_file("Received batch publish request for " +
+              std::to_string(paths.size()) + " articles");
 
-  log_to_file("Article published successfully with ID: " +
-              std::to_string(content_id));
-  res.send(200, "Article published with ID: " + std::to_string(content_id));
+  size_t pool_size = (size_t)std::max(1LL, workers);
+  BatchReport report = publish_articles(paths, pool_size);
+  res.content_type = "application/json";
+  res.send(200, batch_report_json("publish", pool_size, report));
 }
 
-bool validate_sochee_structure(const std::string &sochee_path) {
-  fs::path media_dir = fs::path(sochee_path) / "media";
-  fs::path metadata_file = fs::path(sochee_path) / "metadata.txt";
-
+bool validate_sochee_structure(const ContentManifest &manifest) {
   // Check required components
-  if (!fs::exists(media_dir) || !fs::exists(metadata_file))
+  if (!manifest.has_dir("media") || !manifest.find("metadata.txt"))
     return false;
 
   // Count images in media folder
   int image_count = 0;
-  for (const auto &entry : fs::directory_iterator(media_dir)) {
-    std::string ext = entry.path().extension().string();
-    if (IMAGE_EXTENSIONS.count(ext))
+  for (const auto *entry : manifest.files_in("media")) {
+    if (IMAGE_EXTENSIONS.count(entry->ext))
       image_count++;
   }
 
   return image_count >= 1;
 }
 
-ImageDimensions get_image_dimensions(const std::string &image_path) {
-  std::string cmd = "identify -format \"%w %h\" \"" + image_path + "\"";
-  std::string result = exec_command(cmd);
-
-  std::istringstream iss(result);
-  ImageDimensions dims;
-  iss >> dims.width >> dims.height;
-  return dims;
-}
-
-ImageDimensions
-find_smallest_dimensions(const std::vector<std::string> &image_paths) {
-  if (image_paths.empty())
+ImageDimensions find_smallest_dimensions(
+    ContentManifest &manifest,
+    const std::vector<const ContentManifest::Entry *> &images) {
+  if (images.empty())
     return {0, 0};
 
   // Initialize with first image dimensions instead of INT_MAX
-  ImageDimensions smallest = get_image_dimensions(image_paths[0]);
+  std::vector<ImageDimensions> dims = manifest.image_dimensions(images);
+  ImageDimensions smallest = dims[0];
 
   // Compare with remaining images
-  for (int i = 1; i < image_paths.size(); i++) {
-    ImageDimensions dims = get_image_dimensions(image_paths[i]);
-    if (dims.width * dims.height < smallest.width * smallest.height) {
-      smallest = dims;
+  for (size_t i = 1; i < dims.size(); i++) {
+    if (dims[i].width * dims[i].height < smallest.width * smallest.height) {
+      smallest = dims[i];
     }
   }
   return smallest;
 }
 
-bool process_sochee_image(const std::string &input_path,
-                          const std::string &output_path,
-                          const ImageDimensions &target_dims) {
-  // Step 1: Resize to target dimensions
-  std::string resize_cmd = "convert \"" + input_path + "\" -resize " +
-                           std::to_string(target_dims.width) + "x" +
-                           std::to_string(target_dims.height) + "! \"" +
-                           output_path + "\"";
-
-  if (exec_command(resize_cmd).find("Error") != std::string::npos) {
-    log_to_file("Failed to convert image " + input_path);
-    return false;
-  }
-
-  // Step 2: Crop to square (using smaller dimension)
+// Resizes to the target dimensions, then crops the centre square
+ImageOp sochee_image_op(const std::string &input_path,
+                        const std::string &output_path,
+                        const ImageDimensions &target_dims) {
   int square_size = std::min(target_dims.width, target_dims.height);
-  std::string crop_cmd =
-      "convert \"" + output_path + "\" -gravity center -crop " +
-      std::to_string(square_size) + "x" + std::to_string(square_size) +
-      "+0+0 \"" + output_path + "\"";
-
-  if (exec_command(crop_cmd).find("Error") != std::string::npos) {
-    log_to_file("Failed image to a square " + input_path);
-    return false;
-  }
-  return true;
+  return {input_path,
+          {"-resize",
+           std::to_string(target_dims.width) + "x" +
+               std::to_string(target_dims.height) + "!",
+           "-gravity", "center", "-crop",
+           std::to_string(square_size) + "x" + std::to_string(square_size) +
+               "+0+0"},
+          output_path};
 }
 
-bool process_sochee_images(
-    const std::string &sochee_path, int content_id,
-    const std::unordered_map<std::string, std::string> &metadata) {
-  fs::path media_dir = fs::path(sochee_path) / "media";
+// Uploaded sochee media, applied to the database by apply_sochee_writes()
+struct SocheeUploads {
+  struct Image {
+    std::string url;
+    std::string filename;
+    std::string mime_type;
+    // Known for carousel images only
+    ImageDimensions dims;
+    long long bytes = 0;
+    ImagePlaceholder placeholder;
+  };
+  std::vector<Image> images;
+  std::string thumb_url;
+  bool has_link = false;
+  Image link_image;
+  std::string link_url;
+  std::string link_name;
+};
 
+bool process_sochee_images(
+    ContentManifest &manifest,
+    const std::unordered_map<std::string, std::string> &metadata,
+    SocheeUploads &uploads) {
   // Build ordered list from metadata ("1", "2", "3" keys)
-  std::vector<std::string> ordered_images;
+  std::vector<const ContentManifest::Entry *> ordered_images;
   for (int i = 1;; i++) {
     std::string key = std::to_string(i);
     if (metadata.find(key) == metadata.end())
       break;
 
-    std::string filename = metadata.at(key);
-    fs::path full_path = media_dir / filename;
-    if (fs::exists(full_path)) {
-      ordered_images.push_back(full_path.string());
+    if (const auto *entry = manifest.find("media/" + metadata.at(key))) {
+      ordered_images.push_back(entry);
     }
   }
 
@@ -750,133 +1160,104 @@ bool process_sochee_images(
     return false;
   }
   // Find target dimensions
-  ImageDimensions target_dims = find_smallest_dimensions(ordered_images);
-
-  // Open database
-  sqlite3 *db;
-  if (sqlite3_open(DB_PATH.c_str(), &db) != SQLITE_OK) {
-    log_to_file("Failed to open database at " + DB_PATH + ": " +
-                std::string(sqlite3_errmsg(db)));
-    sqlite3_close(db);
-    return false;
+  ImageDimensions target_dims =
+      find_smallest_dimensions(manifest, ordered_images);
+
+  // The thumbnail is the first image scaled down to PUBLISHER_THUMBNAIL_PX.
+  // When the carousel images are no larger, the bucket copies the first
+  // one instead of receiving the same bytes twice.
+  long long thumb_px = std::max(1LL, env_or("PUBLISHER_THUMBNAIL_PX", 400LL));
+  bool downsize_thumb =
+      std::min(target_dims.width, target_dims.height) > thumb_px;
+  std::string thumb_uuid = generate_uuid();
+  std::string thumb_path = "/tmp/" + thumb_uuid + ordered_images[0]->ext;
+
+  // All images go to ImageMagick as one batch, each also writing the
+  // sample its placeholder is computed from
+  std::vector<std::string> uuids, processed_paths;
+  std::vector<ImageOp> ops;
+  for (const auto *image : ordered_images) {
+    uuids.push_back(generate_uuid());
+    processed_paths.push_back("/tmp/" + uuids.back() + image->ext);
+    ops.push_back(sochee_image_op(image->path.string(),
+                                  processed_paths.back(), target_dims));
+    std::vector<std::string> sample =
+        placeholder_sample_options("/tmp/" + uuids.back() + ".rgb");
+    ops.back().options.insert(ops.back().options.end(), sample.begin(),
+                              sample.end());
   }
-  // Begin transaction
-  if (sqlite3_exec(db, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr) !=
-      SQLITE_OK) {
-    log_to_file("Failed to begin transaction: " +
-                std::string(sqlite3_errmsg(db)));
-    sqlite3_close(db);
-    return false;
+  if (downsize_thumb) {
+    // Same crop as the first carousel image, without its placeholder sample
+    ImageOp thumb = sochee_image_op(ordered_images[0]->path.string(),
+                                    thumb_path, target_dims);
+    std::string size = std::to_string(thumb_px) + "x" + std::to_string(thumb_px);
+    thumb.options.insert(thumb.options.end(), {"+repage", "-thumbnail", size});
+    ops.push_back(thumb);
+    processed_paths.push_back(thumb_path);
   }
-
-  for (int i = 0; i < ordered_images.size(); i++) {
-    std::string uuid = generate_uuid();
-    std::string ext = fs::path(ordered_images[i]).extension().string();
-    std::string processed_path = "/tmp/" + uuid + ext;
-
-    // Process image (resize + crop)
-    if (!process_sochee_image(ordered_images[i], processed_path, target_dims)) {
-      log_to_file("Failed to process image " + std::to_string(i));
+  std::vector<CallResult> processed = run_image_ops(ops);
+  auto remove_processed = [&] {
+    for (const auto &path : processed_paths)
+      fs::remove(path);
+    for (const auto &uuid : uuids)
+      fs::remove("/tmp/" + uuid + ".rgb");
+  };
+  for (size_t i = 0; i < processed.size(); i++) {
+    if (!processed[i]) {
+      log_to_file("Failed to process image " + std::to_string(i) + ": " +
+                  processed[i].error);
+      remove_processed();
       return false;
     }
+  }
 
-    // Upload to GCS sochee folder
-    std::string gcs_key = "images/sochee/" + uuid + ext;
-    std::string cmd = "gsutil cp \"" + processed_path + "\" gs://" +
-                      GCS_PUBLIC_BUCKET + "/" + gcs_key;
-    exec_command(cmd);
-    std::string gcs_url = GCS_PUBLIC_URL + GCS_PUBLIC_BUCKET + "/" + gcs_key;
+  for (size_t i = 0; i < ordered_images.size(); i++) {
+    const std::string &uuid = uuids[i];
+    std::string ext = ordered_images[i]->ext;
 
-    // Insert into images table
-    sqlite3_stmt *stmt;
-    const char *insert_image_record =
-        "INSERT INTO images (original_url, filename, mime_type, content_id, "
-        "image_type, processing_status) VALUES (?, ?, ?, ?, ?, 'complete')";
-    if (sqlite3_prepare_v2(db, insert_image_record, -1, &stmt, nullptr) !=
-        SQLITE_OK) {
-      log_to_file("SQL prepare error: " + std::string(sqlite3_errmsg(db)));
-      sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-      sqlite3_close(db);
-      return false;
-    };
-    sqlite3_bind_text(stmt, 1, gcs_url.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, (uuid + ext).c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 3, ("image/" + ext).c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_int(stmt, 4, content_id);
-    sqlite3_bind_text(stmt, 5, "content", -1, SQLITE_STATIC);
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
-      log_to_file("SQL execution error: " + std::string(sqlite3_errmsg(db)));
-      sqlite3_finalize(stmt);
-      sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-      sqlite3_close(db);
-      return false;
-    }
-    sqlite3_finalize(stmt);
-    int image_id = (int)sqlite3_last_insert_rowid(db);
+    SocheeUploads::Image image;
+    image.filename = uuid + ext;
+    image.mime_type = "image/" + ext.substr(1);
+    std::istringstream(processed[i].value) >> image.dims.width >>
+        image.dims.height;
+    image.bytes = (long long)fs::file_size(processed_paths[i]);
+    image.placeholder = placeholder_from_sample(
+        "/tmp/" + uuid + ".rgb", image.dims.width, image.dims.height);
 
-    // Insert into sochee_order table
-    const char *insert_image_order = "INSERT INTO sochee_order (id, sochee_id, "
-                                     "photo_order) VALUES (?, ?, ?)";
-    if (sqlite3_prepare_v2(db, insert_image_order, -1, &stmt, nullptr) !=
-        SQLITE_OK) {
-      log_to_file("SQL prepare error: " + std::string(sqlite3_errmsg(db)));
-      sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-      sqlite3_close(db);
-      return false;
-    }
-    sqlite3_bind_int(stmt, 1, image_id);
-    sqlite3_bind_int(stmt, 2, content_id);
-    sqlite3_bind_int(stmt, 3, i + 1);
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
-      log_to_file("SQL execution error: " + std::string(sqlite3_errmsg(db)));
-      sqlite3_finalize(stmt);
-      sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-      sqlite3_close(db);
-      return false;
-    }
-    sqlite3_finalize(stmt);
+    // Upload to GCS sochee folder
+    CallResult upload =
+        upload_public_file(processed_paths[i], "images/sochee/" + uuid + ext);
+    image.url = upload.value;
+    uploads.images.push_back(image);
 
     // Handle first image as thumbnail
-    if (i == 0) {
-      std::string thumb_uuid = generate_uuid();
+    if (upload && i == 0) {
       std::string thumb_key = "images/thumbnails/" + thumb_uuid + ext;
-      std::string thumb_cmd = "gsutil cp \"" + processed_path + "\" gs://" +
-                              GCS_PUBLIC_BUCKET + "/" + thumb_key;
-      exec_command(thumb_cmd);
-      std::string thumb_url =
-          GCS_PUBLIC_URL + GCS_PUBLIC_BUCKET + "/" + thumb_key;
-
-      // Update content_blocks with thumbnail_url
-      const char *update_thumbnail_sql =
-          "UPDATE content_blocks SET thumbnail_url = ? WHERE id = ?";
-      if (sqlite3_prepare_v2(db, update_thumbnail_sql, -1, &stmt, nullptr)) {
-        log_to_file("SQL prepare error: " + std::string(sqlite3_errmsg(db)));
-        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-        sqlite3_close(db);
-        return false;
-      }
-      sqlite3_bind_text(stmt, 1, thumb_url.c_str(), -1, SQLITE_STATIC);
-      sqlite3_bind_int(stmt, 2, content_id);
-      if (sqlite3_step(stmt) != SQLITE_DONE) {
-        log_to_file("SQL execution error: " + std::string(sqlite3_errmsg(db)));
-        sqlite3_finalize(stmt);
-        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-        sqlite3_close(db);
-        return false;
-      }
-      sqlite3_finalize(stmt);
+      upload = downsize_thumb
+                   ? upload_public_file(thumb_path, thumb_key)
+                   : copy_public_object("images/sochee/" + uuid + ext,
+                                        thumb_key);
+      uploads.thumb_url = upload.value;
     }
 
-    fs::remove(processed_path);
+    if (!upload) {
+      log_to_file("Sochee image upload failed: " + upload.error);
+      remove_processed();
+      return false;
+    }
   }
 
-  sqlite3_close(db);
+  remove_processed();
   return true;
 }
 
+// Creates the sochee's content_blocks and sochee rows. A sochee published
+// again under the same slug, site and type (e.g. a drop folder edited after
+// its first publish) keeps its ID and counters; its images, carousel order
+// and link rows are dropped for apply_sochee_writes() to insert anew.
 bool create_sochee_content_block(
-    const std::unordered_map<std::string, std::string> &metadata,
-    int &content_id, const std::string &sochee_path) {
+    WriteTxn &txn, const std::unordered_map<std::string, std::string> &metadata,
+    int &content_id, bool has_link) {
   // Validate required fields
   if (metadata.find("location") == metadata.end() ||
       metadata.find("caption") == metadata.end() ||
@@ -885,55 +1266,38 @@ bool create_sochee_content_block(
     return false;
   }
 
-  sqlite3 *db;
-  if (sqlite3_open(DB_PATH.c_str(), &db) != SQLITE_OK) {
-    log_to_file("Failed to open database at " + DB_PATH + ": " +
-                std::string(sqlite3_errmsg(db)));
-    sqlite3_close(db);
-    return false;
-  }
-  // Begin transaction
-  if (sqlite3_exec(db, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr) !=
-      SQLITE_OK) {
-    log_to_file("Failed to begin transaction: " +
-                std::string(sqlite3_errmsg(db)));
-    sqlite3_close(db);
-    return false;
-  }
-
-  // Create content_blocks entry
-  sqlite3_stmt *stmt;
-  const char *cb_sql = "INSERT INTO content_blocks (title, url_slug, type_id, "
-                       "status, language, site_id) "
-                       "VALUES (?, ?, ?, 'published', ?, ?)";
-
   std::string title = metadata.at("title");
   std::string slug = metadata.at("slug");
   std::string type_id = metadata.at("type_id");
   std::string lang = metadata.at("language");
   std::string site_id = metadata.at("site_id");
 
-  if (sqlite3_prepare_v2(db, cb_sql, -1, &stmt, nullptr)) {
-    log_to_file("SQL prepare error: " + std::string(sqlite3_errmsg(db)));
-    sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-    sqlite3_close(db);
-    return false;
-  }
-  sqlite3_bind_text(stmt, 1, title.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 2, slug.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 3, type_id.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 4, lang.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 5, site_id.c_str(), -1, SQLITE_STATIC);
-
-  if (sqlite3_step(stmt) != SQLITE_DONE) {
-    sqlite3_finalize(stmt);
-    sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-    sqlite3_close(db);
+  long long existing_id = -1;
+  bool found = false;
+  if (!txn.query_int("SELECT id FROM content_blocks WHERE url_slug = ? "
+                     "AND site_id = ? AND type_id = ?",
+                     {slug, site_id, type_id}, existing_id, found))
     return false;
+  if (found) {
+    content_id = (int)existing_id;
+    log_to_file("Replacing sochee with ID: " + std::to_string(content_id));
+    if (!txn.exec("UPDATE content_blocks SET title = ?, language = ?, "
+                  "status = 'published' WHERE id = ?",
+                  {title, lang, existing_id}) ||
+        !txn.exec("DELETE FROM sochee_order WHERE sochee_id = ?",
+                  {existing_id}) ||
+        !txn.exec("DELETE FROM sochee_link WHERE id = ?", {existing_id}) ||
+        !txn.exec("DELETE FROM images WHERE content_id = ?", {existing_id}))
+      return false;
+  } else {
+    // Create content_blocks entry
+    if (!txn.exec("INSERT INTO content_blocks (title, url_slug, type_id, "
+                  "status, language, site_id) "
+                  "VALUES (?, ?, ?, 'published', ?, ?)",
+                  {title, slug, type_id, lang, site_id}, true))
+      return false;
+    content_id = (int)txn.result.row_ids.back();
   }
-  sqlite3_finalize(stmt);
-
-  content_id = (int)sqlite3_last_insert_rowid(db);
 
   // Count images to determine 'single' value
   int image_count = 0;
@@ -950,68 +1314,59 @@ bool create_sochee_content_block(
     hashtag_count = std::count(hashtags.begin(), hashtags.end(), '#');
   }
 
-  // Check for link folder
-  bool has_link = fs::exists(fs::path(sochee_path) / "link");
-
-  // Create sochee entry
-  const char *sochee_sql =
-      "INSERT INTO sochee (id, single, comments, likes, caption, "
-      "hashtag, location, has_link) VALUES (?, ?, 0, 0, ?, ?, ?, ?)";
-
-  if (sqlite3_prepare_v2(db, sochee_sql, -1, &stmt, nullptr)) {
-    log_to_file("SQL prepare error: " + std::string(sqlite3_errmsg(db)));
-    sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-    sqlite3_close(db);
+  // Index hashtags in the same tag tables as article tags, replacing those
+  // of an earlier publish
+  auto hashtags = metadata.find("hashtags");
+  if (!write_content_tags(txn, content_id,
+                          hashtags == metadata.end()
+                              ? std::vector<std::string>{}
+                              : parse_hashtags(hashtags->second)))
     return false;
-  }
-  sqlite3_bind_int(stmt, 1, content_id);
-  sqlite3_bind_int(stmt, 2, image_count == 1 ? 1 : 0);
-  sqlite3_bind_text(stmt, 3, metadata.at("caption").c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 4, hashtag_count);
-  sqlite3_bind_text(stmt, 5, metadata.at("location").c_str(), -1,
-                    SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 6, has_link ? 1 : 0);
-
-  if (sqlite3_step(stmt) != SQLITE_DONE) {
-    sqlite3_finalize(stmt);
-    sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-    sqlite3_close(db);
-    return false;
-  }
-  sqlite3_finalize(stmt);
 
-  sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
-  sqlite3_close(db);
-  return true;
+  // Create the sochee entry, or refresh it without touching its comment and
+  // like counts
+  if (found)
+    return txn.exec("UPDATE sochee SET single = ?, caption = ?, hashtag = ?, "
+                    "location = ?, has_link = ? WHERE id = ?",
+                    {(long long)(image_count == 1 ? 1 : 0),
+                     metadata.at("caption"), (long long)hashtag_count,
+                     metadata.at("location"), (long long)(has_link ? 1 : 0),
+                     (long long)content_id});
+  return txn.exec("INSERT INTO sochee (id, single, comments, likes, caption, "
+                  "hashtag, location, has_link) VALUES (?, ?, 0, 0, ?, ?, ?, "
+                  "?)",
+                  {(long long)content_id, (long long)(image_count == 1 ? 1 : 0),
+                   metadata.at("caption"), (long long)hashtag_count,
+                   metadata.at("location"), (long long)(has_link ? 1 : 0)});
 }
 
-bool process_sochee_link(const std::string &sochee_path, int content_id) {
-  fs::path link_dir = fs::path(sochee_path) / "link";
-  if (!fs::exists(link_dir)) {
+bool process_sochee_link(const ContentManifest &manifest,
+                         SocheeUploads &uploads) {
+  if (!manifest.has_dir("link")) {
     return true;
   }
 
   // Find exactly one image and link.txt
   std::string image_file;
-  fs::path link_txt_path = link_dir / "link.txt";
+  const auto *link_txt = manifest.find("link/link.txt");
 
-  if (!fs::exists(link_txt_path)) {
+  if (!link_txt) {
     log_to_file("Missing link.txt in link folder");
     return false;
   }
+  fs::path link_txt_path = link_txt->path;
 
   // Find single image
-  for (const auto &entry : fs::directory_iterator(link_dir)) {
-    if (entry.path().filename() == "link.txt")
+  for (const auto *entry : manifest.files_in("link")) {
+    if (entry == link_txt)
       continue;
 
-    std::string ext = entry.path().extension().string();
-    if (IMAGE_EXTENSIONS.count(ext)) {
+    if (IMAGE_EXTENSIONS.count(entry->ext)) {
       if (!image_file.empty()) {
         log_to_file("Multiple images found in link folder");
         return false;
       }
-      image_file = entry.path().string();
+      image_file = entry->path.string();
     }
   }
 
@@ -1029,87 +1384,161 @@ bool process_sochee_link(const std::string &sochee_path, int content_id) {
     return false;
   }
 
-  std::string url = link_data.at("url");
-  std::string name = link_data.at("name");
-
   // Upload image to GCS
   std::string uuid = generate_uuid();
   std::string ext = fs::path(image_file).extension().string();
-  std::string gcs_key = "images/sochee/" + uuid + ext;
-  std::string tmp_path = "/tmp/" + uuid + ext;
-
-  fs::copy_file(image_file, tmp_path);
-  std::string cmd = "gsutil cp \"" + tmp_path + "\" gs://" + GCS_PUBLIC_BUCKET +
-                    "/" + gcs_key;
-  exec_command(cmd);
-  fs::remove(tmp_path);
+  CallResult upload =
+      upload_public_file(image_file, "images/sochee/" + uuid + ext);
+  if (!upload) {
+    log_to_file("Link image upload failed: " + upload.error);
+    return false;
+  }
 
-  std::string gcs_url = GCS_PUBLIC_URL + GCS_PUBLIC_BUCKET + "/" + gcs_key;
+  uploads.has_link = true;
+  uploads.link_image.url = upload.value;
+  uploads.link_image.filename = uuid + ext;
+  uploads.link_image.mime_type = "image/" + ext.substr(1);
+  uploads.link_url = link_data.at("url");
+  uploads.link_name = link_data.at("name");
+  return true;
+}
 
-  // Database operations
-  sqlite3 *db;
-  if (sqlite3_open(DB_PATH.c_str(), &db) != SQLITE_OK)
+// Every DB mutation of a sochee publish, in a single transaction
+bool apply_sochee_writes(
+    WriteTxn &txn, const std::unordered_map<std::string, std::string> &metadata,
+    const SocheeUploads &uploads, int &content_id) {
+  if (!create_sochee_content_block(txn, metadata, content_id,
+                                   uploads.has_link))
     return false;
+  txn.on_commit.push_back(
+      [content_id] { content_cache().invalidate(content_id); });
 
-  sqlite3_exec(db, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr);
+  for (size_t i = 0; i < uploads.images.size(); i++) {
+    // Insert into images table
+    const auto &image = uploads.images[i];
+    if (!txn.exec("INSERT INTO images (original_url, filename, mime_type, "
+                  "content_id, image_type, processing_status, width, height, "
+                  "byte_size, blurhash, dominant_color) VALUES (?, ?, ?, ?, "
+                  "'content', 'complete', ?, ?, ?, NULLIF(?, ''), "
+                  "NULLIF(?, ''))",
+                  {image.url, image.filename, image.mime_type,
+                   (long long)content_id, (long long)image.dims.width,
+                   (long long)image.dims.height, image.bytes,
+                   image.placeholder.blurhash, image.placeholder.color},
+                  true))
+      return false;
+    long long image_id = txn.result.row_ids.back();
 
-  sqlite3_stmt *stmt;
+    // Insert into sochee_order table
+    if (!txn.exec("INSERT INTO sochee_order (id, sochee_id, photo_order) "
+                  "VALUES (?, ?, ?)",
+                  {image_id, (long long)content_id, (long long)i + 1}))
+      return false;
+  }
 
-  // Insert into images table
-  const char *insert_image_record =
-      "INSERT INTO images (original_url, filename, mime_type, content_id, "
-      "image_type, processing_status) VALUES (?, ?, ?, ?, ?, 'complete')";
-  if (sqlite3_prepare_v2(db, insert_image_record, -1, &stmt, nullptr) !=
-      SQLITE_OK) {
-    log_to_file("SQL prepare error: " + std::string(sqlite3_errmsg(db)));
-    sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-    sqlite3_close(db);
-    return false;
-  };
-  sqlite3_bind_text(stmt, 1, gcs_url.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 2, (uuid + ext).c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 3, ("image/" + ext).c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 4, content_id);
-  sqlite3_bind_text(stmt, 5, "content", -1, SQLITE_STATIC);
-  if (sqlite3_step(stmt) != SQLITE_DONE) {
-    log_to_file("SQL execution error: " + std::string(sqlite3_errmsg(db)));
-    sqlite3_finalize(stmt);
-    sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-    sqlite3_close(db);
+  // Update content_blocks with thumbnail_url
+  if (!txn.exec("UPDATE content_blocks SET thumbnail_url = ? WHERE id = ?",
+                {uploads.thumb_url, (long long)content_id}))
     return false;
+
+  if (uploads.has_link) {
+    // Insert the link image, then the sochee_link row pointing at it
+    if (!txn.exec("INSERT INTO images (original_url, filename, mime_type, "
+                  "content_id, image_type, processing_status) VALUES (?, ?, "
+                  "?, ?, 'content', 'complete')",
+                  {uploads.link_image.url, uploads.link_image.filename,
+                   uploads.link_image.mime_type, (long long)content_id},
+                  true))
+      return false;
+    long long image_id = txn.result.row_ids.back();
+
+    if (!txn.exec("INSERT INTO sochee_link (id, image_id, url, name) VALUES "
+                  "(?, ?, ?, ?)",
+                  {(long long)content_id, image_id, uploads.link_url,
+                   uploads.link_name}))
+      return false;
   }
-  sqlite3_finalize(stmt);
-  int image_id = (int)sqlite3_last_insert_rowid(db);
 
-  // Insert into sochee_link table
-  const char *link_sql =
-      "INSERT INTO sochee_link (id, image_id, url, name) VALUES (?, ?, ?, ?)";
+  return refresh_feed_entry(txn, content_id);
+}
+
+// One sochee moving through the publish pipeline
+struct SocheeJob : PublishOutcome {
+  ContentManifest manifest;
+  std::unordered_map<std::string, std::string> metadata;
+  SocheeUploads uploads;
+  SearchDocument search_doc;
+};
 
-  if (sqlite3_prepare_v2(db, link_sql, -1, &stmt, nullptr) != SQLITE_OK) {
-    log_to_file("SQL prepare error: " + std::string(sqlite3_errmsg(db)));
-    sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-    sqlite3_close(db);
-    return false;
+bool validate_sochee(SocheeJob &job) {
+  if (!job.manifest.scan(job.path) || !validate_sochee_structure(job.manifest))
+    return job.fail(400, "Invalid sochee structure");
+  job.metadata =
+      parse_metadata(fs::path(job.path) / "metadata.txt",
+                     {"title", "status", "type_id", "language", "caption",
+                      "site_id", "status", "location", "hashtags", "1"});
+  if (job.metadata.empty()) {
+    log_to_file("Not enough metadata for sochee at " + job.path);
+    return job.fail(500, "Metadata fetching failed");
   }
-  sqlite3_bind_int(stmt, 1, content_id);
-  sqlite3_bind_int(stmt, 2, image_id);
-  sqlite3_bind_text(stmt, 3, url.c_str(), -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 4, name.c_str(), -1, SQLITE_STATIC);
-  if (sqlite3_step(stmt) != SQLITE_DONE) {
-    log_to_file("SQL execution error: " + std::string(sqlite3_errmsg(db)));
-    sqlite3_finalize(stmt);
-    sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-    sqlite3_close(db);
-    return false;
+  return true;
+}
+
+// Slow work first: image processing and uploads
+bool prepare_sochee_files(SocheeJob &job) {
+  if (!process_sochee_images(job.manifest, job.metadata, job.uploads))
+    return job.fail(500, "Failed to process images");
+  if (!process_sochee_link(job.manifest, job.uploads))
+    return job.fail(500, "Failed to process link in sochee");
+
+  job.search_doc.title = job.metadata.at("title");
+  for (const auto &tag : parse_hashtags(job.metadata.at("hashtags")))
+    job.search_doc.tags += (job.search_doc.tags.empty() ? "" : " ") + tag;
+  job.search_doc.caption = job.metadata.at("caption");
+  job.search_doc.location = job.metadata.at("location");
+  return true;
+}
+
+WriteBatch sochee_write_batch(SocheeJob &job) {
+  return [&job](WriteTxn &txn) {
+    return apply_sochee_writes(txn, job.metadata, job.uploads,
+                               job.content_id) &&
+           index_search_document(txn, job.content_id, job.search_doc) &&
+           related_index().update(txn, job.content_id);
+  };
+}
+
+bool finish_sochee(SocheeJob &job, const WriteResult &result) {
+  if (!result.ok) {
+    log_to_file("Failed to create sochee: " + result.error);
+    return job.fail(500, "Failed to create content block");
   }
-  sqlite3_finalize(stmt);
-  sqlite3_close(db);
+  job.status = 200;
+  job.message = "Sochee published with ID: " + std::to_string(job.content_id);
   return true;
 }
 
+bool publish_sochee(SocheeJob &job) {
+  job.deadline = request_deadline();
+  DeadlineScope scope(job.deadline);
+  if (!validate_sochee(job) || !prepare_sochee_files(job))
+    return false;
+  // Then every DB mutation in one short transaction
+  return finish_sochee(job, write_sync(sochee_write_batch(job)));
+}
+
+BatchReport publish_sochees(const std::vector<std::string> &paths,
+                            size_t workers) {
+  std::vector<SocheeJob> jobs(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i)
+    jobs[i].path = paths[i];
+  return run_batch(jobs, workers, validate_sochee, prepare_sochee_files,
+                   sochee_write_batch, finish_sochee);
+}
+
 void handle_sochee_request(const HttpRequest &req, HttpResponse &res) {
   log_to_file("Received sochee publish request");
-  std::string sochee_path;
+  SocheeJob job;
   // Log headers for debugging
   log_to_file("Request headers:");
   for (const auto &pair : req.headers) {
@@ -1122,53 +1551,158 @@ void handle_sochee_request(const HttpRequest &req, HttpResponse &res) {
     log_to_file("[Query] " + pair.first + ": " + pair.second);
   }
 
+  // Archive uploads are unpacked first, then published from /tmp
+  if (req.read_body) {
+    fs::path upload_dir;
+    if (receive_upload(req, res, upload_dir, job.path,
+                       [](const fs::path &) {})) {
+      publish_sochee(job);
+      res.send(job.status, job.message);
+    }
+    remove_upload(upload_dir);
+    return;
+  }
+
   // Determine article path
   auto it = req.query_params.find("path");
   if (it != req.query_params.end()) {
-    sochee_path = it->second;
-    log_to_file("Using path from query parameter: " + sochee_path);
+    job.path = it->second;
+    log_to_file("Using path from query parameter: " + job.path);
   } else if (!req.body.empty()) {
-    sochee_path = req.body;
-    log_to_file("Using path from request body: " + sochee_path);
+    job.path = req.body;
+    log_to_file("Using path from request body: " + job.path);
   } else {
     log_to_file("No path provided in query parameters or request body");
     res.send(400, "Missing path parameter. Provide it either as a query "
                   "parameter '?path=' or in the request body.");
     return;
   }
-  if (!validate_sochee_structure(sochee_path)) {
-    res.send(400, "Invalid sochee structure");
+
+  publish_sochee(job);
+  res.send(job.status, job.message);
+}
+
+// Drop folder publishes: directories with an index.html are articles, the
+// rest sochee. Results only go to the log since nobody is waiting on them.
+void publish_dropped(const std::vector<std::string> &dirs) {
+  std::vector<std::string> articles, sochees;
+  for (const auto &dir : dirs) {
+    std::error_code ec;
+    (fs::exists(fs::path(dir) / "index.html", ec) ? articles : sochees)
+        .push_back(dir);
   }
-  auto metadata =
-      parse_metadata(fs::path(sochee_path) / "metadata.txt",
-                     {"title", "status", "type_id", "language", "caption",
-                      "site_id", "status", "location", "hashtags", "1"});
-  int content_id = -1;
-  if (!create_sochee_content_block(metadata, content_id, sochee_path)) {
-    res.send(500, "Failed to create content block");
-    return;
+  size_t workers = (size_t)std::max(1LL, env_or("PUBLISHER_BATCH_JOBS", 4LL));
+  if (!articles.empty())
+    log_to_file("Drop folder publish: " +
+                batch_report_json("publish", workers,
+                                  publish_articles(articles, workers)));
+  if (!sochees.empty())
+    log_to_file("Drop folder publish: " +
+                batch_report_json("sochee", workers,
+                                  publish_sochees(sochees, workers)));
+}
+
+// article_publisher publish|sochee [--jobs N] <dir>...
+// article_publisher reindex [--jobs N]
+// article_publisher verify
+// Runs the publish pipeline or a maintenance job in-process, without the
+// HTTP server, and prints a JSON summary with timings. Exit status is 0 on
+// success, 1 when any item or check failed and 2 on a usage error.
+int run_cli(int argc, char *argv[]) {
+  std::string command = argv[1];
+  size_t workers = (size_t)std::max(1LL, env_or("PUBLISHER_BATCH_JOBS", 4LL));
+  std::vector<std::string> paths;
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    long long value;
+    if (arg == "--jobs" && i + 1 < argc && parse_id(argv[i + 1], value) &&
+        value > 0) {
+      workers = (size_t)value;
+      ++i;
+    } else {
+      paths.push_back(arg);
+    }
   }
-  if (!process_sochee_images(sochee_path, content_id, metadata)) {
-    res.send(500, "Failed to process images");
-    return;
+
+  bool publishing = command == "publish" || command == "sochee";
+  bool maintenance = command == "reindex" || command == "verify";
+  if (publishing ? paths.empty() : !maintenance || !paths.empty()) {
+    std::cerr << "usage: " << argv[0]
+              << " publish|sochee [--jobs N] <dir>...\n"
+              << "       " << argv[0] << " reindex [--jobs N]\n"
+              << "       " << argv[0] << " verify\n";
+    return 2;
   }
-  if (!process_sochee_link(sochee_path, content_id)) {
-    res.send(500, "Failed to process link in sochee");
-    return;
+
+  bool ok;
+  std::string report;
+  if (publishing) {
+    BatchReport batch = command == "publish" ? publish_articles(paths, workers)
+                                             : publish_sochees(paths, workers);
+    report = batch_report_json(command, workers, batch);
+    ok = std::all_of(batch.results.begin(), batch.results.end(),
+                     [](const PublishOutcome &item) {
+                       return item.status == 200;
+                     });
+  } else if (command == "reindex") {
+    ok = reindex_content(workers, report);
+  } else {
+    ok = verify_content(report);
   }
-  res.send(200, "Sochee published with ID: " + std::to_string(content_id));
+  std::cout << report << std::endl;
+  return ok ? 0 : 1;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
   log_to_file("Starting Article Publisher Service");
 
+  // A gsutil that exits early must not take the service down while an
+  // upload is still writing into its stdin
+  signal(SIGPIPE, SIG_IGN);
+
   // Create storage directory if it doesn't exist
-  std::string mkdir_cmd = "mkdir -p " + STORAGE_ROOT;
-  exec_command(mkdir_cmd);
+  std::error_code mkdir_error;
+  fs::create_directories(STORAGE_ROOT, mkdir_error);
+
+  // Apply the pragma profile up front so WAL is enabled before any publish
+  start_wal_checkpointer(db_pool());
+  {
+    PooledDb db(db_pool());
+    if (!db) {
+      log_to_file("Database unavailable at startup");
+    } else {
+      if (!run_migrations(db)) {
+        log_to_file("Schema migrations failed, refusing to start");
+        return 1;
+      }
+      log_to_file("Schema at version " +
+                  std::to_string(current_schema_version(db)));
+      tag_dictionary().warm(db);
+      related_index().warm(db);
+    }
+  }
+  if (related_index().needs_rebuild()) {
+    WriteResult rebuilt = write_sync(
+        [](WriteTxn &txn) { return related_index().rebuild(txn); });
+    if (!rebuilt.ok)
+      log_to_file("Related content rebuild failed: " + rebuilt.error);
+  }
+
+  if (argc > 1)
+    return run_cli(argc, argv);
 
   HttpServer server(8082); // localhost only
+  server.max_connections =
+      (size_t)std::max(1LL, env_or("PUBLISHER_MAX_CONNECTIONS", 64LL));
   server.route("/publish", handle_publish_request);
+  server.route("/publish/batch", handle_publish_batch_request);
   server.route("/sochee", handle_sochee_request);
+  server.stream_bodies("/publish", ARCHIVE_CONTENT_TYPES);
+  server.stream_bodies("/sochee", ARCHIVE_CONTENT_TYPES);
+  register_content_routes(server);
+  register_feed_routes(server);
+  register_search_routes(server);
+  start_drop_watcher(publish_dropped);
 
   log_to_file("Server initialized, listening on port 8082");
   server.run();
@@ -0,0 +1,355 @@
+#include "content_api.hpp"
+#include "db.hpp"
+#include "json.hpp"
+#include "publisher.hpp"
+
+#include <algorithm>
+#include <mutex>
+
+namespace {
+
+const char *CONTENT_COLUMNS = "id, title, url_slug, site_id, type_id, "
+                              "language, status, thumbnail_url";
+
+// Fields shared by every content type, without the closing brace
+std::string content_fields_json(sqlite3_stmt *stmt) {
+  return "{\"id\":" + json_column(stmt, 0) +
+         ",\"title\":" + json_column(stmt, 1) +
+         ",\"slug\":" + json_column(stmt, 2) +
+         ",\"site_id\":" + json_column(stmt, 3) +
+         ",\"type_id\":" + json_column(stmt, 4) +
+         ",\"language\":" + json_column(stmt, 5) +
+         ",\"status\":" + json_column(stmt, 6) +
+         ",\"thumbnail_url\":" + json_column(stmt, 7);
+}
+
+std::string tags_json(sqlite3 *db, long long id) {
+  std::string json = "[";
+  query_rows(db,
+             "SELECT t.name FROM content_tags ct JOIN tags t ON t.id = "
+             "ct.tag_id WHERE ct.content_id = ? ORDER BY t.name",
+             {id}, [&](sqlite3_stmt *stmt) {
+               if (json.size() > 1)
+                 json += ",";
+               json += json_column(stmt, 0);
+             });
+  return json + "]";
+}
+
+std::string image_json(sqlite3_stmt *stmt) {
+  return "{\"id\":" + json_column(stmt, 0) +
+         ",\"url\":" + json_column(stmt, 1) +
+         ",\"filename\":" + json_column(stmt, 2) +
+         ",\"mime_type\":" + json_column(stmt, 3) +
+         ",\"image_type\":" + json_column(stmt, 4) +
+         ",\"width\":" + json_column(stmt, 5) +
+         ",\"height\":" + json_column(stmt, 6) +
+         ",\"byte_size\":" + json_column(stmt, 7) +
+         ",\"blurhash\":" + json_column(stmt, 8) +
+         ",\"dominant_color\":" + json_column(stmt, 9) + "}";
+}
+
+bool load_content(sqlite3 *db, const std::string &where,
+                  const std::vector<SqlParam> &params, std::string &json) {
+  long long id = -1;
+  bool ok = query_rows(db,
+                       std::string("SELECT ") + CONTENT_COLUMNS +
+                           " FROM content_blocks WHERE " + where +
+                           " AND status = 'published' LIMIT 1",
+                       params, [&](sqlite3_stmt *stmt) {
+                         id = sqlite3_column_int64(stmt, 0);
+                         json = content_fields_json(stmt);
+                       });
+  if (!ok || id == -1)
+    return false;
+
+  json += ",\"tags\":" + tags_json(db, id) + ",\"images\":[";
+  bool first = true;
+  query_rows(db,
+             "SELECT id, original_url, filename, mime_type, image_type, "
+             "width, height, byte_size, blurhash, dominant_color FROM images "
+             "WHERE content_id = ? ORDER BY id",
+             {id}, [&](sqlite3_stmt *stmt) {
+               if (!first)
+                 json += ",";
+               first = false;
+               json += image_json(stmt);
+             });
+  json += "],\"related\":[";
+  first = true;
+  query_rows(db,
+             "SELECT f.id, f.title, f.slug, f.thumbnail_url FROM "
+             "related_content r JOIN feed f ON f.id = r.related_id WHERE "
+             "r.content_id = ? ORDER BY r.rank",
+             {id}, [&](sqlite3_stmt *stmt) {
+               if (!first)
+                 json += ",";
+               first = false;
+               json += "{\"id\":" + json_column(stmt, 0) +
+                       ",\"title\":" + json_column(stmt, 1) +
+                       ",\"slug\":" + json_column(stmt, 2) +
+                       ",\"thumbnail_url\":" + json_column(stmt, 3) + "}";
+             });
+  json += "]}";
+  return true;
+}
+
+bool load_sochee(sqlite3 *db, long long id, std::string &json) {
+  bool found = false;
+  bool ok = query_rows(
+      db,
+      std::string("SELECT cb.id, cb.title, cb.url_slug, cb.site_id, "
+                  "cb.type_id, cb.language, cb.status, cb.thumbnail_url, "
+                  "s.single, s.likes, s.comments, s.caption, s.location, "
+                  "s.has_link FROM content_blocks cb JOIN sochee s ON s.id = "
+                  "cb.id WHERE cb.id = ? AND cb.status = 'published'"),
+      {id}, [&](sqlite3_stmt *stmt) {
+        found = true;
+        json = content_fields_json(stmt) +
+               ",\"single\":" + json_column(stmt, 8) +
+               ",\"likes\":" + json_column(stmt, 9) +
+               ",\"comments\":" + json_column(stmt, 10) +
+               ",\"caption\":" + json_column(stmt, 11) +
+               ",\"location\":" + json_column(stmt, 12) +
+               ",\"has_link\":" + json_column(stmt, 13);
+      });
+  if (!ok || !found)
+    return false;
+
+  json += ",\"tags\":" + tags_json(db, id) + ",\"images\":[";
+  bool first = true;
+  query_rows(db,
+             "SELECT i.id, i.original_url, i.filename, i.mime_type, "
+             "i.image_type, i.width, i.height, i.byte_size, i.blurhash, "
+             "i.dominant_color FROM sochee_order so JOIN images i ON i.id = "
+             "so.id "
+             "WHERE so.sochee_id = ? ORDER BY so.photo_order",
+             {id}, [&](sqlite3_stmt *stmt) {
+               if (!first)
+                 json += ",";
+               first = false;
+               json += image_json(stmt);
+             });
+  json += "],\"link\":";
+
+  std::string link = "null";
+  query_rows(db,
+             "SELECT sl.url, sl.name, i.original_url FROM sochee_link sl "
+             "LEFT JOIN images i ON i.id = sl.image_id WHERE sl.id = ?",
+             {id}, [&](sqlite3_stmt *stmt) {
+               link = "{\"url\":" + json_column(stmt, 0) +
+                      ",\"name\":" + json_column(stmt, 1) +
+                      ",\"image_url\":" + json_column(stmt, 2) + "}";
+             });
+  json += link + "}";
+  return true;
+}
+
+bool load_listing(sqlite3 *db, const std::string &site_id,
+                  const std::string &type_id, int page, int per_page,
+                  std::string &json) {
+  std::string sql = std::string("SELECT ") + CONTENT_COLUMNS +
+                    " FROM content_blocks WHERE status = 'published'";
+  std::vector<SqlParam> params;
+  if (!site_id.empty()) {
+    sql += " AND site_id = ?";
+    params.emplace_back(site_id);
+  }
+  if (!type_id.empty()) {
+    sql += " AND type_id = ?";
+    params.emplace_back(type_id);
+  }
+  sql += " ORDER BY id DESC LIMIT ? OFFSET ?";
+  // One extra row tells whether another page exists
+  params.emplace_back((long long)per_page + 1);
+  params.emplace_back((long long)(page - 1) * per_page);
+
+  std::string items;
+  int count = 0;
+  bool ok = query_rows(db, sql, params, [&](sqlite3_stmt *stmt) {
+    if (++count > per_page)
+      return;
+    if (!items.empty())
+      items += ",";
+    items += content_fields_json(stmt) + "}";
+  });
+  if (!ok)
+    return false;
+
+  json = "{\"items\":[" + items + "],\"page\":" + std::to_string(page) +
+         ",\"per_page\":" + std::to_string(per_page) +
+         ",\"has_more\":" + (count > per_page ? "true" : "false") + "}";
+  return true;
+}
+
+void send_json(HttpResponse &res, bool found, const std::string &json) {
+  res.content_type = "application/json";
+  if (found)
+    res.send(200, json);
+  else
+    res.send(404, "{\"error\":\"not found\"}");
+}
+
+} // namespace
+
+ContentCache::ContentCache()
+    : ttl(std::max(1LL, env_or("PUBLISHER_CACHE_TTL_S", 60LL))),
+      max_entries(
+          (size_t)std::max(1LL, env_or("PUBLISHER_CACHE_MAX_ENTRIES", 10000LL))) {}
+
+bool ContentCache::lookup(Map &map, const std::string &key, std::string &json) {
+  std::shared_lock<std::shared_mutex> lock(mutex);
+  auto it = map.find(key);
+  if (it == map.end() ||
+      std::chrono::steady_clock::now() - it->second.loaded > ttl)
+    return false;
+  json = it->second.json;
+  return true;
+}
+
+void ContentCache::store(Map &map, const std::string &key,
+                         const std::string &json, uint64_t loaded_generation) {
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  if (generation.load() != loaded_generation)
+    return;
+  if (map.size() >= max_entries)
+    map.clear();
+  map[key] = {json, std::chrono::steady_clock::now()};
+}
+
+bool ContentCache::get_content(long long id, std::string &json) {
+  std::string key = std::to_string(id);
+  if (lookup(contents, key, json))
+    return true;
+
+  uint64_t loaded_generation = generation.load();
+  PooledDb db(db_pool());
+  if (!db || !load_content(db, "id = ?", {id}, json))
+    return false;
+  store(contents, key, json, loaded_generation);
+  return true;
+}
+
+bool ContentCache::get_content_by_slug(const std::string &site_id,
+                                       const std::string &type_id,
+                                       const std::string &slug,
+                                       std::string &json) {
+  std::string key = site_id + "/" + type_id + "/" + slug;
+  if (lookup(slugs, key, json))
+    return true;
+
+  uint64_t loaded_generation = generation.load();
+  PooledDb db(db_pool());
+  if (!db || !load_content(db, "url_slug = ? AND site_id = ? AND type_id = ?",
+                           {slug, site_id, type_id}, json))
+    return false;
+  store(slugs, key, json, loaded_generation);
+  return true;
+}
+
+bool ContentCache::get_sochee(long long id, std::string &json) {
+  std::string key = std::to_string(id);
+  if (lookup(sochees, key, json))
+    return true;
+
+  uint64_t loaded_generation = generation.load();
+  PooledDb db(db_pool());
+  if (!db || !load_sochee(db, id, json))
+    return false;
+  store(sochees, key, json, loaded_generation);
+  return true;
+}
+
+bool ContentCache::get_listing(const std::string &site_id,
+                               const std::string &type_id, int page,
+                               int per_page, std::string &json) {
+  std::string key = site_id + "/" + type_id + "/" + std::to_string(page) +
+                    "/" + std::to_string(per_page);
+  if (lookup(listings, key, json))
+    return true;
+
+  uint64_t loaded_generation = generation.load();
+  PooledDb db(db_pool());
+  if (!db || !load_listing(db, site_id, type_id, page, per_page, json))
+    return false;
+  store(listings, key, json, loaded_generation);
+  return true;
+}
+
+void ContentCache::invalidate(long long content_id) {
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  ++generation;
+  contents.erase(std::to_string(content_id));
+  sochees.erase(std::to_string(content_id));
+  // Slug and listing entries can't be mapped back cheaply; publishes are
+  // rare enough to drop them wholesale.
+  slugs.clear();
+  listings.clear();
+}
+
+ContentCache &content_cache() {
+  static ContentCache cache;
+  return cache;
+}
+
+void register_content_routes(HttpServer &server) {
+  server.route_prefix("/content/", [](const HttpRequest &req,
+                                       HttpResponse &res) {
+    long long id;
+    std::string json;
+    if (!parse_id(req.path.substr(std::string("/content/").size()), id)) {
+      res.send(400, "Invalid content id");
+      return;
+    }
+    send_json(res, content_cache().get_content(id, json), json);
+  });
+
+  server.route("/content/by-slug", [](const HttpRequest &req,
+                                      HttpResponse &res) {
+    std::string slug = req.param("slug");
+    std::string site_id = req.param("site_id");
+    std::string type_id = req.param("type_id");
+    if (slug.empty() || site_id.empty() || type_id.empty()) {
+      res.send(400, "Missing slug, site_id or type_id parameter");
+      return;
+    }
+    std::string json;
+    send_json(res,
+              content_cache().get_content_by_slug(site_id, type_id, slug, json),
+              json);
+  });
+
+  server.route("/content", [](const HttpRequest &req, HttpResponse &res) {
+    long long page = 1;
+    long long per_page = 20;
+    std::string page_param = req.param("page");
+    std::string per_page_param = req.param("per_page");
+    if ((!page_param.empty() && !parse_id(page_param, page)) ||
+        (!per_page_param.empty() && !parse_id(per_page_param, per_page)) ||
+        page < 1 || per_page < 1 || page > 100000) {
+      res.send(400, "Invalid page or per_page parameter");
+      return;
+    }
+    per_page = std::min(per_page, 100LL);
+
+    std::string json;
+    if (!content_cache().get_listing(req.param("site_id"),
+                                     req.param("type_id"), (int)page,
+                                     (int)per_page, json)) {
+      res.send(500, "Listing failed");
+      return;
+    }
+    send_json(res, true, json);
+  });
+
+  server.route_prefix("/sochee/", [](const HttpRequest &req,
+                                      HttpResponse &res) {
+    long long id;
+    std::string json;
+    if (!parse_id(req.path.substr(std::string("/sochee/").size()), id)) {
+      res.send(400, "Invalid sochee id");
+      return;
+    }
+    send_json(res, content_cache().get_sochee(id, json), json);
+  });
+}
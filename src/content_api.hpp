@@ -0,0 +1,56 @@
+// content_api.hpp
+#pragma once
+
+#include "http_server.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+// In-process cache of pre-serialized JSON for the read endpoints. Entries
+// are filled from SQLite on a miss and dropped when a publish touching the
+// content commits. A TTL bounds staleness from writes made outside this
+// service (likes, comments).
+struct ContentCache {
+  ContentCache();
+
+  bool get_content(long long id, std::string &json);
+  bool get_content_by_slug(const std::string &site_id,
+                           const std::string &type_id, const std::string &slug,
+                           std::string &json);
+  bool get_sochee(long long id, std::string &json);
+  bool get_listing(const std::string &site_id, const std::string &type_id,
+                   int page, int per_page, std::string &json);
+
+  // Called from the DB writer after a publish commits.
+  void invalidate(long long content_id);
+
+private:
+  struct Entry {
+    std::string json;
+    std::chrono::steady_clock::time_point loaded;
+  };
+  using Map = std::unordered_map<std::string, Entry>;
+
+  bool lookup(Map &map, const std::string &key, std::string &json);
+  void store(Map &map, const std::string &key, const std::string &json,
+             uint64_t loaded_generation);
+
+  std::shared_mutex mutex;
+  // Bumped by every invalidation; a load that raced with one is not cached.
+  std::atomic<uint64_t> generation{0};
+  std::chrono::seconds ttl;
+  size_t max_entries;
+  Map contents; // "<id>"
+  Map sochees;  // "<id>"
+  Map slugs;    // "<site>/<type>/<slug>" -> content JSON
+  Map listings; // "<site>/<type>/<page>/<per_page>"
+};
+
+ContentCache &content_cache();
+
+// GET /content/<id>, /content/by-slug, /content (listing) and /sochee/<id>
+void register_content_routes(HttpServer &server);
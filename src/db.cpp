@@ -0,0 +1,246 @@
+#include "db.hpp"
+#include "publisher.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <unordered_set>
+
+namespace {
+
+// Pragma values cannot be bound as parameters, so string settings are
+// checked against the keywords SQLite accepts before being spliced in.
+std::string checked_keyword(const char *name, const std::string &value,
+                            const std::string &fallback,
+                            const std::unordered_set<std::string> &allowed) {
+  std::string upper = value;
+  std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+  if (allowed.count(upper))
+    return upper;
+  log_to_file(std::string("Ignoring invalid value for ") + name + ": " +
+              value);
+  return fallback;
+}
+
+// Busy handler replacing PRAGMA busy_timeout: exponential backoff capped at
+// 100ms with +/-50% jitter, so the publisher and the site readers do not
+// retry the lock in lockstep.
+int jittered_busy_handler(void *ctx, int attempt) {
+  static thread_local std::chrono::steady_clock::time_point started;
+  static thread_local std::mt19937 gen(std::random_device{}());
+
+  auto now = std::chrono::steady_clock::now();
+  if (attempt == 0)
+    started = now;
+
+  int timeout_ms = static_cast<const DbProfile *>(ctx)->busy_timeout_ms;
+  auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    now - started)
+                    .count();
+  if (waited >= timeout_ms)
+    return 0;
+
+  int base_ms = std::min(100, 1 << std::min(attempt, 7));
+  std::uniform_int_distribution<int> jitter(base_ms / 2, base_ms + base_ms / 2);
+  int sleep_ms =
+      std::min<long long>(std::max(1, jitter(gen)), timeout_ms - waited);
+  std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));
+  return 1;
+}
+
+bool exec_pragma(sqlite3 *db, const std::string &sql) {
+  char *err = nullptr;
+  if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err) != SQLITE_OK) {
+    log_to_file("Failed to apply '" + sql +
+                "': " + std::string(err ? err : sqlite3_errmsg(db)));
+    sqlite3_free(err);
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+
+DbProfile load_db_profile() {
+  DbProfile profile;
+  profile.path = env_or("PUBLISHER_DB_PATH", DB_PATH);
+  profile.journal_mode = checked_keyword(
+      "PUBLISHER_DB_JOURNAL_MODE",
+      env_or("PUBLISHER_DB_JOURNAL_MODE", profile.journal_mode),
+      profile.journal_mode,
+      {"DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF"});
+  profile.synchronous = checked_keyword(
+      "PUBLISHER_DB_SYNCHRONOUS",
+      env_or("PUBLISHER_DB_SYNCHRONOUS", profile.synchronous),
+      profile.synchronous, {"OFF", "NORMAL", "FULL", "EXTRA"});
+  profile.temp_store = checked_keyword(
+      "PUBLISHER_DB_TEMP_STORE",
+      env_or("PUBLISHER_DB_TEMP_STORE", profile.temp_store),
+      profile.temp_store, {"DEFAULT", "FILE", "MEMORY"});
+  profile.mmap_size = env_or("PUBLISHER_DB_MMAP_SIZE", profile.mmap_size);
+  profile.cache_size = static_cast<int>(
+      env_or("PUBLISHER_DB_CACHE_SIZE", (long long)profile.cache_size));
+  profile.busy_timeout_ms = static_cast<int>(std::max(
+      0LL, env_or("PUBLISHER_DB_BUSY_TIMEOUT_MS",
+                  (long long)profile.busy_timeout_ms)));
+  profile.checkpoint_interval_s = static_cast<int>(std::max(
+      0LL, env_or("PUBLISHER_DB_CHECKPOINT_INTERVAL_S",
+                  (long long)profile.checkpoint_interval_s)));
+  profile.pool_size = static_cast<size_t>(std::max(
+      1LL, env_or("PUBLISHER_DB_POOL_SIZE", (long long)profile.pool_size)));
+  return profile;
+}
+
+DbPool::~DbPool() {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (sqlite3 *db : idle)
+    sqlite3_close(db);
+  idle.clear();
+}
+
+sqlite3 *DbPool::open_connection() {
+  sqlite3 *db = nullptr;
+  int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX;
+  if (sqlite3_open_v2(profile.path.c_str(), &db, flags, nullptr) !=
+      SQLITE_OK) {
+    log_to_file("Failed to open database at " + profile.path + ": " +
+                std::string(db ? sqlite3_errmsg(db) : "out of memory"));
+    sqlite3_close(db);
+    return nullptr;
+  }
+
+  sqlite3_busy_handler(db, jittered_busy_handler, &profile);
+
+  // With the background checkpointer running, commits skip the automatic
+  // checkpoint and leave it to the passive pass.
+  int autocheckpoint = profile.checkpoint_interval_s > 0 ? 0 : 1000;
+  bool ok =
+      exec_pragma(db, "PRAGMA journal_mode=" + profile.journal_mode + ";") &&
+      exec_pragma(db, "PRAGMA synchronous=" + profile.synchronous + ";") &&
+      exec_pragma(db, "PRAGMA mmap_size=" +
+                          std::to_string(profile.mmap_size) + ";") &&
+      exec_pragma(db, "PRAGMA cache_size=" +
+                          std::to_string(profile.cache_size) + ";") &&
+      exec_pragma(db, "PRAGMA temp_store=" + profile.temp_store + ";") &&
+      exec_pragma(db, "PRAGMA wal_autocheckpoint=" +
+                          std::to_string(autocheckpoint) + ";");
+  if (!ok) {
+    sqlite3_close(db);
+    return nullptr;
+  }
+  return db;
+}
+
+sqlite3 *DbPool::acquire() {
+  std::unique_lock<std::mutex> lock(mutex);
+  available.wait(lock,
+                 [this] { return !idle.empty() || open_count < profile.pool_size; });
+
+  if (!idle.empty()) {
+    sqlite3 *db = idle.back();
+    idle.pop_back();
+    return db;
+  }
+
+  ++open_count;
+  lock.unlock();
+  sqlite3 *db = open_connection();
+  if (!db) {
+    lock.lock();
+    --open_count;
+    available.notify_one();
+  }
+  return db;
+}
+
+void DbPool::release(sqlite3 *db) {
+  // Never hand out a connection with a transaction left open by an early
+  // return; closing the connection used to roll it back implicitly.
+  if (!sqlite3_get_autocommit(db))
+    sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  idle.push_back(db);
+  available.notify_one();
+}
+
+DbPool &db_pool() {
+  static DbPool pool(load_db_profile());
+  return pool;
+}
+
+void start_wal_checkpointer(DbPool &pool) {
+  if (pool.profile.checkpoint_interval_s <= 0 ||
+      pool.profile.journal_mode != "WAL")
+    return;
+
+  std::thread([&pool] {
+    sqlite3 *db = pool.open_connection();
+    if (!db) {
+      log_to_file("WAL checkpointer disabled: could not open database");
+      return;
+    }
+    while (true) {
+      std::this_thread::sleep_for(
+          std::chrono::seconds(pool.profile.checkpoint_interval_s));
+      int wal_frames = 0;
+      int checkpointed = 0;
+      int rc = sqlite3_wal_checkpoint_v2(db, nullptr, SQLITE_CHECKPOINT_PASSIVE,
+                                         &wal_frames, &checkpointed);
+      if (rc != SQLITE_OK && rc != SQLITE_BUSY) {
+        log_to_file("WAL checkpoint failed: " +
+                    std::string(sqlite3_errmsg(db)));
+      } else if (wal_frames > 0 && checkpointed < wal_frames) {
+        log_to_file("WAL checkpoint partial: " + std::to_string(checkpointed) +
+                    "/" + std::to_string(wal_frames) + " frames");
+      }
+    }
+  }).detach();
+}
+
+bool bind_params(sqlite3_stmt *stmt, const std::vector<SqlParam> &params) {
+  for (size_t i = 0; i < params.size(); ++i) {
+    int index = static_cast<int>(i + 1);
+    int rc;
+    if (auto *n = std::get_if<long long>(&params[i])) {
+      rc = sqlite3_bind_int64(stmt, index, *n);
+    } else if (auto *real = std::get_if<double>(&params[i])) {
+      rc = sqlite3_bind_double(stmt, index, *real);
+    } else if (auto *text = std::get_if<std::string>(&params[i])) {
+      rc = sqlite3_bind_text(stmt, index, text->c_str(),
+                             static_cast<int>(text->size()), SQLITE_TRANSIENT);
+    } else {
+      rc = sqlite3_bind_null(stmt, index);
+    }
+    if (rc != SQLITE_OK)
+      return false;
+  }
+  return true;
+}
+
+bool query_rows(sqlite3 *db, const std::string &sql,
+                const std::vector<SqlParam> &params,
+                const std::function<void(sqlite3_stmt *)> &on_row) {
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+    log_to_file("SQL prepare error: " + std::string(sqlite3_errmsg(db)));
+    return false;
+  }
+  if (!bind_params(stmt, params)) {
+    log_to_file("SQL bind error: " + std::string(sqlite3_errmsg(db)));
+    sqlite3_finalize(stmt);
+    return false;
+  }
+
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    on_row(stmt);
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE) {
+    log_to_file("SQL execution error: " + std::string(sqlite3_errmsg(db)));
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,83 @@
+// db.hpp
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <sqlite3.h>
+#include <string>
+#include <variant>
+#include <vector>
+
+using SqlParam = std::variant<std::nullptr_t, long long, double, std::string>;
+
+// Pragma profile applied to every pooled connection. Defaults favour
+// concurrent site readers: WAL journaling, synchronous=NORMAL and periodic
+// passive checkpoints off the publish path. Every field can be overridden
+// through PUBLISHER_DB_* environment variables (see load_db_profile).
+struct DbProfile {
+  std::string path;
+  std::string journal_mode = "WAL";
+  std::string synchronous = "NORMAL";
+  long long mmap_size = 256LL * 1024 * 1024;
+  int cache_size = -16384; // negative values are KiB, as in the pragma
+  std::string temp_store = "MEMORY";
+  int busy_timeout_ms = 5000;
+  int checkpoint_interval_s = 30;
+  size_t pool_size = 4;
+};
+
+DbProfile load_db_profile();
+
+struct DbPool {
+  DbProfile profile;
+
+  explicit DbPool(DbProfile p) : profile(std::move(p)) {}
+  ~DbPool();
+
+  // Blocks until a connection is free; returns nullptr if opening fails.
+  sqlite3 *acquire();
+  void release(sqlite3 *db);
+
+  // Opens a connection with the profile applied, outside the pool.
+  sqlite3 *open_connection();
+
+private:
+  std::mutex mutex;
+  std::condition_variable available;
+  std::vector<sqlite3 *> idle;
+  size_t open_count = 0;
+};
+
+// Process-wide pool, configured from the environment on first use.
+DbPool &db_pool();
+
+// Scoped pool checkout. Converts to sqlite3 * so it can be handed straight
+// to the sqlite3_* API.
+struct PooledDb {
+  DbPool &pool;
+  sqlite3 *db;
+
+  explicit PooledDb(DbPool &p) : pool(p), db(p.acquire()) {}
+  ~PooledDb() {
+    if (db)
+      pool.release(db);
+  }
+  PooledDb(const PooledDb &) = delete;
+  PooledDb &operator=(const PooledDb &) = delete;
+
+  operator sqlite3 *() const { return db; }
+};
+
+// Runs PRAGMA wal_checkpoint(PASSIVE) every checkpoint_interval_s on a
+// background thread so commits never pay for checkpointing.
+void start_wal_checkpointer(DbPool &pool);
+
+// Binds params to ?1..?n in order.
+bool bind_params(sqlite3_stmt *stmt, const std::vector<SqlParam> &params);
+
+// Read helper for pooled connections: prepares, binds and calls on_row for
+// every result row. Logs and returns false on error.
+bool query_rows(sqlite3 *db, const std::string &sql,
+                const std::vector<SqlParam> &params,
+                const std::function<void(sqlite3_stmt *)> &on_row);
@@ -0,0 +1,262 @@
+#include "db_writer.hpp"
+#include "publisher.hpp"
+
+namespace {
+
+// Statements with many distinct shapes (multi-row inserts) would otherwise
+// grow the cache without bound.
+const size_t MAX_CACHED_STATEMENTS = 256;
+
+bool exec_simple(sqlite3 *db, const char *sql, std::string &error) {
+  if (sqlite3_exec(db, sql, nullptr, nullptr, nullptr) != SQLITE_OK) {
+    error = std::string(sql) + " failed: " + sqlite3_errmsg(db);
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+
+sqlite3_stmt *WriteTxn::prepare(const std::string &sql) {
+  auto it = statements.find(sql);
+  if (it != statements.end()) {
+    sqlite3_reset(it->second);
+    sqlite3_clear_bindings(it->second);
+    return it->second;
+  }
+
+  if (statements.size() >= MAX_CACHED_STATEMENTS) {
+    for (auto &[cached_sql, stmt] : statements)
+      sqlite3_finalize(stmt);
+    statements.clear();
+  }
+
+  sqlite3_stmt *stmt = nullptr;
+  if (sqlite3_prepare_v3(db, sql.c_str(), -1, SQLITE_PREPARE_PERSISTENT, &stmt,
+                         nullptr) != SQLITE_OK) {
+    result.error = "SQL prepare error: " + std::string(sqlite3_errmsg(db));
+    log_to_file(result.error);
+    return nullptr;
+  }
+  statements.emplace(sql, stmt);
+  return stmt;
+}
+
+bool WriteTxn::exec(const std::string &sql, const std::vector<SqlParam> &params,
+                    bool record_rowid) {
+  sqlite3_stmt *stmt = prepare(sql);
+  if (!stmt)
+    return false;
+  if (!bind_params(stmt, params)) {
+    result.error = "SQL bind error: " + std::string(sqlite3_errmsg(db));
+    log_to_file(result.error);
+    return false;
+  }
+
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+  }
+  sqlite3_reset(stmt);
+  if (rc != SQLITE_DONE) {
+    result.error = "SQL execution error: " + std::string(sqlite3_errmsg(db));
+    log_to_file(result.error);
+    return false;
+  }
+
+  if (record_rowid)
+    result.row_ids.push_back(sqlite3_last_insert_rowid(db));
+  return true;
+}
+
+bool WriteTxn::query_int(const std::string &sql,
+                         const std::vector<SqlParam> &params, long long &value,
+                         bool &found) {
+  found = false;
+  sqlite3_stmt *stmt = prepare(sql);
+  if (!stmt)
+    return false;
+  if (!bind_params(stmt, params)) {
+    result.error = "SQL bind error: " + std::string(sqlite3_errmsg(db));
+    log_to_file(result.error);
+    return false;
+  }
+
+  int rc = sqlite3_step(stmt);
+  if (rc == SQLITE_ROW) {
+    value = sqlite3_column_int64(stmt, 0);
+    found = true;
+  }
+  sqlite3_reset(stmt);
+  if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+    result.error = "SQL execution error: " + std::string(sqlite3_errmsg(db));
+    log_to_file(result.error);
+    return false;
+  }
+  return true;
+}
+
+bool WriteTxn::query(const std::string &sql,
+                     const std::vector<SqlParam> &params,
+                     const std::function<void(sqlite3_stmt *)> &on_row) {
+  sqlite3_stmt *stmt = prepare(sql);
+  if (!stmt)
+    return false;
+  if (!bind_params(stmt, params)) {
+    result.error = "SQL bind error: " + std::string(sqlite3_errmsg(db));
+    log_to_file(result.error);
+    return false;
+  }
+
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    on_row(stmt);
+  sqlite3_reset(stmt);
+  if (rc != SQLITE_DONE) {
+    result.error = "SQL execution error: " + std::string(sqlite3_errmsg(db));
+    log_to_file(result.error);
+    return false;
+  }
+  return true;
+}
+
+std::future<WriteResult> DbWriter::submit(WriteBatch batch) {
+  Pending pending{std::move(batch), {}};
+  std::future<WriteResult> future = pending.promise.get_future();
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!thread.joinable())
+    thread = std::thread([this] { run(); });
+  queue.push_back(std::move(pending));
+  queued.notify_one();
+  return future;
+}
+
+DbWriter::~DbWriter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  queued.notify_one();
+  if (thread.joinable())
+    thread.join();
+
+  for (auto &[sql, stmt] : statements)
+    sqlite3_finalize(stmt);
+  if (db)
+    sqlite3_close(db);
+}
+
+void DbWriter::run() {
+  db = pool.open_connection();
+  if (!db)
+    log_to_file("DB writer could not open its connection");
+
+  while (true) {
+    std::vector<Pending> group;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      queued.wait(lock, [this] { return !queue.empty() || stopping; });
+      if (queue.empty())
+        return;
+      while (!queue.empty() && group.size() < max_group) {
+        group.push_back(std::move(queue.front()));
+        queue.pop_front();
+      }
+    }
+    commit_group(group);
+  }
+}
+
+void DbWriter::commit_group(std::vector<Pending> &group) {
+  std::vector<WriteResult> results(group.size());
+  std::vector<std::vector<std::function<void()>>> on_commit(group.size());
+  std::vector<std::vector<std::function<void()>>> on_rollback(group.size());
+  auto undo = [](std::vector<std::function<void()>> &callbacks) {
+    for (auto it = callbacks.rbegin(); it != callbacks.rend(); ++it)
+      (*it)();
+    callbacks.clear();
+  };
+
+  auto fail_all = [&](const std::string &error) {
+    log_to_file("DB writer: " + error);
+    for (size_t i = 0; i < group.size(); ++i) {
+      results[i].ok = false;
+      results[i].row_ids.clear();
+      if (results[i].error.empty())
+        results[i].error = error;
+      group[i].promise.set_value(std::move(results[i]));
+    }
+  };
+
+  std::string error;
+  if (!db) {
+    // Retry the open so a DB that was briefly unavailable recovers.
+    db = pool.open_connection();
+    if (!db) {
+      fail_all("database connection unavailable");
+      return;
+    }
+  }
+  if (!exec_simple(db, "BEGIN IMMEDIATE;", error)) {
+    fail_all(error);
+    return;
+  }
+
+  for (size_t i = 0; i < group.size(); ++i) {
+    WriteTxn txn{db, results[i], statements, {}, {}};
+    // Without its savepoint a failing batch could not be undone on its own,
+    // so the batch does not run at all
+    bool ok = exec_simple(db, "SAVEPOINT batch;", results[i].error);
+    if (ok) {
+      try {
+        ok = group[i].batch(txn);
+      } catch (const std::exception &e) {
+        ok = false;
+        results[i].error = std::string("write batch threw: ") + e.what();
+      }
+    }
+    if (ok)
+      ok = exec_simple(db, "RELEASE batch;", results[i].error);
+
+    if (ok) {
+      on_commit[i] = std::move(txn.on_commit);
+      on_rollback[i] = std::move(txn.on_rollback);
+    } else {
+      if (results[i].error.empty())
+        results[i].error = "write batch failed";
+      results[i].row_ids.clear();
+      sqlite3_exec(db, "ROLLBACK TO batch; RELEASE batch;", nullptr, nullptr,
+                   nullptr);
+      undo(txn.on_rollback);
+    }
+    results[i].ok = ok;
+  }
+
+  if (!exec_simple(db, "COMMIT;", error)) {
+    sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+    for (size_t i = group.size(); i-- > 0;)
+      undo(on_rollback[i]);
+    for (auto &result : results)
+      result.error.clear();
+    fail_all(error);
+    return;
+  }
+
+  if (group.size() > 1)
+    log_to_file("DB writer committed " + std::to_string(group.size()) +
+                " batches in one transaction");
+  for (size_t i = 0; i < group.size(); ++i) {
+    for (auto &callback : on_commit[i])
+      callback();
+    group[i].promise.set_value(std::move(results[i]));
+  }
+}
+
+DbWriter &db_writer() {
+  static DbWriter writer(db_pool());
+  return writer;
+}
+
+WriteResult write_sync(WriteBatch batch) {
+  return db_writer().submit(std::move(batch)).get();
+}
@@ -0,0 +1,98 @@
+// db_writer.hpp
+#pragma once
+
+#include "db.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <sqlite3.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct WriteResult {
+  bool ok = false;
+  std::string error;
+  // Row ids recorded by WriteTxn::exec(..., true), in execution order.
+  std::vector<long long> row_ids;
+};
+
+// Handed to a write batch on the writer thread. A batch runs inside its own
+// savepoint of the group transaction; returning false (or throwing) rolls
+// back only that batch.
+struct WriteTxn {
+  sqlite3 *db;
+  WriteResult &result;
+  std::unordered_map<std::string, sqlite3_stmt *> &statements;
+
+  // Binds params in order and steps the statement to completion. When
+  // record_rowid is set, the last insert rowid is appended to row_ids.
+  bool exec(const std::string &sql, const std::vector<SqlParam> &params,
+            bool record_rowid = false);
+
+  // Runs a query and returns the first column of the first row, if any.
+  bool query_int(const std::string &sql, const std::vector<SqlParam> &params,
+                 long long &value, bool &found);
+
+  // Runs a query, calling on_row for every result row.
+  bool query(const std::string &sql, const std::vector<SqlParam> &params,
+             const std::function<void(sqlite3_stmt *)> &on_row);
+
+  // Prepared statements are cached for the lifetime of the writer.
+  sqlite3_stmt *prepare(const std::string &sql);
+
+  // Callbacks run only if this batch's writes are committed, for keeping
+  // in-memory state coherent with the database.
+  std::vector<std::function<void()>> on_commit;
+
+  // Callbacks run, newest first, when this batch's writes are rolled back
+  // after it ran: by its own failure or by a failed group COMMIT. They undo
+  // in-memory changes a batch makes right away so that later batches of
+  // the same group see them.
+  std::vector<std::function<void()>> on_rollback;
+};
+
+using WriteBatch = std::function<bool(WriteTxn &txn)>;
+
+// Single writer thread that owns the only write connection. Batches queued
+// while a commit is in flight are applied together under one BEGIN
+// IMMEDIATE ... COMMIT, so concurrent publishes share one fsync instead of
+// contending for SQLite's write lock.
+struct DbWriter {
+  explicit DbWriter(DbPool &p, size_t group_limit = 64)
+      : pool(p), max_group(group_limit) {}
+  // Drains the queue before returning.
+  ~DbWriter();
+
+  std::future<WriteResult> submit(WriteBatch batch);
+
+private:
+  struct Pending {
+    WriteBatch batch;
+    std::promise<WriteResult> promise;
+  };
+
+  void run();
+  void commit_group(std::vector<Pending> &group);
+
+  DbPool &pool;
+  size_t max_group;
+  sqlite3 *db = nullptr;
+  std::unordered_map<std::string, sqlite3_stmt *> statements;
+
+  std::mutex mutex;
+  std::condition_variable queued;
+  std::deque<Pending> queue;
+  std::thread thread;
+  bool stopping = false;
+};
+
+// Process-wide writer on top of db_pool(); the thread starts on first submit.
+DbWriter &db_writer();
+
+// Submits a batch and waits for its group to commit.
+WriteResult write_sync(WriteBatch batch);
@@ -0,0 +1,133 @@
+#include "feed.hpp"
+#include "db.hpp"
+#include "json.hpp"
+#include "publisher.hpp"
+
+#include <algorithm>
+
+namespace {
+
+const long long DEFAULT_PAGE_SIZE = 20;
+const long long MAX_PAGE_SIZE = 100;
+
+// Cursors are "<published_at>.<id>" of the last item on the previous page.
+bool parse_cursor(const std::string &cursor, long long &published_at,
+                  long long &id) {
+  size_t dot = cursor.find('.');
+  return dot != std::string::npos &&
+         parse_id(cursor.substr(0, dot), published_at) &&
+         parse_id(cursor.substr(dot + 1), id);
+}
+
+void handle_feed_request(const HttpRequest &req, HttpResponse &res) {
+  long long site_id;
+  long long type_id = -1;
+  long long limit = DEFAULT_PAGE_SIZE;
+  if (!parse_id(req.param("site_id"), site_id) ||
+      (!req.param("type_id").empty() &&
+       !parse_id(req.param("type_id"), type_id)) ||
+      (!req.param("limit").empty() && !parse_id(req.param("limit"), limit)) ||
+      limit < 1) {
+    res.send(400, "Missing or invalid site_id, type_id or limit parameter");
+    return;
+  }
+  limit = std::min(limit, MAX_PAGE_SIZE);
+
+  std::string sql = "SELECT id, published_at, title, slug, type_id, "
+                    "thumbnail_url, image_count, thumbnail_blurhash, "
+                    "thumbnail_color FROM feed WHERE site_id = ?";
+  std::vector<SqlParam> params{site_id};
+  if (type_id >= 0) {
+    sql += " AND type_id = ?";
+    params.emplace_back(type_id);
+  }
+  std::string cursor = req.param("cursor");
+  if (!cursor.empty()) {
+    long long published_at, id;
+    if (!parse_cursor(cursor, published_at, id)) {
+      res.send(400, "Invalid cursor");
+      return;
+    }
+    sql += " AND (published_at, id) < (?, ?)";
+    params.emplace_back(published_at);
+    params.emplace_back(id);
+  }
+  // One extra row tells whether another page exists
+  sql += " ORDER BY published_at DESC, id DESC LIMIT ?";
+  params.emplace_back(limit + 1);
+
+  std::string items;
+  std::string next_cursor = "null";
+  long long count = 0;
+  PooledDb db(db_pool());
+  bool ok = db && query_rows(db, sql, params, [&](sqlite3_stmt *stmt) {
+              if (++count > limit)
+                return;
+              if (count == limit)
+                next_cursor = json_string(
+                    std::to_string(sqlite3_column_int64(stmt, 1)) + "." +
+                    std::to_string(sqlite3_column_int64(stmt, 0)));
+              if (!items.empty())
+                items += ",";
+              items += "{\"id\":" + json_column(stmt, 0) +
+                       ",\"published_at\":" + json_column(stmt, 1) +
+                       ",\"title\":" + json_column(stmt, 2) +
+                       ",\"slug\":" + json_column(stmt, 3) +
+                       ",\"type_id\":" + json_column(stmt, 4) +
+                       ",\"thumbnail_url\":" + json_column(stmt, 5) +
+                       ",\"image_count\":" + json_column(stmt, 6) +
+                       ",\"thumbnail_blurhash\":" + json_column(stmt, 7) +
+                       ",\"thumbnail_color\":" + json_column(stmt, 8) + "}";
+            });
+  if (!ok) {
+    res.send(500, "Feed query failed");
+    return;
+  }
+  if (count <= limit)
+    next_cursor = "null";
+
+  res.content_type = "application/json";
+  res.send(200, "{\"items\":[" + items + "],\"next_cursor\":" + next_cursor +
+                    "}");
+}
+
+} // namespace
+
+bool refresh_feed_entry(WriteTxn &txn, long long content_id) {
+  return txn.exec("DELETE FROM feed WHERE id = ? AND NOT EXISTS (SELECT 1 "
+                  "FROM content_blocks WHERE id = ? AND status = "
+                  "'published')",
+                  {content_id, content_id}) &&
+         txn.exec("INSERT INTO feed (id, site_id, type_id, published_at, "
+                  "title, slug, thumbnail_url, image_count, "
+                  "thumbnail_blurhash, thumbnail_color) "
+                  "SELECT cb.id, cb.site_id, cb.type_id, "
+                  "CAST(strftime('%s', 'now') AS INTEGER), cb.title, "
+                  "cb.url_slug, cb.thumbnail_url, (SELECT COUNT(*) FROM "
+                  // Thumbnail variants are renditions, not images of the item
+                  "images i WHERE i.content_id = cb.id AND i.image_type = "
+                  "'content'), p.blurhash, "
+                  "p.dominant_color "
+                  "FROM content_blocks cb "
+                  // Placeholder of the thumbnail's own images row, else of
+                  // the first image that has one: a sochee thumbnail is cut
+                  // from its first carousel image
+                  "LEFT JOIN images p ON p.id = COALESCE((SELECT i.id FROM "
+                  "images i WHERE i.content_id = cb.id AND i.original_url = "
+                  "cb.thumbnail_url AND i.blurhash IS NOT NULL), (SELECT "
+                  "MIN(i.id) FROM images i WHERE i.content_id = cb.id AND "
+                  "i.blurhash IS NOT NULL)) "
+                  "WHERE cb.id = ? AND cb.status = 'published' "
+                  "ON CONFLICT (id) DO UPDATE SET site_id = excluded.site_id, "
+                  "type_id = excluded.type_id, title = excluded.title, "
+                  "slug = excluded.slug, thumbnail_url = "
+                  "excluded.thumbnail_url, image_count = "
+                  "excluded.image_count, thumbnail_blurhash = "
+                  "excluded.thumbnail_blurhash, thumbnail_color = "
+                  "excluded.thumbnail_color",
+                  {content_id});
+}
+
+void register_feed_routes(HttpServer &server) {
+  server.route("/feed", handle_feed_request);
+}
@@ -0,0 +1,19 @@
+// feed.hpp
+#pragma once
+
+#include "db_writer.hpp"
+#include "http_server.hpp"
+
+// Denormalized per-site listing kept in the feed table (schema migration 2).
+// Rows are rewritten inside the publish transaction, so the feed never shows
+// content whose write rolled back.
+
+// Upserts the feed row of content_id from content_blocks and images, or
+// removes it when the content is no longer published. published_at is kept
+// from the first publish so a republish does not move the item to the top.
+bool refresh_feed_entry(WriteTxn &txn, long long content_id);
+
+// GET /feed?site_id=&type_id=&limit=&cursor=
+// Keyset pagination on (published_at, id): each page is an index range scan
+// starting at the cursor returned by the previous page.
+void register_feed_routes(HttpServer &server);
@@ -1,9 +1,12 @@
 // http_server.hpp
 #pragma once
 
+#include <algorithm>
+#include <cctype>
 #include <functional>
 #include <map>
 #include <netinet/in.h>
+#include <set>
 #include <string>
 #include <unordered_map>
 
@@ -15,11 +18,44 @@ struct HttpRequest {
   std::map<std::string, std::string> headers;
   std::map<std::string, std::string> query_params;
   std::string body;
+  // Set instead of `body` for streamed uploads (HttpServer::stream_bodies):
+  // pulls up to n bytes of the body, 0 at its end and -1 on a read error
+  std::function<long long(char *, size_t)> read_body;
+
+  // Query parameter value, or "" when absent
+  std::string param(const std::string &key) const {
+    auto it = query_params.find(key);
+    return it == query_params.end() ? "" : it->second;
+  }
+
+  // Header value by case-insensitive name, or "" when absent
+  std::string header(const std::string &name) const {
+    for (const auto &[key, value] : headers) {
+      if (key.size() == name.size() &&
+          std::equal(key.begin(), key.end(), name.begin(),
+                     [](unsigned char a, unsigned char b) {
+                       return std::tolower(a) == std::tolower(b);
+                     }))
+        return value;
+    }
+    return "";
+  }
 };
 
+// Non-negative decimal id from a path segment or query value
+inline bool parse_id(const std::string &text, long long &id) {
+  if (text.empty() || text.size() > 18 ||
+      !std::all_of(text.begin(), text.end(),
+                   [](unsigned char c) { return std::isdigit(c); }))
+    return false;
+  id = std::stoll(text);
+  return true;
+}
+
 struct HttpResponse {
   int status = 200;
   std::string body;
+  std::string content_type = "text/plain";
 
   void send(int code, const std::string &response_body) {
     status = code;
@@ -32,6 +68,14 @@ struct HttpServer {
   std::map<std::string,
            std::function<void(const HttpRequest &, HttpResponse &)>>
       handlers;
+  // Matched by longest prefix when no exact route exists, e.g. "/content/"
+  std::map<std::string,
+           std::function<void(const HttpRequest &, HttpResponse &)>>
+      prefix_handlers;
+  // Content-Types whose bodies are handed to the handler unread, per path
+  std::map<std::string, std::set<std::string>> streamed_types;
+  // Connections handled at once; later clients wait to be accepted
+  size_t max_connections = 64;
 
   HttpServer(int p) : port(p) {}
 
@@ -40,5 +84,23 @@ struct HttpServer {
     handlers[path] = h;
   }
 
+  void route_prefix(const std::string &prefix,
+                    std::function<void(const HttpRequest &, HttpResponse &)> h) {
+    prefix_handlers[prefix] = h;
+  }
+
+  // Requests to `path` with one of these Content-Types get `read_body`
+  // instead of a buffered body, so uploads larger than MAX_BODY_BYTES can be
+  // consumed as they arrive. They must carry a Content-Length.
+  void stream_bodies(const std::string &path,
+                     const std::set<std::string> &content_types) {
+    streamed_types[path] = content_types;
+  }
+
   void run(); // Implemented in cpp
+
+private:
+  void dispatch(const HttpRequest &request, HttpResponse &response);
+  bool streams_body(const HttpRequest &request) const;
+  void handle_client(int client_fd);
 };
@@ -2,22 +2,59 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <sstream>
+#include <thread>
+
+// Path lists for /publish/batch can be long; anything larger is refused
+// unless the route streams its body (HttpServer::stream_bodies).
+const size_t MAX_HEADER_BYTES = 64 * 1024;
+const size_t MAX_BODY_BYTES = 8 * 1024 * 1024;
+// Read and dropped after refusing a streamed body, so the client is likely
+// to see the response rather than a reset
+const size_t LINGER_BYTES = 256 * 1024;
+const int LINGER_TIMEOUT_S = 1;
+
+// Decode %XX escapes and '+' in a query string component
+std::string url_decode(const std::string &s) {
+  std::string out;
+  out.reserve(s.size());
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '%' && i + 2 < s.size() &&
+        isxdigit((unsigned char)s[i + 1]) &&
+        isxdigit((unsigned char)s[i + 2])) {
+      out += static_cast<char>(std::stoi(s.substr(i + 1, 2), nullptr, 16));
+      i += 2;
+    } else if (s[i] == '+') {
+      out += ' ';
+    } else {
+      out += s[i];
+    }
+  }
+  return out;
+}
 
 // Parse query string from URL
 void parse_query_string(HttpRequest &req, const std::string &query_string) {
   std::string key, value;
   bool parsing_key = true;
   for (char c : query_string) {
-    if (c == '=') {
+    if (c == '=' && parsing_key) {
       parsing_key = false;
     } else if (c == '&') {
       if (!key.empty()) {
-        req.query_params[key] = value;
+        req.query_params[url_decode(key)] = url_decode(value);
       }
       key.clear();
       value.clear();
@@ -31,7 +68,7 @@ void parse_query_string(HttpRequest &req, const std::string &query_string) {
     }
   }
   if (!key.empty()) {
-    req.query_params[key] = value;
+    req.query_params[url_decode(key)] = url_decode(value);
   }
 }
 
@@ -88,6 +125,177 @@ void parse_request(const std::string &request_str, HttpRequest &req) {
   }
 }
 
+// Reads until the end of the head; body bytes that arrived with it stay in
+// request_str. Returns false on a closed connection or an oversized head.
+bool read_head(int client_fd, std::string &request_str, size_t &header_end) {
+  char buffer[4096];
+  while (true) {
+    header_end = request_str.find("\r\n\r\n");
+    if (header_end != std::string::npos) {
+      header_end += 4;
+      return true;
+    }
+    if (request_str.size() > MAX_HEADER_BYTES)
+      return false;
+    ssize_t bytes_read = read(client_fd, buffer, sizeof(buffer));
+    if (bytes_read <= 0) {
+      // Keep the old leniency for clients that close without a blank line
+      header_end = request_str.size();
+      return !request_str.empty();
+    }
+    request_str.append(buffer, bytes_read);
+  }
+}
+
+// Reads the rest of a Content-Length body into request_str; a short body
+// is handed to the handler as it arrived
+void read_body(int client_fd, std::string &request_str, size_t expected) {
+  char buffer[4096];
+  while (request_str.size() < expected) {
+    ssize_t bytes_read = read(client_fd, buffer, sizeof(buffer));
+    if (bytes_read <= 0)
+      return;
+    request_str.append(buffer, bytes_read);
+  }
+}
+
+unsigned long long content_length(const HttpRequest &request) {
+  return std::strtoull(request.header("Content-Length").c_str(), nullptr, 10);
+}
+
+bool HttpServer::streams_body(const HttpRequest &request) const {
+  auto it = streamed_types.find(request.path);
+  if (it == streamed_types.end() || request.method != "POST")
+    return false;
+  std::string type = request.header("Content-Type");
+  type = type.substr(0, type.find(';'));
+  type.erase(type.find_last_not_of(" \t") + 1);
+  std::transform(type.begin(), type.end(), type.begin(),
+                 [](unsigned char c) { return (char)std::tolower(c); });
+  return it->second.count(type) > 0;
+}
+
+void HttpServer::dispatch(const HttpRequest &request,
+                          HttpResponse &response) {
+  auto handler = handlers.find(request.path);
+  if (handler != handlers.end()) {
+    handler->second(request, response);
+  } else {
+    // Longest matching prefix route, e.g. "/content/" for "/content/42"
+    auto prefix = prefix_handlers.end();
+    for (auto it = prefix_handlers.begin(); it != prefix_handlers.end(); ++it) {
+      if (request.path.rfind(it->first, 0) == 0 &&
+          (prefix == prefix_handlers.end() ||
+           it->first.size() > prefix->first.size()))
+        prefix = it;
+    }
+    if (prefix != prefix_handlers.end()) {
+      prefix->second(request, response);
+    } else {
+      response.send(404, "Not Found");
+    }
+  }
+}
+
+void HttpServer::handle_client(int client_fd) {
+  std::string request_str;
+  size_t header_end;
+  if (!read_head(client_fd, request_str, header_end)) {
+    close(client_fd);
+    return;
+  }
+
+  HttpRequest request;
+  HttpResponse response;
+
+  // Parse the HTTP request
+  parse_request(request_str.substr(0, header_end), request);
+  unsigned long long length = content_length(request);
+  if (streams_body(request)) {
+    // Body bytes already read come first, then the socket up to the length
+    auto pending = std::make_shared<std::string>(
+        request_str.substr(header_end, length));
+    auto remaining =
+        std::make_shared<unsigned long long>(length - pending->size());
+    request.read_body = [client_fd, pending,
+                         remaining](char *out, size_t n) -> long long {
+      if (!pending->empty()) {
+        size_t got = std::min(n, pending->size());
+        memcpy(out, pending->data(), got);
+        pending->erase(0, got);
+        return (long long)got;
+      }
+      if (*remaining == 0)
+        return 0;
+      ssize_t got = read(client_fd, out, std::min<unsigned long long>(
+                                              n, *remaining));
+      if (got <= 0)
+        return -1;
+      *remaining -= (unsigned long long)got;
+      return got;
+    };
+  } else {
+    if (length > MAX_BODY_BYTES) {
+      close(client_fd);
+      return;
+    }
+    read_body(client_fd, request_str, header_end + length);
+    if (request.method == "POST")
+      request.body = request_str.substr(header_end);
+  }
+
+  // Debug output
+  std::cout << "Received request: " << request.method << " " << request.path
+            << std::endl;
+  for (const auto &[key, value] : request.query_params) {
+    std::cout << "Query param: " << key << " = " << value << std::endl;
+  }
+
+  try {
+    dispatch(request, response);
+  } catch (const std::exception &e) {
+    std::cerr << "Handler for " << request.path << " threw: " << e.what()
+              << std::endl;
+    response = HttpResponse();
+    response.send(500, "Internal Server Error");
+  }
+
+  // A refused streamed body (411, 413, a bad archive) is not read to its
+  // end, which would accept the size the handler just refused. Otherwise
+  // drain what the handler left unread so the client sees the response
+  // instead of a reset connection.
+  bool refused = request.read_body && response.status >= 400;
+  if (request.read_body && !refused) {
+    char buffer[16384];
+    while (request.read_body(buffer, sizeof(buffer)) > 0) {
+    }
+  }
+
+  std::string http_response =
+      "HTTP/1.1 " + std::to_string(response.status) +
+      " OK\r\nContent-Length: " + std::to_string(response.body.size()) +
+      "\r\nContent-Type: " + response.content_type +
+      "\r\nConnection: close\r\n\r\n" + response.body;
+
+  send(client_fd, http_response.c_str(), http_response.size(), 0);
+  if (refused) {
+    // Closing with unread bytes queued would reset the connection and may
+    // discard the response; linger briefly on a half-closed socket instead
+    shutdown(client_fd, SHUT_WR);
+    timeval timeout{LINGER_TIMEOUT_S, 0};
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    auto until = std::chrono::steady_clock::now() +
+                 std::chrono::seconds(LINGER_TIMEOUT_S);
+    char buffer[16384];
+    size_t dropped = 0;
+    ssize_t got;
+    while (dropped < LINGER_BYTES && std::chrono::steady_clock::now() < until &&
+           (got = read(client_fd, buffer, sizeof(buffer))) > 0)
+      dropped += (size_t)got;
+  }
+  close(client_fd);
+}
+
 void HttpServer::run() {
   int server_fd = socket(AF_INET, SOCK_STREAM, 0);
   if (server_fd == -1) {
@@ -120,49 +328,43 @@ void HttpServer::run() {
 
   std::cout << "Server running on port " << port << "...\n";
 
+  // Connections being handled, shared with their detached threads
+  struct OpenConnections {
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t count = 0;
+  };
+  auto open = std::make_shared<OpenConnections>();
+  size_t limit = std::max<size_t>(1, max_connections);
+
   while (true) {
+    {
+      // At the limit, further clients wait in the listen backlog
+      std::unique_lock<std::mutex> lock(open->mutex);
+      open->cv.wait(lock, [&] { return open->count < limit; });
+      ++open->count;
+    }
+
     sockaddr_in client_address;
     socklen_t client_len = sizeof(client_address);
     int client_fd = accept(server_fd, (sockaddr *)&client_address, &client_len);
     if (client_fd < 0) {
       std::cerr << "Failed to accept connection.\n";
+      std::lock_guard<std::mutex> lock(open->mutex);
+      --open->count;
       continue;
     }
 
-    char buffer[4096] = {0};
-    ssize_t bytes_read = read(client_fd, buffer, sizeof(buffer));
-    if (bytes_read <= 0) {
-      close(client_fd);
-      continue;
-    }
-
-    HttpRequest request;
-    HttpResponse response;
-
-    // Parse the HTTP request
-    std::string request_str(buffer, bytes_read);
-    parse_request(request_str, request);
-
-    // Debug output
-    std::cout << "Received request: " << request.method << " " << request.path
-              << std::endl;
-    for (const auto &[key, value] : request.query_params) {
-      std::cout << "Query param: " << key << " = " << value << std::endl;
-    }
-
-    if (handlers.find(request.path) != handlers.end()) {
-      handlers[request.path](request, response);
-    } else {
-      response.send(404, "Not Found");
-    }
-
-    std::string http_response =
-        "HTTP/1.1 " + std::to_string(response.status) +
-        " OK\r\nContent-Length: " + std::to_string(response.body.size()) +
-        "\r\nContent-Type: text/plain\r\n\r\n" + response.body;
-
-    send(client_fd, http_response.c_str(), http_response.size(), 0);
-    close(client_fd);
+    // Each connection gets its own thread so slow publishes overlap; their
+    // database writes are grouped by the single DB writer.
+    std::thread([this, client_fd, open] {
+      handle_client(client_fd);
+      {
+        std::lock_guard<std::mutex> lock(open->mutex);
+        --open->count;
+      }
+      open->cv.notify_one();
+    }).detach();
   }
 
   close(server_fd);
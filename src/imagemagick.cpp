@@ -0,0 +1,248 @@
+#include "imagemagick.hpp"
+#include "process.hpp"
+#include "publisher.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+// -print goes through stdio, which is block-buffered on a pipe; stdbuf
+// makes magick flush every answer line
+const std::vector<std::string> WORKER_ARGV = {"stdbuf", "-oL", "magick",
+                                              "-script", "-"};
+
+struct Worker {
+  CoProcess process;
+  long long ops = 0; // since it was started
+};
+
+class WorkerPool {
+public:
+  explicit WorkerPool(size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+      workers.push_back(std::make_unique<Worker>());
+      idle.push_back(workers.back().get());
+    }
+  }
+
+  size_t size() const { return workers.size(); }
+
+  // nullptr when the deadline passes first
+  Worker *acquire(Deadline deadline) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto available = [&] { return !idle.empty(); };
+    if (deadline == Deadline::max())
+      cv.wait(lock, available);
+    else if (!cv.wait_until(lock, deadline, available))
+      return nullptr;
+    Worker *worker = idle.back();
+    idle.pop_back();
+    return worker;
+  }
+
+  void release(Worker *worker) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      idle.push_back(worker);
+    }
+    cv.notify_one();
+  }
+
+private:
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<Worker *> idle;
+  std::mutex mutex;
+  std::condition_variable cv;
+};
+
+// nullptr when workers are off or magick cannot run
+WorkerPool *worker_pool() {
+  static std::unique_ptr<WorkerPool> pool = []() -> std::unique_ptr<WorkerPool> {
+    long long size = env_or("PUBLISHER_IMAGEMAGICK_WORKERS", 0LL);
+    if (size <= 0)
+      return nullptr;
+    CallResult version = run_process({"magick", "-version"});
+    if (!version) {
+      log_to_file("ImageMagick workers disabled, magick is unavailable: " +
+                  version.error);
+      return nullptr;
+    }
+    log_to_file("Using " + std::to_string(size) + " ImageMagick workers");
+    return std::make_unique<WorkerPool>((size_t)size);
+  }();
+  return pool.get();
+}
+
+// Script tokens cannot carry line breaks; such ops start a tool instead
+bool scriptable(const ImageOp &op) {
+  auto plain = [](const std::string &text) {
+    return text.find_first_of("\n\r", 0, 3) == std::string::npos;
+  };
+  return plain(op.input) && plain(op.output) &&
+         std::all_of(op.options.begin(), op.options.end(), plain);
+}
+
+std::string script_token(const std::string &text) {
+  bool bare = !text.empty() && text[0] != '#';
+  for (char c : text) {
+    if (!std::isalnum((unsigned char)c) &&
+        std::string("-+_./:=,!@^%x").find(c) == std::string::npos)
+      bare = false;
+  }
+  if (bare)
+    return text;
+  std::string quoted = "\"";
+  for (char c : text) {
+    if (c == '"' || c == '\\')
+      quoted += '\\';
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+// The parentheses keep settings such as -gravity from leaking into the
+// next op (the worker runs with -respect-parentheses). The size of the
+// result comes back on one line, then "end <n>" marks the end of the
+// answer even when the read failed.
+std::string op_script(const ImageOp &op, long long token) {
+  bool measure_only = op.options.empty() && op.output.empty();
+  std::string script = "( ";
+  if (measure_only)
+    script += "-ping ";
+  script += "-read " + script_token(op.input);
+  if (measure_only)
+    script += " +ping";
+  for (const auto &option : op.options)
+    script += " " + script_token(option);
+  if (!op.output.empty())
+    script += " -write " + script_token(op.output);
+  return script + " ) -print '%w %h\\n' -delete 0--1 -print 'end " +
+         std::to_string(token) + "\\n'\n";
+}
+
+// Same op as a one-off convert or identify run
+std::vector<std::string> tool_argv(const ImageOp &op) {
+  if (op.options.empty() && op.output.empty())
+    return {"identify", "-format", "%w %h\\n", op.input};
+  std::vector<std::string> argv = {"convert", op.input};
+  argv.insert(argv.end(), op.options.begin(), op.options.end());
+  if (!op.output.empty()) {
+    argv.push_back("-write");
+    argv.push_back(op.output);
+  }
+  argv.insert(argv.end(), {"-format", "%w %h\\n", "info:"});
+  return argv;
+}
+
+// "<width> <height>" from the first line of a size answer, "" if unusable
+std::string parse_size(const std::string &text) {
+  int width = 0, height = 0;
+  if (std::sscanf(text.c_str(), "%d %d", &width, &height) != 2 ||
+      width <= 0 || height <= 0)
+    return "";
+  return std::to_string(width) + " " + std::to_string(height);
+}
+
+CallResult run_tool(const ImageOp &op) {
+  CallResult result = run_process(tool_argv(op));
+  if (result) {
+    result.value = parse_size(result.value);
+    if (result.value.empty())
+      return CallResult::failed(CallStatus::Permanent,
+                                op.input + ": no image size reported");
+  }
+  return result;
+}
+
+CallResult run_on_worker(Worker &worker, const ImageOp &op) {
+  Deadline deadline = tool_deadline();
+  long long max_ops =
+      std::max(1LL, env_or("PUBLISHER_IMAGEMAGICK_WORKER_OPS", 500LL));
+  if (worker.process.running() && worker.ops >= max_ops)
+    worker.process.stop();
+  if (!worker.process.running()) {
+    worker.ops = 0;
+    CallResult started = worker.process.start(WORKER_ARGV);
+    if (started)
+      started = worker.process.send("-respect-parentheses\n", deadline);
+    if (!started) {
+      worker.process.stop();
+      return started;
+    }
+  }
+
+  long long token = ++worker.ops;
+  CallResult result = worker.process.send(op_script(op, token), deadline);
+  std::string size, end = "end " + std::to_string(token);
+  while (result) {
+    result = worker.process.read_line(deadline);
+    if (!result || result.value == end)
+      break;
+    if (size.empty())
+      size = result.value;
+  }
+  if (!result) {
+    // The worker may be stuck mid-op; only a fresh one is safe to reuse
+    worker.process.stop();
+    return CallResult::failed(result.status, op.input + ": " + result.error);
+  }
+
+  std::string errors = worker.process.take_errors();
+  size = parse_size(size);
+  if (size.empty() || errors.find("@ error/") != std::string::npos ||
+      errors.find("@ fatal/") != std::string::npos)
+    return CallResult::failed(CallStatus::Permanent,
+                              op.input + ": " +
+                                  (errors.empty() ? "no image size reported"
+                                                  : errors));
+  return CallResult::ok(size);
+}
+
+} // namespace
+
+std::vector<CallResult> run_image_ops(const std::vector<ImageOp> &ops) {
+  std::vector<CallResult> results(ops.size());
+  WorkerPool *pool = worker_pool();
+  if (!pool) {
+    for (size_t i = 0; i < ops.size(); ++i)
+      results[i] =
+          call_with_retry("imagemagick", [&] { return run_tool(ops[i]); });
+    return results;
+  }
+
+  // One thread per worker taken, each pulling the next op
+  std::atomic<size_t> next{0};
+  Deadline deadline = current_deadline();
+  auto work = [&] {
+    DeadlineScope scope(deadline);
+    Worker *worker = pool->acquire(deadline);
+    for (size_t i; (i = next++) < ops.size();) {
+      if (!worker)
+        results[i] = CallResult::failed(
+            CallStatus::DeadlineExceeded,
+            ops[i].input + ": timed out waiting for an ImageMagick worker");
+      else if (!scriptable(ops[i]))
+        results[i] =
+            call_with_retry("imagemagick", [&] { return run_tool(ops[i]); });
+      else
+        results[i] = call_with_retry(
+            "imagemagick", [&] { return run_on_worker(*worker, ops[i]); });
+    }
+    if (worker)
+      pool->release(worker);
+  };
+  std::vector<std::thread> helpers;
+  for (size_t t = 1; t < std::min(pool->size(), ops.size()); ++t)
+    helpers.emplace_back(work);
+  work();
+  for (auto &helper : helpers)
+    helper.join();
+  return results;
+}
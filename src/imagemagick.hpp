@@ -0,0 +1,31 @@
+// imagemagick.hpp
+#pragma once
+
+#include "resilience.hpp"
+
+#include <string>
+#include <vector>
+
+// ImageMagick work for the publish pipeline. By default every operation
+// starts `convert` or `identify` (see process.hpp). With
+// PUBLISHER_IMAGEMAGICK_WORKERS above 0 the operations go to a pool of
+// that many long-lived `magick -script -` processes instead, so a batch
+// pays for starting ImageMagick once per worker rather than once per
+// image. A worker that times out or dies is killed and started again, and
+// each one is replaced after PUBLISHER_IMAGEMAGICK_WORKER_OPS operations.
+// Without a usable `magick` (ImageMagick 6) the pool falls back to
+// starting the tools per operation.
+
+struct ImageOp {
+  std::string input;
+  // convert options applied after reading, e.g. {"-resize", "640x480!"}
+  std::vector<std::string> options;
+  // Written after the options; "" only measures the result
+  std::string output;
+};
+
+// Runs the ops, spread over the workers, and returns their results in the
+// same order. A result's value is "<width> <height>" of the image after
+// the options. Transient failures go through call_with_retry() under the
+// "imagemagick" breaker.
+std::vector<CallResult> run_image_ops(const std::vector<ImageOp> &ops);
@@ -0,0 +1,493 @@
+#include "images.hpp"
+#include "imagemagick.hpp"
+#include "process.hpp"
+#include "publisher.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+struct ThumbnailFormat {
+  const char *ext;
+  const char *mime_type;
+  std::vector<std::string> options;
+};
+
+std::vector<ThumbnailFormat> thumbnail_formats() {
+  std::string webp_quality =
+      std::to_string(env_or("PUBLISHER_THUMBNAIL_WEBP_QUALITY", 80LL));
+  std::string jpeg_quality =
+      std::to_string(env_or("PUBLISHER_THUMBNAIL_JPEG_QUALITY", 82LL));
+  return {{".webp",
+           "image/webp",
+           {"-quality", webp_quality, "-define", "webp:method=6"}},
+          {".jpg",
+           "image/jpeg",
+           {"-quality", jpeg_quality, "-interlace", "JPEG",
+            "-sampling-factor", "4:2:0"}}};
+}
+
+// Ascending widths from a "400,800" list; bad entries are skipped
+std::vector<int> thumbnail_widths() {
+  std::vector<int> widths;
+  std::istringstream list(env_or("PUBLISHER_THUMBNAIL_WIDTHS",
+                                 std::string("400,800")));
+  std::string item;
+  while (std::getline(list, item, ',')) {
+    int width = std::atoi(item.c_str());
+    if (width > 0)
+      widths.push_back(width);
+  }
+  std::sort(widths.begin(), widths.end());
+  widths.erase(std::unique(widths.begin(), widths.end()), widths.end());
+  return widths;
+}
+
+// Edge of the square RGB sample placeholders are computed from
+const int SAMPLE_EDGE = 32;
+
+const char BASE83[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+                      "#$%*+,-.:;=?@[]^_{|}~";
+
+void append_base83(int value, int digits, std::string &out) {
+  int divisor = 1;
+  for (int i = 1; i < digits; ++i)
+    divisor *= 83;
+  for (; divisor > 0; divisor /= 83)
+    out += BASE83[(value / divisor) % 83];
+}
+
+const std::array<float, 256> SRGB_TO_LINEAR = [] {
+  std::array<float, 256> table{};
+  for (int i = 0; i < 256; ++i) {
+    float v = i / 255.0f;
+    table[i] = v <= 0.04045f ? v / 12.92f : std::pow((v + 0.055f) / 1.055f, 2.4f);
+  }
+  return table;
+}();
+
+int linear_to_srgb(float value) {
+  float v = std::clamp(value, 0.0f, 1.0f);
+  if (v <= 0.0031308f)
+    return (int)(v * 12.92f * 255 + 0.5f);
+  return (int)((1.055f * std::pow(v, 1 / 2.4f) - 0.055f) * 255 + 0.5f);
+}
+
+// BlurHash (https://blurha.sh) of the sample, with nx * ny components.
+// The cosine transform is separable: each basis row is first applied to
+// whole sample rows, an element-wise loop the compiler vectorizes.
+std::string blurhash(const std::vector<unsigned char> &rgb, int nx, int ny) {
+  const int n = SAMPLE_EDGE;
+  std::vector<float> planes[3];
+  for (int c = 0; c < 3; ++c) {
+    planes[c].resize(n * n);
+    for (int p = 0; p < n * n; ++p)
+      planes[c][p] = SRGB_TO_LINEAR[rgb[p * 3 + c]];
+  }
+  auto basis = [n](int k, int at) {
+    return std::cos((float)M_PI * k * at / n);
+  };
+
+  // factors[(j * nx + i) * 3 + c]
+  std::vector<float> factors(nx * ny * 3);
+  std::vector<float> column(n);
+  for (int c = 0; c < 3; ++c) {
+    for (int j = 0; j < ny; ++j) {
+      std::fill(column.begin(), column.end(), 0.0f);
+      for (int y = 0; y < n; ++y) {
+        float weight = basis(j, y);
+        const float *row = &planes[c][y * n];
+        for (int x = 0; x < n; ++x)
+          column[x] += weight * row[x];
+      }
+      for (int i = 0; i < nx; ++i) {
+        float sum = 0;
+        for (int x = 0; x < n; ++x)
+          sum += basis(i, x) * column[x];
+        float normalisation = (i == 0 && j == 0) ? 1.0f : 2.0f;
+        factors[(j * nx + i) * 3 + c] = sum * normalisation / (n * n);
+      }
+    }
+  }
+
+  std::string hash;
+  append_base83((nx - 1) + (ny - 1) * 9, 1, hash);
+  float max_value = 1;
+  if (nx * ny > 1) {
+    float actual_max = 0;
+    for (size_t k = 3; k < factors.size(); ++k)
+      actual_max = std::max(actual_max, std::fabs(factors[k]));
+    int quantised = std::clamp((int)std::floor(actual_max * 166 - 0.5f), 0, 82);
+    max_value = (quantised + 1) / 166.0f;
+    append_base83(quantised, 1, hash);
+  } else {
+    append_base83(0, 1, hash);
+  }
+  append_base83((linear_to_srgb(factors[0]) << 16) +
+                    (linear_to_srgb(factors[1]) << 8) +
+                    linear_to_srgb(factors[2]),
+                4, hash);
+  auto quantise = [max_value](float v) {
+    float scaled = v / max_value;
+    float root = std::copysign(std::sqrt(std::fabs(scaled)), scaled);
+    return std::clamp((int)std::floor(root * 9 + 9.5f), 0, 18);
+  };
+  for (size_t k = 3; k < factors.size(); k += 3)
+    append_base83(quantise(factors[k]) * 19 * 19 +
+                      quantise(factors[k + 1]) * 19 +
+                      quantise(factors[k + 2]),
+                  2, hash);
+  return hash;
+}
+
+// Mean colour of the most populated cell of a 16x16x16 RGB grid
+std::string dominant_color(const std::vector<unsigned char> &rgb) {
+  std::vector<unsigned> counts(4096);
+  std::vector<unsigned> sums(4096 * 3);
+  for (size_t p = 0; p + 2 < rgb.size(); p += 3) {
+    int cell = (rgb[p] >> 4) << 8 | (rgb[p + 1] >> 4) << 4 | rgb[p + 2] >> 4;
+    counts[cell]++;
+    for (int c = 0; c < 3; ++c)
+      sums[cell * 3 + c] += rgb[p + c];
+  }
+  int best = (int)(std::max_element(counts.begin(), counts.end()) -
+                   counts.begin());
+  char color[8];
+  std::snprintf(color, sizeof(color), "#%02x%02x%02x",
+                sums[best * 3] / counts[best], sums[best * 3 + 1] / counts[best],
+                sums[best * 3 + 2] / counts[best]);
+  return color;
+}
+
+// Quality range searched when transcoding originals
+const int TRANSCODE_QUALITY_MIN = 30;
+const int TRANSCODE_QUALITY_MAX = 95;
+// Longest edge of the grey samples SSIM is computed on
+const int SSIM_SAMPLE_EDGE = 512;
+
+struct TranscodeFormat {
+  const char *ext;
+  std::vector<std::string> options;
+};
+
+// True when `convert -list format` shows AVIF with write support
+bool avif_writable() {
+  static const bool writable = [] {
+    std::istringstream formats(
+        run_process({"convert", "-list", "format"}).value);
+    std::string line;
+    while (std::getline(formats, line)) {
+      std::istringstream fields(line);
+      std::string name, module, mode;
+      fields >> name >> module >> mode;
+      if ((name == "AVIF" || name == "AVIF*") &&
+          mode.find('w') != std::string::npos)
+        return true;
+    }
+    return false;
+  }();
+  return writable;
+}
+
+std::vector<TranscodeFormat> transcode_formats() {
+  std::vector<TranscodeFormat> formats = {
+      {".webp", {"-define", "webp:method=6"}}};
+  if (avif_writable())
+    formats.push_back({".avif", {"-define", "heic:speed=6"}});
+  return formats;
+}
+
+// Grey sample of image, at most SSIM_SAMPLE_EDGE on its longest side
+bool grey_sample(const std::string &image, std::vector<unsigned char> &grey,
+                 int &width, int &height) {
+  std::string edge = std::to_string(SSIM_SAMPLE_EDGE);
+  fs::path path = "/tmp/" + generate_uuid() + ".gray";
+  CallResult written = run_image_ops(
+      {{image,
+        {"-auto-orient", "-colorspace", "Gray", "-resize",
+         edge + "x" + edge + ">", "-depth", "8"},
+        "gray:" + path.string()}})[0];
+  std::istringstream(written.value) >> width >> height;
+  std::ifstream in(path, std::ios::binary);
+  grey.assign((size_t)std::max(0, width) * std::max(0, height), 0);
+  in.read(reinterpret_cast<char *>(grey.data()), grey.size());
+  bool complete = written && in.gcount() == (std::streamsize)grey.size();
+  in.close();
+  std::error_code ec;
+  fs::remove(path, ec);
+  return complete && !grey.empty();
+}
+
+// Mean SSIM over 8x8 windows stepped by 4 (the whole image when smaller)
+double ssim(const std::vector<unsigned char> &a,
+            const std::vector<unsigned char> &b, int width, int height) {
+  const double c1 = 6.5025, c2 = 58.5225; // (0.01 * 255)^2, (0.03 * 255)^2
+  int win_w = std::min(8, width), win_h = std::min(8, height);
+  double total = 0;
+  int windows = 0;
+  for (int y = 0; y + win_h <= height; y += std::max(1, win_h / 2)) {
+    for (int x = 0; x + win_w <= width; x += std::max(1, win_w / 2)) {
+      double sum_a = 0, sum_b = 0, sum_aa = 0, sum_bb = 0, sum_ab = 0;
+      for (int dy = 0; dy < win_h; ++dy) {
+        const unsigned char *row_a = &a[(size_t)(y + dy) * width + x];
+        const unsigned char *row_b = &b[(size_t)(y + dy) * width + x];
+        for (int dx = 0; dx < win_w; ++dx) {
+          double va = row_a[dx], vb = row_b[dx];
+          sum_a += va;
+          sum_b += vb;
+          sum_aa += va * va;
+          sum_bb += vb * vb;
+          sum_ab += va * vb;
+        }
+      }
+      double n = win_w * win_h;
+      double mean_a = sum_a / n, mean_b = sum_b / n;
+      double var_a = sum_aa / n - mean_a * mean_a;
+      double var_b = sum_bb / n - mean_b * mean_b;
+      double cov = sum_ab / n - mean_a * mean_b;
+      total += ((2 * mean_a * mean_b + c1) * (2 * cov + c2)) /
+               ((mean_a * mean_a + mean_b * mean_b + c1) * (var_a + var_b + c2));
+      windows++;
+    }
+  }
+  return windows ? total / windows : 0;
+}
+
+} // namespace
+
+std::vector<std::string>
+placeholder_sample_options(const fs::path &sample_path) {
+  std::string edge = std::to_string(SAMPLE_EDGE);
+  // Transparent areas are flattened onto white, as most pages show them
+  return {"(",       "+clone",        "-background", "white",
+          "-alpha",  "remove",        "-resize",     edge + "x" + edge + "!",
+          "-depth",  "8",             "-write",      "rgb:" + sample_path.string(),
+          "+delete", ")"};
+}
+
+ImagePlaceholder placeholder_from_sample(const fs::path &sample, int width,
+                                         int height) {
+  std::vector<unsigned char> rgb(SAMPLE_EDGE * SAMPLE_EDGE * 3);
+  std::ifstream in(sample, std::ios::binary);
+  in.read(reinterpret_cast<char *>(rgb.data()), rgb.size());
+  bool complete = in.gcount() == (std::streamsize)rgb.size();
+  in.close();
+  std::error_code ec;
+  fs::remove(sample, ec);
+  if (!complete || width <= 0 || height <= 0)
+    return {};
+
+  // 4 components along the longer side, 3 along the other
+  int nx = width >= height ? 4 : 3;
+  int ny = width >= height ? 3 : 4;
+  return {blurhash(rgb, nx, ny), dominant_color(rgb)};
+}
+
+std::string sniff_image_mime(const fs::path &file) {
+  unsigned char head[16] = {};
+  std::ifstream in(file, std::ios::binary);
+  in.read(reinterpret_cast<char *>(head), sizeof(head));
+  size_t n = (size_t)in.gcount();
+  auto starts = [&](size_t at, const char *magic) {
+    size_t len = std::strlen(magic);
+    return n >= at + len && std::memcmp(head + at, magic, len) == 0;
+  };
+
+  if (n >= 3 && head[0] == 0xff && head[1] == 0xd8 && head[2] == 0xff)
+    return "image/jpeg";
+  if (starts(0, "\x89PNG\r\n\x1a\n"))
+    return "image/png";
+  if (starts(0, "GIF87a") || starts(0, "GIF89a"))
+    return "image/gif";
+  if (starts(0, "RIFF") && starts(8, "WEBP"))
+    return "image/webp";
+  if (starts(0, "BM"))
+    return "image/bmp";
+  if (starts(0, "II*") || (starts(0, "MM") && n >= 4 && head[2] == 0 &&
+                             head[3] == 0x2a))
+    return "image/tiff";
+  if (starts(4, "ftyp")) {
+    if (starts(8, "avif") || starts(8, "avis"))
+      return "image/avif";
+    if (starts(8, "heic") || starts(8, "heix") || starts(8, "mif1") ||
+        starts(8, "msf1"))
+      return "image/heic";
+  }
+  return "";
+}
+
+bool is_animated_png(const fs::path &file) {
+  std::ifstream in(file, std::ios::binary);
+  in.seekg(8); // signature
+  unsigned char header[8];
+  while (in.read(reinterpret_cast<char *>(header), sizeof(header))) {
+    if (std::memcmp(header + 4, "acTL", 4) == 0)
+      return true;
+    if (std::memcmp(header + 4, "IDAT", 4) == 0)
+      return false;
+    uint32_t length = (uint32_t)header[0] << 24 | header[1] << 16 |
+                      header[2] << 8 | header[3];
+    in.seekg((std::streamoff)length + 4, std::ios::cur); // data and CRC
+  }
+  return false;
+}
+
+CallResult make_thumbnail_variants(const fs::path &source,
+                                   std::vector<ImageVariant> &variants) {
+  variants.clear();
+  if (sniff_image_mime(source).empty())
+    return CallResult::failed(CallStatus::Permanent,
+                              source.string() + " is not a known image format");
+
+  // Measured as the variants are rendered: a photo stored rotated has its
+  // edges swapped once oriented
+  CallResult measured =
+      run_image_ops({{source.string(), {"-auto-orient"}, ""}})[0];
+  if (!measured)
+    return measured;
+  int source_width = 0;
+  std::istringstream(measured.value) >> source_width;
+
+  // Widths at or past the source would all give the source size; only the
+  // first of them is rendered
+  std::vector<int> widths;
+  for (int width : thumbnail_widths()) {
+    widths.push_back(std::min(width, source_width));
+    if (width >= source_width)
+      break;
+  }
+
+  std::string stem = "/tmp/" + generate_uuid();
+  std::vector<ImageOp> ops;
+  for (int width : widths) {
+    for (const auto &format : thumbnail_formats()) {
+      ImageOp op{source.string(),
+                 {"-auto-orient", "-thumbnail", std::to_string(width) + "x",
+                  "-strip"},
+                 stem + "-" + std::to_string(width) + format.ext};
+      op.options.insert(op.options.end(), format.options.begin(),
+                        format.options.end());
+      ops.push_back(op);
+
+      ImageVariant variant;
+      variant.path = op.output;
+      variant.ext = format.ext;
+      variant.mime_type = format.mime_type;
+      variants.push_back(variant);
+    }
+  }
+
+  // The smallest variant carries the placeholder sample
+  fs::path sample = stem + ".rgb";
+  std::vector<std::string> sample_options = placeholder_sample_options(sample);
+  ops[0].options.insert(ops[0].options.end(), sample_options.begin(),
+                        sample_options.end());
+
+  std::vector<CallResult> results = run_image_ops(ops);
+  for (size_t i = 0; i < variants.size(); ++i) {
+    std::error_code ec;
+    std::istringstream(results[i].value) >> variants[i].width >>
+        variants[i].height;
+    variants[i].bytes = fs::file_size(variants[i].path, ec);
+    if (!results[i] || ec) {
+      CallResult failed =
+          results[i] ? CallResult::failed(CallStatus::Permanent,
+                                           variants[i].path.string() +
+                                               " was not written")
+                     : results[i];
+      for (const auto &variant : variants)
+        fs::remove(variant.path, ec);
+      fs::remove(sample, ec);
+      variants.clear();
+      return failed;
+    }
+  }
+
+  ImagePlaceholder placeholder = placeholder_from_sample(
+      sample, variants[0].width, variants[0].height);
+  for (auto &variant : variants)
+    variant.placeholder = placeholder;
+  return CallResult::ok();
+}
+
+fs::path transcode_original(const fs::path &source) {
+  if (env_or("PUBLISHER_TRANSCODE_ORIGINALS", 0LL) <= 0)
+    return {};
+  // GIFs and APNGs may be animated; unknown files are left to the browser
+  std::string mime = sniff_image_mime(source);
+  if (mime.empty() || mime == "image/gif" ||
+      (mime == "image/png" && is_animated_png(source)))
+    return {};
+  bool displayable = mime == "image/jpeg" || mime == "image/png" ||
+                     mime == "image/webp" || mime == "image/avif";
+  double min_ssim =
+      std::atof(env_or("PUBLISHER_TRANSCODE_MIN_SSIM", std::string("0.98"))
+                    .c_str());
+
+  std::vector<unsigned char> reference;
+  int width = 0, height = 0;
+  if (!grey_sample(source.string(), reference, width, height)) {
+    log_to_file("Cannot sample " + source.string() + ", not transcoded");
+    return {};
+  }
+
+  std::error_code ec;
+  fs::path best;
+  uintmax_t best_bytes = displayable ? fs::file_size(source, ec) : UINTMAX_MAX;
+  for (const auto &format : transcode_formats()) {
+    // Lowest quality that still looks like the source
+    fs::path passing;
+    int passing_quality = 0;
+    int low = TRANSCODE_QUALITY_MIN, high = TRANSCODE_QUALITY_MAX;
+    while (low <= high) {
+      int quality = (low + high) / 2;
+      fs::path encoded = "/tmp/" + generate_uuid() + format.ext;
+      ImageOp op{source.string(),
+                 {"-auto-orient", "-quality", std::to_string(quality)},
+                 encoded.string()};
+      op.options.insert(op.options.end(), format.options.begin(),
+                        format.options.end());
+      std::vector<unsigned char> sample;
+      int sample_width = 0, sample_height = 0;
+      bool similar =
+          run_image_ops({op})[0] &&
+          grey_sample(encoded.string(), sample, sample_width, sample_height) &&
+          sample_width == width && sample_height == height &&
+          ssim(reference, sample, width, height) >= min_ssim;
+      if (similar) {
+        if (!passing.empty())
+          fs::remove(passing, ec);
+        passing = encoded;
+        passing_quality = quality;
+        high = quality - 1;
+      } else {
+        fs::remove(encoded, ec);
+        low = quality + 1;
+      }
+    }
+    if (passing.empty())
+      continue;
+
+    uintmax_t bytes = fs::file_size(passing, ec);
+    log_to_file("Transcoded " + source.string() + " to " + format.ext +
+                " at quality " + std::to_string(passing_quality) + ": " +
+                std::to_string(bytes) + " bytes");
+    if (!ec && bytes < best_bytes) {
+      if (!best.empty())
+        fs::remove(best, ec);
+      best = passing;
+      best_bytes = bytes;
+    } else {
+      fs::remove(passing, ec);
+    }
+  }
+  return best;
+}
@@ -0,0 +1,73 @@
+// images.hpp
+#pragma once
+
+#include "resilience.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Derived images built at publish time. A thumbnail source becomes one
+// WebP and one JPEG per width in PUBLISHER_THUMBNAIL_WIDTHS, never wider
+// than the source, oriented and stripped of metadata, at
+// PUBLISHER_THUMBNAIL_WEBP_QUALITY / PUBLISHER_THUMBNAIL_JPEG_QUALITY.
+// All variants are rendered as one ImageMagick batch (imagemagick.hpp).
+//
+// With PUBLISHER_TRANSCODE_ORIGINALS=1, media originals are re-encoded as
+// WebP, and as AVIF where the local ImageMagick can write it. Each format
+// is encoded at the lowest quality whose SSIM against the source stays at
+// or above PUBLISHER_TRANSCODE_MIN_SSIM, found by binary search. SSIM is
+// computed here on grey samples ImageMagick writes of both images. The
+// smallest encoding replaces the original only when it is smaller, except
+// for formats browsers cannot show (BMP, TIFF, HEIC), which are always
+// replaced.
+//
+// Thumbnails and sochee carousel images also get a placeholder: a BlurHash
+// string and a dominant colour that pages show until the image has loaded.
+// Both come from a 32x32 RGB sample that ImageMagick writes next to the
+// real output, from pixels it has already decoded for it.
+
+struct ImagePlaceholder {
+  std::string blurhash;
+  std::string color; // "#rrggbb"
+};
+
+struct ImageVariant {
+  // Temporary file named "<uuid>-<target width><ext>", removed by the caller
+  std::filesystem::path path;
+  std::string ext; // ".webp", ".jpg"
+  std::string mime_type;
+  int width = 0;
+  int height = 0;
+  uintmax_t bytes = 0;
+  ImagePlaceholder placeholder; // the same for every variant
+};
+
+// "image/<type>" from the file's leading bytes, "" when it is not an image
+// format the pipeline knows
+std::string sniff_image_mime(const std::filesystem::path &file);
+
+// True when a PNG file is animated (APNG): an acTL chunk comes before the
+// image data. Re-encoding one would keep only its first frame.
+bool is_animated_png(const std::filesystem::path &file);
+
+// Renders the thumbnail variants of source, smallest first. On failure no
+// variant files are left behind.
+CallResult make_thumbnail_variants(const std::filesystem::path &source,
+                                   std::vector<ImageVariant> &variants);
+
+// Options to append to an ImageOp so it also writes the placeholder sample
+// of its result to sample_path
+std::vector<std::string>
+placeholder_sample_options(const std::filesystem::path &sample_path);
+
+// Placeholder from a sample written by those options, which is removed.
+// width and height are the image's size, which picks the number of
+// BlurHash components. Empty fields when the sample is unusable.
+ImagePlaceholder placeholder_from_sample(const std::filesystem::path &sample,
+                                         int width, int height);
+
+// File to upload in place of an original image: a temporary transcoded
+// file the caller removes, or an empty path to upload source as it is
+std::filesystem::path transcode_original(const std::filesystem::path &source);
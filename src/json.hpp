@@ -0,0 +1,66 @@
+// json.hpp
+#pragma once
+
+#include <cstdio>
+#include <sqlite3.h>
+#include <string>
+
+// Minimal helpers for the hand-built JSON responses of the read API.
+
+inline std::string json_string(const std::string &s) {
+  std::string out = "\"";
+  out.reserve(s.size() + 2);
+  for (unsigned char c : s) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      if (c < 0x20) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "\\u%04x", c);
+        out += buf;
+      } else {
+        out += static_cast<char>(c);
+      }
+    }
+  }
+  out += '"';
+  return out;
+}
+
+// Nullable text column value
+inline std::string json_string_or_null(const unsigned char *text) {
+  return text ? json_string(reinterpret_cast<const char *>(text)) : "null";
+}
+
+// Result column as a JSON number, string or null
+inline std::string json_column(sqlite3_stmt *stmt, int col) {
+  switch (sqlite3_column_type(stmt, col)) {
+  case SQLITE_NULL:
+    return "null";
+  case SQLITE_INTEGER:
+    return std::to_string(sqlite3_column_int64(stmt, col));
+  default:
+    return json_string_or_null(sqlite3_column_text(stmt, col));
+  }
+}
+
+// Milliseconds rounded for timing summaries
+inline std::string json_ms(double ms) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.1f", ms);
+  return buf;
+}
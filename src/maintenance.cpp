@@ -0,0 +1,248 @@
+#include "maintenance.hpp"
+#include "db.hpp"
+#include "db_writer.hpp"
+#include "feed.hpp"
+#include "json.hpp"
+#include "publisher.hpp"
+#include "related.hpp"
+#include "search.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Items per write batch; small enough that a live server's publishes are
+// not held behind one long transaction
+const size_t REINDEX_CHUNK = 200;
+const size_t MAX_LISTED_PROBLEMS = 100;
+
+const char *const PUBLISHED_IDS =
+    "SELECT id FROM content_blocks WHERE status = 'published'";
+
+struct IndexedContent {
+  long long id;
+  SearchDocument doc;
+};
+
+std::string read_page_text(long long content_id) {
+  std::ifstream in(fs::path(STORAGE_ROOT) / std::to_string(content_id) /
+                   "index.html");
+  if (!in)
+    return "";
+  std::stringstream buffer;
+  buffer << in.rdbuf();
+  return extract_visible_text(buffer.str());
+}
+
+// Published content with the metadata columns of its search document
+bool load_published(sqlite3 *db, std::vector<IndexedContent> &contents) {
+  std::unordered_map<long long, size_t> position;
+  return query_rows(db,
+                    "SELECT cb.id, cb.title, s.caption, s.location FROM "
+                    "content_blocks cb LEFT JOIN sochee s ON s.id = cb.id "
+                    "WHERE cb.status = 'published' ORDER BY cb.id",
+                    {},
+                    [&](sqlite3_stmt *stmt) {
+                      auto text = [&](int col) {
+                        const unsigned char *v = sqlite3_column_text(stmt, col);
+                        return v ? std::string((const char *)v) : "";
+                      };
+                      IndexedContent content{sqlite3_column_int64(stmt, 0), {}};
+                      content.doc.title = text(1);
+                      content.doc.caption = text(2);
+                      content.doc.location = text(3);
+                      position[content.id] = contents.size();
+                      contents.push_back(std::move(content));
+                    }) &&
+         query_rows(db,
+                    "SELECT ct.content_id, t.name FROM content_tags ct JOIN "
+                    "tags t ON t.id = ct.tag_id ORDER BY ct.rowid",
+                    {}, [&](sqlite3_stmt *stmt) {
+                      auto it = position.find(sqlite3_column_int64(stmt, 0));
+                      const unsigned char *name = sqlite3_column_text(stmt, 1);
+                      if (it == position.end() || !name)
+                        return;
+                      std::string &tags = contents[it->second].doc.tags;
+                      tags += (tags.empty() ? "" : " ") +
+                              std::string((const char *)name);
+                    });
+}
+
+} // namespace
+
+bool reindex_content(size_t workers, std::string &report) {
+  auto started = std::chrono::steady_clock::now();
+  std::vector<IndexedContent> contents;
+  {
+    PooledDb db(db_pool());
+    if (!db || !load_published(db, contents)) {
+      log_to_file("Reindex: failed to read published content");
+      report = "{\"command\":\"reindex\",\"ok\":false}";
+      return false;
+    }
+  }
+  double load_ms = ms_since(started);
+
+  auto phase = std::chrono::steady_clock::now();
+  std::atomic<size_t> next{0};
+  std::vector<std::thread> pool;
+  for (size_t w = 0; w < std::max<size_t>(1, std::min(workers, contents.size()));
+       ++w) {
+    pool.emplace_back([&] {
+      for (size_t i = next++; i < contents.size(); i = next++)
+        contents[i].doc.body = read_page_text(contents[i].id);
+    });
+  }
+  for (auto &thread : pool)
+    thread.join();
+  double extract_ms = ms_since(phase);
+
+  phase = std::chrono::steady_clock::now();
+  std::vector<std::future<WriteResult>> writes;
+  for (size_t begin = 0; begin < contents.size(); begin += REINDEX_CHUNK) {
+    size_t end = std::min(contents.size(), begin + REINDEX_CHUNK);
+    writes.push_back(db_writer().submit([&contents, begin, end](WriteTxn &txn) {
+      for (size_t i = begin; i < end; ++i) {
+        if (!refresh_feed_entry(txn, contents[i].id) ||
+            !index_search_document(txn, contents[i].id, contents[i].doc))
+          return false;
+      }
+      return true;
+    }));
+  }
+  // Rows of content that was unpublished or deleted behind our back
+  writes.push_back(db_writer().submit([](WriteTxn &txn) {
+    return txn.exec(std::string("DELETE FROM feed WHERE id NOT IN (") +
+                        PUBLISHED_IDS + ")",
+                    {}) &&
+           txn.exec(std::string("DELETE FROM search_index WHERE rowid NOT "
+                                "IN (") +
+                        PUBLISHED_IDS + ")",
+                    {});
+  }));
+  size_t failed = 0;
+  for (auto &write : writes) {
+    WriteResult result = write.get();
+    if (!result.ok) {
+      log_to_file("Reindex: write batch failed: " + result.error);
+      ++failed;
+    }
+  }
+  WriteResult optimized = write_sync([](WriteTxn &txn) {
+    return txn.exec("INSERT INTO search_index (search_index) VALUES "
+                    "('optimize')",
+                    {});
+  });
+  if (!optimized.ok)
+    ++failed;
+  double write_ms = ms_since(phase);
+
+  phase = std::chrono::steady_clock::now();
+  bool warmed;
+  {
+    PooledDb db(db_pool());
+    warmed = db && related_index().warm(db);
+  }
+  if (!warmed || !write_sync([](WriteTxn &txn) {
+                    return related_index().rebuild(txn);
+                  }).ok)
+    ++failed;
+  double related_ms = ms_since(phase);
+
+  log_to_file("Reindexed " + std::to_string(contents.size()) +
+              " published items, " + std::to_string(failed) +
+              " failed writes");
+  report = "{\"command\":\"reindex\",\"ok\":" +
+           std::string(failed ? "false" : "true") +
+           ",\"indexed\":" + std::to_string(contents.size()) +
+           ",\"failed_writes\":" + std::to_string(failed) +
+           ",\"jobs\":" + std::to_string(workers) +
+           ",\"timings_ms\":{\"load\":" + json_ms(load_ms) +
+           ",\"extract\":" + json_ms(extract_ms) +
+           ",\"write\":" + json_ms(write_ms) +
+           ",\"related\":" + json_ms(related_ms) +
+           ",\"total\":" + json_ms(ms_since(started)) + "}}";
+  return failed == 0;
+}
+
+bool verify_content(std::string &report) {
+  auto started = std::chrono::steady_clock::now();
+  std::string listed;
+  size_t problems = 0;
+  auto problem = [&](const char *check, long long content_id,
+                     const std::string &detail) {
+    if (++problems > MAX_LISTED_PROBLEMS)
+      return;
+    if (!listed.empty())
+      listed += ",";
+    listed += "{\"check\":" + json_string(check) + ",\"content_id\":" +
+              (content_id >= 0 ? std::to_string(content_id) : "null") +
+              ",\"detail\":" + json_string(detail) + "}";
+  };
+  size_t files = 0;
+  PooledDb db(db_pool());
+  auto each_id = [&](const char *check, const std::string &sql,
+                     const char *detail) {
+    return query_rows(db, sql, {}, [&](sqlite3_stmt *stmt) {
+      problem(check, sqlite3_column_int64(stmt, 0), detail);
+    });
+  };
+
+  bool ok =
+      db &&
+      query_rows(db, "PRAGMA quick_check", {},
+                 [&](sqlite3_stmt *stmt) {
+                   std::string result = (const char *)sqlite3_column_text(stmt, 0);
+                   if (result != "ok")
+                     problem("integrity", -1, result);
+                 }) &&
+      query_rows(db,
+                 "SELECT content_id, file_path FROM content_files WHERE "
+                 "file_path LIKE ? || '%'",
+                 {STORAGE_ROOT}, [&](sqlite3_stmt *stmt) {
+                   ++files;
+                   std::string path = (const char *)sqlite3_column_text(stmt, 1);
+                   std::error_code ec;
+                   if (!fs::exists(path, ec))
+                     problem("missing_file", sqlite3_column_int64(stmt, 0),
+                             path);
+                 }) &&
+      each_id("missing_from_feed",
+              std::string(PUBLISHED_IDS) +
+                  " AND id NOT IN (SELECT id FROM feed)",
+              "published content has no feed row") &&
+      each_id("stale_feed_row",
+              std::string("SELECT id FROM feed WHERE id NOT IN (") +
+                  PUBLISHED_IDS + ")",
+              "feed row for content that is not published") &&
+      each_id("missing_from_search",
+              std::string(PUBLISHED_IDS) +
+                  " AND id NOT IN (SELECT rowid FROM search_index)",
+              "published content is not in the search index") &&
+      each_id("stale_search_row",
+              std::string("SELECT rowid FROM search_index WHERE rowid NOT "
+                          "IN (") +
+                  PUBLISHED_IDS + ")",
+              "search row for content that is not published");
+  if (!ok)
+    log_to_file("Verify: queries failed");
+
+  report = "{\"command\":\"verify\",\"ok\":" +
+           std::string(ok && !problems ? "true" : "false") +
+           ",\"files_checked\":" + std::to_string(files) +
+           ",\"problem_count\":" + std::to_string(problems) +
+           ",\"problems\":[" + listed +
+           "],\"elapsed_ms\":" + json_ms(ms_since(started)) + "}";
+  return ok && !problems;
+}
@@ -0,0 +1,20 @@
+// maintenance.hpp
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Offline jobs run by the CLI against the same database and STORAGE_ROOT as
+// the server. Each fills `report` with a JSON summary and returns false when
+// the job failed or found problems.
+
+// Rebuilds the derived tables (feed, search_index, related_content) from
+// content_blocks and the installed article pages. Pages are read and
+// tokenized on `workers` threads; rows are written in chunks through the DB
+// writer so a running server keeps publishing meanwhile.
+bool reindex_content(size_t workers, std::string &report);
+
+// Read-only consistency check: SQLite integrity, files referenced by
+// content_files, and published content missing from (or left over in) the
+// feed and search index.
+bool verify_content(std::string &report);
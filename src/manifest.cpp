@@ -0,0 +1,308 @@
+#include "manifest.hpp"
+#include "imagemagick.hpp"
+#include "publisher.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <mutex>
+#include <sstream>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+ContentManifest::Category category_of(const std::string &rel,
+                                      const std::string &type) {
+  if (rel == "metadata.txt")
+    return ContentManifest::Category::Metadata;
+  size_t slash = rel.find('/');
+  std::string top = slash == std::string::npos ? "" : rel.substr(0, slash);
+  if (top == "media")
+    return ContentManifest::Category::Media;
+  if (top == "thumbnail")
+    return ContentManifest::Category::Thumbnail;
+  if (top == "link")
+    return ContentManifest::Category::Link;
+  // Page files may sit in css/, js/, assets/ or any other subdirectory
+  return VM_ALLOWED.count(type) ? ContentManifest::Category::Page
+                                : ContentManifest::Category::Other;
+}
+
+std::string parent_of(const std::string &rel) {
+  size_t slash = rel.rfind('/');
+  return slash == std::string::npos ? "" : rel.substr(0, slash);
+}
+
+// Layout of the records returned by getdents64(2)
+struct LinuxDirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+// Parallel walk of one tree. Every directory is a task; a worker pops its
+// own newest task and steals the oldest one of another worker when it runs
+// dry, so wide trees spread out while deep ones stay on one thread. Helper
+// threads start only once a worker has more queued subdirectories than it
+// can take itself, so small articles are walked on the calling thread.
+class TreeWalk {
+public:
+  TreeWalk(int root_fd, fs::path root, size_t max_workers)
+      : root_fd(root_fd), root(std::move(root)),
+        workers(std::max<size_t>(1, max_workers)) {}
+
+  bool run(std::vector<ContentManifest::Entry> &entries,
+           std::unordered_set<std::string> &dirs) {
+    dirs.insert("");
+    push(0, "");
+    work(0);
+    {
+      std::lock_guard<std::mutex> lock(spawn_mutex);
+      for (auto &thread : threads)
+        thread.join();
+    }
+    for (auto &worker : workers) {
+      for (auto &entry : worker.entries)
+        entries.push_back(std::move(entry));
+      dirs.insert(worker.dirs.begin(), worker.dirs.end());
+    }
+    return !failed;
+  }
+
+private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<std::string> tasks; // directories relative to the root
+    std::vector<ContentManifest::Entry> entries;
+    std::vector<std::string> dirs;
+  };
+
+  void push(size_t self, std::string rel) {
+    pending++;
+    std::lock_guard<std::mutex> lock(workers[self].mutex);
+    workers[self].tasks.push_back(std::move(rel));
+  }
+
+  bool take(size_t self, std::string &rel) {
+    {
+      std::lock_guard<std::mutex> lock(workers[self].mutex);
+      if (!workers[self].tasks.empty()) {
+        rel = std::move(workers[self].tasks.back());
+        workers[self].tasks.pop_back();
+        return true;
+      }
+    }
+    for (size_t i = 1; i < workers.size(); ++i) {
+      Worker &victim = workers[(self + i) % workers.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        rel = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void work(size_t self) {
+    std::string rel;
+    while (pending > 0) {
+      if (!take(self, rel)) {
+        std::this_thread::yield();
+        continue;
+      }
+      if (!failed && !read_dir(self, rel))
+        failed = true;
+      pending--;
+    }
+  }
+
+  void maybe_spawn(size_t self) {
+    {
+      std::lock_guard<std::mutex> lock(workers[self].mutex);
+      if (workers[self].tasks.size() < 2)
+        return;
+    }
+    std::lock_guard<std::mutex> lock(spawn_mutex);
+    if (threads.size() + 1 >= workers.size())
+      return;
+    size_t index = threads.size() + 1;
+    threads.emplace_back([this, index] { work(index); });
+  }
+
+  bool read_dir(size_t self, const std::string &rel) {
+    int fd = rel.empty() ? dup(root_fd)
+                         : openat(root_fd, rel.c_str(),
+                                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      log_to_file("Cannot open " + rel + " for scanning: " +
+                  std::string(strerror(errno)));
+      return false;
+    }
+    Worker &worker = workers[self];
+    alignas(LinuxDirent64) char buf[32 * 1024];
+    bool ok = true;
+    while (true) {
+      long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+      if (n <= 0) {
+        ok = n == 0;
+        break;
+      }
+      for (long pos = 0; pos < n;) {
+        const auto *dirent = reinterpret_cast<LinuxDirent64 *>(buf + pos);
+        pos += dirent->d_reclen;
+        std::string name = dirent->d_name;
+        if (name == "." || name == "..")
+          continue;
+        std::string child = rel.empty() ? name : rel + "/" + name;
+
+        // Symlinked files are published, symlinked directories are not
+        // followed, as with std::filesystem's default iteration
+        unsigned char type = dirent->d_type;
+        if (type == DT_DIR) {
+          worker.dirs.push_back(child);
+          push(self, std::move(child));
+          continue;
+        }
+        struct stat st;
+        if ((type != DT_REG && type != DT_LNK && type != DT_UNKNOWN) ||
+            fstatat(fd, name.c_str(), &st, 0) != 0)
+          continue;
+        if (S_ISDIR(st.st_mode)) {
+          if (type == DT_UNKNOWN) {
+            worker.dirs.push_back(child);
+            push(self, std::move(child));
+          }
+          continue;
+        }
+        if (!S_ISREG(st.st_mode))
+          continue;
+
+        ContentManifest::Entry entry;
+        entry.path = root / child;
+        entry.rel = std::move(child);
+        entry.ext = fs::path(name).extension().string();
+        entry.type = entry.ext.empty() ? "bin" : entry.ext.substr(1);
+        entry.category = category_of(entry.rel, entry.type);
+        entry.size = (uintmax_t)st.st_size;
+        worker.entries.push_back(std::move(entry));
+      }
+      maybe_spawn(self);
+    }
+    close(fd);
+    return ok;
+  }
+
+  int root_fd;
+  fs::path root;
+  std::vector<Worker> workers;
+  std::atomic<size_t> pending{0};
+  std::atomic<bool> failed{false};
+  std::mutex spawn_mutex;
+  std::vector<std::thread> threads;
+};
+
+} // namespace
+
+bool ContentManifest::scan(const fs::path &dir) {
+  root = dir;
+  entries.clear();
+  by_rel.clear();
+  dirs.clear();
+  dimensions.clear();
+
+  int root_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (root_fd < 0)
+    return false;
+  TreeWalk walk(root_fd, dir,
+                (size_t)std::max(1LL, env_or("PUBLISHER_SCAN_THREADS", 4LL)));
+  bool ok = walk.run(entries, dirs);
+  close(root_fd);
+  if (!ok)
+    return false;
+
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) { return a.rel < b.rel; });
+  for (size_t i = 0; i < entries.size(); ++i)
+    by_rel[entries[i].rel] = i;
+  log_to_file("Scanned " + dir.string() + ": " +
+              std::to_string(entries.size()) + " files in " +
+              std::to_string(dirs.size()) + " directories");
+  return true;
+}
+
+bool ContentManifest::has_dir(const std::string &rel) const {
+  return dirs.count(rel) > 0;
+}
+
+const ContentManifest::Entry *
+ContentManifest::find(const std::string &rel) const {
+  auto it = by_rel.find(rel);
+  return it == by_rel.end() ? nullptr : &entries[it->second];
+}
+
+std::vector<const ContentManifest::Entry *>
+ContentManifest::files_in(const std::string &rel_dir) const {
+  std::vector<const Entry *> files;
+  for (const auto &entry : entries) {
+    if (parent_of(entry.rel) == rel_dir)
+      files.push_back(&entry);
+  }
+  return files;
+}
+
+std::vector<const ContentManifest::Entry *>
+ContentManifest::files_of(Category category) const {
+  std::vector<const Entry *> files;
+  for (const auto &entry : entries) {
+    if (entry.category == category)
+      files.push_back(&entry);
+  }
+  return files;
+}
+
+ImageDimensions ContentManifest::image_dimensions(const Entry &entry) {
+  return image_dimensions(std::vector<const Entry *>{&entry})[0];
+}
+
+std::vector<ImageDimensions>
+ContentManifest::image_dimensions(const std::vector<const Entry *> &batch) {
+  std::vector<ImageOp> ops;
+  std::vector<const Entry *> measured;
+  for (const auto *entry : batch) {
+    if (dimensions.count(entry->rel) ||
+        std::find(measured.begin(), measured.end(), entry) != measured.end())
+      continue;
+    ops.push_back({entry->path.string(), {}, ""});
+    measured.push_back(entry);
+  }
+
+  std::vector<CallResult> results = run_image_ops(ops);
+  for (size_t i = 0; i < measured.size(); ++i) {
+    ImageDimensions dims;
+    if (results[i]) {
+      std::istringstream iss(results[i].value);
+      iss >> dims.width >> dims.height;
+    } else {
+      log_to_file("Cannot measure " + measured[i]->rel + ": " +
+                  results[i].error);
+    }
+    dimensions[measured[i]->rel] = dims;
+  }
+
+  std::vector<ImageDimensions> sizes;
+  for (const auto *entry : batch)
+    sizes.push_back(dimensions[entry->rel]);
+  return sizes;
+}
@@ -0,0 +1,58 @@
+// manifest.hpp
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+struct ImageDimensions {
+  int width = 0;
+  int height = 0;
+};
+
+// Files of an article or sochee directory, from one recursive walk that is
+// split over up to PUBLISHER_SCAN_THREADS threads for large trees. Every
+// publish stage looks files up here instead of walking or stat'ing the
+// directory again. Image dimensions are measured the first time a stage
+// asks for them and then cached. A manifest belongs to
+// one publish job and is not shared between threads.
+struct ContentManifest {
+  enum class Category { Metadata, Page, Media, Thumbnail, Link, Other };
+
+  struct Entry {
+    std::filesystem::path path; // on disk
+    std::string rel;            // relative to root, '/' separated
+    std::string ext;            // ".jpg", as spelled on disk
+    std::string type;           // extension without the dot, "bin" if none
+    Category category;
+    uintmax_t size;
+  };
+
+  std::filesystem::path root;
+
+  // Walks root; false when it is not a readable directory
+  bool scan(const std::filesystem::path &dir);
+
+  bool has_dir(const std::string &rel) const;
+  const Entry *find(const std::string &rel) const;
+  // Entries are ordered by relative path
+  // Files directly inside rel_dir ("" for the root)
+  std::vector<const Entry *> files_in(const std::string &rel_dir) const;
+  // Files of one category at any depth
+  std::vector<const Entry *> files_of(Category category) const;
+
+  // Pixel size reported by ImageMagick, {0, 0} when it cannot tell
+  ImageDimensions image_dimensions(const Entry &entry);
+  // The same for several images, measured as one batch
+  std::vector<ImageDimensions>
+  image_dimensions(const std::vector<const Entry *> &batch);
+
+private:
+  std::vector<Entry> entries;
+  std::unordered_map<std::string, size_t> by_rel;
+  std::unordered_set<std::string> dirs;
+  std::unordered_map<std::string, ImageDimensions> dimensions;
+};
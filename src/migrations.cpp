@@ -0,0 +1,171 @@
+#include "migrations.hpp"
+#include "publisher.hpp"
+
+#include <ctime>
+
+namespace {
+
+bool exec_sql(sqlite3 *db, const std::string &sql) {
+  char *err = nullptr;
+  if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err) != SQLITE_OK) {
+    log_to_file("Migration SQL failed: " +
+                std::string(err ? err : sqlite3_errmsg(db)));
+    sqlite3_free(err);
+    return false;
+  }
+  return true;
+}
+
+} // namespace
+
+const std::vector<Migration> &schema_migrations() {
+  static const std::vector<Migration> migrations = {
+      {1, "indexes for the publish path",
+       // Slug lookup; the rowid makes it covering for SELECT id. Not unique:
+       // sochee publishes may legitimately reuse a slug.
+       "CREATE INDEX IF NOT EXISTS idx_content_blocks_slug "
+       "ON content_blocks (url_slug, site_id, type_id);"
+       // INSERT OR IGNORE INTO tags relies on name being unique. Fold any
+       // duplicate names into the lowest id first.
+       "UPDATE content_tags SET tag_id = (SELECT MIN(d.id) FROM tags t "
+       "JOIN tags d ON d.name = t.name WHERE t.id = content_tags.tag_id) "
+       "WHERE tag_id IN (SELECT t.id FROM tags t WHERE EXISTS (SELECT 1 "
+       "FROM tags d WHERE d.name = t.name AND d.id < t.id));"
+       "DELETE FROM tags WHERE EXISTS (SELECT 1 FROM tags d "
+       "WHERE d.name = tags.name AND d.id < tags.id);"
+       "CREATE UNIQUE INDEX IF NOT EXISTS idx_tags_name ON tags (name);"
+       "CREATE INDEX IF NOT EXISTS idx_content_tags_content "
+       "ON content_tags (content_id, tag_id);"
+       "CREATE INDEX IF NOT EXISTS idx_content_tags_tag "
+       "ON content_tags (tag_id, content_id);"
+       "CREATE INDEX IF NOT EXISTS idx_content_files_content "
+       "ON content_files (content_id);"
+       "CREATE INDEX IF NOT EXISTS idx_images_content "
+       "ON images (content_id, image_type);"
+       "CREATE INDEX IF NOT EXISTS idx_sochee_order_sochee "
+       "ON sochee_order (sochee_id, photo_order);"},
+      {2, "materialized feed table",
+       "CREATE TABLE IF NOT EXISTS feed ("
+       "id INTEGER PRIMARY KEY, "
+       "site_id INTEGER NOT NULL, "
+       "type_id INTEGER NOT NULL, "
+       "published_at INTEGER NOT NULL, "
+       "title TEXT, "
+       "slug TEXT, "
+       "thumbnail_url TEXT, "
+       "image_count INTEGER NOT NULL DEFAULT 0);"
+       // The primary key is appended to each entry, so both indexes cover
+       // the (published_at, id) keyset order.
+       "CREATE INDEX IF NOT EXISTS idx_feed_site "
+       "ON feed (site_id, published_at DESC, id DESC);"
+       "CREATE INDEX IF NOT EXISTS idx_feed_site_type "
+       "ON feed (site_id, type_id, published_at DESC, id DESC);"
+       // Existing content has no publish time; backfilled rows share one and
+       // fall back to id order.
+       "INSERT OR IGNORE INTO feed (id, site_id, type_id, published_at, "
+       "title, slug, thumbnail_url, image_count) "
+       "SELECT cb.id, cb.site_id, cb.type_id, "
+       "CAST(strftime('%s', 'now') AS INTEGER), cb.title, cb.url_slug, "
+       "cb.thumbnail_url, (SELECT COUNT(*) FROM images i "
+       "WHERE i.content_id = cb.id) "
+       "FROM content_blocks cb WHERE cb.status = 'published';"},
+      {3, "full-text search index",
+       // rowid is the content id. Prefix indexes serve the trailing
+       // "term*" of search-as-you-type queries.
+       "CREATE VIRTUAL TABLE IF NOT EXISTS search_index USING fts5("
+       "title, tags, body, caption, location, "
+       "tokenize = 'unicode61 remove_diacritics 2', prefix = '2 3');"
+       // Default ranking: bm25 weighting title, tags, body, caption,
+       // location hits in that order of importance.
+       "INSERT INTO search_index (search_index, rank) "
+       "VALUES ('rank', 'bm25(10.0, 5.0, 1.0, 3.0, 2.0)');"
+       // Page text is only read at publish time; existing articles get
+       // their body indexed when next republished.
+       "INSERT INTO search_index (rowid, title, tags, body, caption, "
+       "location) "
+       "SELECT cb.id, cb.title, (SELECT group_concat(t.name, ' ') FROM "
+       "content_tags ct JOIN tags t ON t.id = ct.tag_id WHERE ct.content_id "
+       "= cb.id), '', s.caption, s.location "
+       "FROM content_blocks cb LEFT JOIN sochee s ON s.id = cb.id "
+       "WHERE cb.status = 'published';"},
+      {4, "precomputed related content",
+       // Filled by the publisher on startup and on every publish
+       "CREATE TABLE IF NOT EXISTS related_content ("
+       "content_id INTEGER NOT NULL, "
+       "rank INTEGER NOT NULL, "
+       "related_id INTEGER NOT NULL, "
+       "score REAL NOT NULL, "
+       "PRIMARY KEY (content_id, rank)) WITHOUT ROWID;"},
+      {5, "image sizes",
+       // Known for thumbnail variants rendered at publish time; NULL for
+       // images stored as uploaded
+       "ALTER TABLE images ADD COLUMN width INTEGER;"
+       "ALTER TABLE images ADD COLUMN height INTEGER;"
+       "ALTER TABLE images ADD COLUMN byte_size INTEGER;"},
+      {6, "image placeholders",
+       // BlurHash and "#rrggbb" computed at publish time; the feed copies
+       // those of each item's thumbnail
+       "ALTER TABLE images ADD COLUMN blurhash TEXT;"
+       "ALTER TABLE images ADD COLUMN dominant_color TEXT;"
+       "ALTER TABLE feed ADD COLUMN thumbnail_blurhash TEXT;"
+       "ALTER TABLE feed ADD COLUMN thumbnail_color TEXT;"},
+  };
+  return migrations;
+}
+
+int current_schema_version(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, "SELECT COALESCE(MAX(version), 0) FROM "
+                             "schema_version",
+                         -1, &stmt, nullptr) != SQLITE_OK)
+    return 0;
+  int version = 0;
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    version = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  return version;
+}
+
+bool run_migrations(sqlite3 *db) {
+  if (!exec_sql(db, "CREATE TABLE IF NOT EXISTS schema_version ("
+                    "version INTEGER PRIMARY KEY, "
+                    "description TEXT NOT NULL, "
+                    "applied_at INTEGER NOT NULL);"))
+    return false;
+
+  for (const auto &migration : schema_migrations()) {
+    if (!exec_sql(db, "BEGIN IMMEDIATE;"))
+      return false;
+
+    if (current_schema_version(db) >= migration.version) {
+      exec_sql(db, "COMMIT;");
+      continue;
+    }
+
+    log_to_file("Applying schema migration " +
+                std::to_string(migration.version) + ": " +
+                migration.description);
+    sqlite3_stmt *stmt = nullptr;
+    bool ok = exec_sql(db, migration.sql) &&
+              sqlite3_prepare_v2(db,
+                                 "INSERT INTO schema_version (version, "
+                                 "description, applied_at) VALUES (?, ?, ?)",
+                                 -1, &stmt, nullptr) == SQLITE_OK;
+    if (ok) {
+      sqlite3_bind_int(stmt, 1, migration.version);
+      sqlite3_bind_text(stmt, 2, migration.description.c_str(), -1,
+                        SQLITE_STATIC);
+      sqlite3_bind_int64(stmt, 3, (sqlite3_int64)time(nullptr));
+      ok = sqlite3_step(stmt) == SQLITE_DONE;
+    }
+    sqlite3_finalize(stmt);
+
+    if (!ok || !exec_sql(db, "COMMIT;")) {
+      log_to_file("Schema migration " + std::to_string(migration.version) +
+                  " failed: " + std::string(sqlite3_errmsg(db)));
+      sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,23 @@
+// migrations.hpp
+#pragma once
+
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+
+// One schema change owned by this service. Versions are applied in order,
+// each in its own transaction, and recorded in schema_version.
+struct Migration {
+  int version;
+  std::string description;
+  std::string sql;
+};
+
+const std::vector<Migration> &schema_migrations();
+
+// Highest applied version, 0 for a database this service never migrated.
+int current_schema_version(sqlite3 *db);
+
+// Applies every pending migration; safe to run concurrently from several
+// processes since each step re-checks the version under BEGIN IMMEDIATE.
+bool run_migrations(sqlite3 *db);
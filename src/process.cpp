@@ -0,0 +1,480 @@
+#include "process.hpp"
+#include "publisher.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Bytes moved per read/write on the pipes
+const size_t PIPE_BUFFER_BYTES = 64 * 1024;
+
+// Counting semaphore capping how many copies of one tool run at once
+class ToolSlots {
+public:
+  explicit ToolSlots(long long limit) : limit(std::max(1LL, limit)) {}
+
+  // False when the deadline passes first
+  bool acquire(Deadline deadline) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto free = [&] { return used < limit; };
+    if (deadline == Deadline::max())
+      cv.wait(lock, free);
+    else if (!cv.wait_until(lock, deadline, free))
+      return false;
+    ++used;
+    return true;
+  }
+
+  void release() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      --used;
+    }
+    cv.notify_one();
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable cv;
+  long long used = 0;
+  long long limit;
+};
+
+struct SlotGuard {
+  ToolSlots &slots;
+  ~SlotGuard() { slots.release(); }
+};
+
+ToolSlots &slots_for(const std::string &tool) {
+  static std::mutex mutex;
+  static std::map<std::string, std::unique_ptr<ToolSlots>> slots;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &entry = slots[tool];
+  if (!entry) {
+    std::string name = "PUBLISHER_";
+    for (char c : tool)
+      name += std::isalnum((unsigned char)c) ? (char)std::toupper(c) : '_';
+    name += "_SLOTS";
+    entry = std::make_unique<ToolSlots>(
+        env_or(name.c_str(), env_or("PUBLISHER_TOOL_SLOTS", 8LL)));
+  }
+  return *entry;
+}
+
+// posix_spawn has no rlimit attribute, so the limits are set on the child
+// right after it starts
+void apply_rlimits(pid_t pid) {
+  long long memory_mb = env_or("PUBLISHER_TOOL_MEMORY_MB", 0LL);
+  if (memory_mb > 0) {
+    rlimit limit{(rlim_t)memory_mb << 20, (rlim_t)memory_mb << 20};
+    prlimit(pid, RLIMIT_AS, &limit, nullptr);
+  }
+  long long cpu_s = env_or("PUBLISHER_TOOL_CPU_S", 0LL);
+  if (cpu_s > 0) {
+    rlimit limit{(rlim_t)cpu_s, (rlim_t)cpu_s};
+    prlimit(pid, RLIMIT_CPU, &limit, nullptr);
+  }
+}
+
+// Starts argv with stdin from in_fd (/dev/null when -1) and stdout and
+// stderr into out_fd and err_fd; 0 or the errno of the failure
+int spawn_tool(const std::vector<std::string> &argv, int in_fd, int out_fd,
+               int err_fd, pid_t &pid) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (in_fd >= 0)
+    posix_spawn_file_actions_adddup2(&actions, in_fd, 0);
+  else
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, out_fd, 1);
+  posix_spawn_file_actions_adddup2(&actions, err_fd, 2);
+
+  // Own process group so a timeout takes down the tool's children too.
+  // The service ignores SIGPIPE; the tool gets the default back.
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t defaults, empty;
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGPIPE);
+  sigemptyset(&empty);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  posix_spawnattr_setsigmask(&attr, &empty);
+  posix_spawnattr_setpgroup(&attr, 0);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP |
+                                      POSIX_SPAWN_SETSIGDEF |
+                                      POSIX_SPAWN_SETSIGMASK);
+
+  std::vector<char *> args;
+  for (const auto &arg : argv)
+    args.push_back(const_cast<char *>(arg.c_str()));
+  args.push_back(nullptr);
+
+  int error =
+      posix_spawnp(&pid, args[0], &actions, &attr, args.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  if (error == 0)
+    apply_rlimits(pid);
+  return error;
+}
+
+CallResult spawn_failure(const std::string &tool, int error) {
+  log_to_file("Cannot start " + tool + ": " + strerror(error));
+  return CallResult::failed(error == ENOENT || error == EACCES
+                                ? CallStatus::Permanent
+                                : CallStatus::Transient,
+                            "cannot start " + tool + ": " + strerror(error));
+}
+
+std::string tool_name(const std::string &program) {
+  return program.substr(program.rfind('/') + 1);
+}
+
+std::string describe(const std::vector<std::string> &argv) {
+  std::string text;
+  for (const auto &arg : argv)
+    text += (text.empty() ? "" : " ") + arg;
+  return text;
+}
+
+// Reads whatever is available; false once the pipe reached EOF
+bool drain(int fd, std::string &into) {
+  char buf[PIPE_BUFFER_BYTES];
+  while (true) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n > 0) {
+      into.append(buf, (size_t)n);
+      continue;
+    }
+    return n < 0 && (errno == EAGAIN || errno == EINTR);
+  }
+}
+
+} // namespace
+
+Deadline tool_deadline(long long timeout_ms) {
+  if (timeout_ms <= 0)
+    timeout_ms = env_or("PUBLISHER_TOOL_TIMEOUT_MS", 300000LL);
+  Deadline deadline = current_deadline();
+  if (timeout_ms > 0)
+    deadline = std::min(deadline,
+                        Clock::now() + std::chrono::milliseconds(timeout_ms));
+  return deadline;
+}
+
+CallResult run_process(const std::vector<std::string> &argv,
+                       const ProcessOptions &options) {
+  std::string tool = tool_name(argv[0]);
+  std::string command = describe(argv);
+
+  Deadline deadline = tool_deadline(options.timeout_ms);
+
+  ToolSlots &slots = slots_for(tool);
+  if (!slots.acquire(deadline))
+    return CallResult::failed(CallStatus::DeadlineExceeded,
+                              "timed out waiting for a free " + tool + " slot");
+  SlotGuard slot{slots};
+
+  log_to_file("Executing command: " + command);
+  auto started = Clock::now();
+
+  int out_pipe[2], err_pipe[2], in_pipe[2] = {-1, -1};
+  if (pipe2(out_pipe, O_CLOEXEC) != 0)
+    return CallResult::failed(CallStatus::Transient, "pipe2 failed");
+  if (pipe2(err_pipe, O_CLOEXEC) != 0) {
+    close(out_pipe[0]);
+    close(out_pipe[1]);
+    return CallResult::failed(CallStatus::Transient, "pipe2 failed");
+  }
+  if (options.input && pipe2(in_pipe, O_CLOEXEC) != 0) {
+    for (int fd : {out_pipe[0], out_pipe[1], err_pipe[0], err_pipe[1]})
+      close(fd);
+    return CallResult::failed(CallStatus::Transient, "pipe2 failed");
+  }
+
+  pid_t pid;
+  int spawn_error = spawn_tool(argv, options.input ? in_pipe[0] : -1,
+                               out_pipe[1], err_pipe[1], pid);
+  close(out_pipe[1]);
+  close(err_pipe[1]);
+  if (options.input)
+    close(in_pipe[0]);
+  if (spawn_error != 0) {
+    close(out_pipe[0]);
+    close(err_pipe[0]);
+    if (options.input)
+      close(in_pipe[1]);
+    return spawn_failure(tool, spawn_error);
+  }
+
+  int out_fd = out_pipe[0], err_fd = err_pipe[0], in_fd = in_pipe[1];
+  for (int fd : {out_fd, err_fd, in_fd}) {
+    if (fd >= 0)
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  }
+
+  std::string out, err, pending;
+  size_t pending_pos = 0;
+  bool timed_out = false, input_failed = false;
+  while (out_fd >= 0 || err_fd >= 0 || in_fd >= 0) {
+    // Refill the stdin buffer from the caller once it has been written
+    if (in_fd >= 0 && pending_pos == pending.size()) {
+      pending.resize(PIPE_BUFFER_BYTES);
+      long long n = options.input(&pending[0], pending.size());
+      pending.resize(n > 0 ? (size_t)n : 0);
+      pending_pos = 0;
+      if (n <= 0) {
+        input_failed = n < 0;
+        close(in_fd);
+        in_fd = -1;
+        if (input_failed) {
+          kill(-pid, SIGKILL);
+          break;
+        }
+      }
+    }
+
+    long long left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         deadline - Clock::now())
+                         .count();
+    if (deadline != Deadline::max() && left <= 0) {
+      timed_out = true;
+      kill(-pid, SIGKILL);
+      break;
+    }
+    pollfd fds[3];
+    int count = 0;
+    for (int fd : {out_fd, err_fd})
+      if (fd >= 0)
+        fds[count++] = {fd, POLLIN, 0};
+    if (in_fd >= 0)
+      fds[count++] = {in_fd, POLLOUT, 0};
+    int wait_ms = deadline == Deadline::max()
+                      ? -1
+                      : (int)std::min<long long>(left, INT_MAX);
+    if (poll(fds, count, wait_ms) < 0 && errno != EINTR)
+      break;
+
+    for (int i = 0; i < count; ++i) {
+      if (!fds[i].revents)
+        continue;
+      int fd = fds[i].fd;
+      if (fd == in_fd) {
+        ssize_t n = write(in_fd, pending.data() + pending_pos,
+                          pending.size() - pending_pos);
+        if (n > 0) {
+          pending_pos += (size_t)n;
+        } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+          // The tool stopped reading; its exit status tells why
+          close(in_fd);
+          in_fd = -1;
+        }
+      } else if (fd == out_fd && !drain(out_fd, out)) {
+        close(out_fd);
+        out_fd = -1;
+      } else if (fd == err_fd && !drain(err_fd, err)) {
+        close(err_fd);
+        err_fd = -1;
+      }
+    }
+  }
+  for (int fd : {out_fd, err_fd, in_fd}) {
+    if (fd >= 0)
+      close(fd);
+  }
+
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+  }
+  long long elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                             Clock::now() - started)
+                             .count();
+
+  if (timed_out) {
+    log_to_file(tool + " killed after " + std::to_string(elapsed_ms) + " ms");
+    return CallResult::failed(CallStatus::Transient,
+                              command + ": timed out after " +
+                                  std::to_string(elapsed_ms) + " ms");
+  }
+  if (input_failed)
+    return CallResult::failed(CallStatus::Permanent,
+                              command + ": reading the input failed");
+  if (WIFSIGNALED(status)) {
+    log_to_file(tool + " killed by signal " +
+                std::to_string(WTERMSIG(status)));
+    return CallResult::failed(CallStatus::Transient,
+                              command + ": killed by signal " +
+                                  std::to_string(WTERMSIG(status)) + ": " +
+                                  err);
+  }
+  int code = WEXITSTATUS(status);
+  if (code != 0) {
+    log_to_file("Command execution failed with status: " +
+                std::to_string(code) + ": " + err);
+    return {options.on_failure, out,
+            command + ": exit status " + std::to_string(code) + ": " + err};
+  }
+  log_to_file("Command executed successfully in " +
+              std::to_string(elapsed_ms) + " ms");
+  return CallResult::ok(out);
+}
+
+CallResult CoProcess::start(const std::vector<std::string> &argv) {
+  stop();
+  tool = tool_name(argv[0]);
+  int in_pipe[2], out_pipe[2], err_pipe[2];
+  if (pipe2(in_pipe, O_CLOEXEC) != 0)
+    return CallResult::failed(CallStatus::Transient, "pipe2 failed");
+  if (pipe2(out_pipe, O_CLOEXEC) != 0) {
+    close(in_pipe[0]);
+    close(in_pipe[1]);
+    return CallResult::failed(CallStatus::Transient, "pipe2 failed");
+  }
+  if (pipe2(err_pipe, O_CLOEXEC) != 0) {
+    for (int fd : {in_pipe[0], in_pipe[1], out_pipe[0], out_pipe[1]})
+      close(fd);
+    return CallResult::failed(CallStatus::Transient, "pipe2 failed");
+  }
+
+  int spawn_error =
+      spawn_tool(argv, in_pipe[0], out_pipe[1], err_pipe[1], pid);
+  close(in_pipe[0]);
+  close(out_pipe[1]);
+  close(err_pipe[1]);
+  if (spawn_error != 0) {
+    pid = -1;
+    close(in_pipe[1]);
+    close(out_pipe[0]);
+    close(err_pipe[0]);
+    return spawn_failure(tool, spawn_error);
+  }
+  in_fd = in_pipe[1];
+  out_fd = out_pipe[0];
+  err_fd = err_pipe[0];
+  for (int fd : {in_fd, out_fd, err_fd})
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  log_to_file("Started " + tool + " worker " + std::to_string(pid) + ": " +
+              describe(argv));
+  return CallResult::ok();
+}
+
+CallResult CoProcess::send(const std::string &text, Deadline deadline) {
+  pending.erase(0, pending_pos);
+  pending_pos = 0;
+  pending += text;
+  return pump(deadline, [&] { return pending_pos == pending.size(); });
+}
+
+CallResult CoProcess::read_line(Deadline deadline) {
+  CallResult result =
+      pump(deadline, [&] { return out.find('\n') != std::string::npos; });
+  if (!result)
+    return result;
+  // Anything the tool logged before this line is already in the pipe
+  if (err_fd >= 0 && !drain(err_fd, err)) {
+    close(err_fd);
+    err_fd = -1;
+  }
+  size_t end = out.find('\n');
+  std::string line = out.substr(0, end);
+  out.erase(0, end + 1);
+  return CallResult::ok(line);
+}
+
+std::string CoProcess::take_errors() {
+  std::string errors;
+  errors.swap(err);
+  return errors;
+}
+
+void CoProcess::stop() {
+  for (int *fd : {&in_fd, &out_fd, &err_fd}) {
+    if (*fd >= 0)
+      close(*fd);
+    *fd = -1;
+  }
+  if (pid > 0) {
+    kill(-pid, SIGKILL);
+    while (waitpid(pid, nullptr, 0) < 0 && errno == EINTR) {
+    }
+    log_to_file("Stopped " + tool + " worker " + std::to_string(pid));
+  }
+  pid = -1;
+  pending.clear();
+  pending_pos = 0;
+  out.clear();
+  err.clear();
+}
+
+CallResult CoProcess::pump(Deadline deadline,
+                           const std::function<bool()> &done) {
+  while (!done()) {
+    bool writing = pending_pos < pending.size();
+    if (out_fd < 0 || (writing && in_fd < 0))
+      return CallResult::failed(CallStatus::Transient,
+                                tool + " worker exited" +
+                                    (err.empty() ? "" : ": " + err));
+    long long left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         deadline - Clock::now())
+                         .count();
+    if (deadline != Deadline::max() && left <= 0)
+      return CallResult::failed(CallStatus::Transient,
+                                tool + " worker timed out");
+
+    pollfd fds[3];
+    int count = 0;
+    fds[count++] = {out_fd, POLLIN, 0};
+    if (err_fd >= 0)
+      fds[count++] = {err_fd, POLLIN, 0};
+    if (writing)
+      fds[count++] = {in_fd, POLLOUT, 0};
+    int wait_ms = deadline == Deadline::max()
+                      ? -1
+                      : (int)std::min<long long>(left, INT_MAX);
+    if (poll(fds, count, wait_ms) < 0 && errno != EINTR)
+      return CallResult::failed(CallStatus::Transient,
+                                tool + " worker: poll failed");
+
+    for (int i = 0; i < count; ++i) {
+      if (!fds[i].revents)
+        continue;
+      int fd = fds[i].fd;
+      if (fd == in_fd) {
+        ssize_t n = write(in_fd, pending.data() + pending_pos,
+                          pending.size() - pending_pos);
+        if (n > 0) {
+          pending_pos += (size_t)n;
+        } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+          close(in_fd);
+          in_fd = -1;
+        }
+      } else if (fd == out_fd && !drain(out_fd, out)) {
+        close(out_fd);
+        out_fd = -1;
+      } else if (fd == err_fd && !drain(err_fd, err)) {
+        close(err_fd);
+        err_fd = -1;
+      }
+    }
+  }
+  return CallResult::ok();
+}
@@ -0,0 +1,70 @@
+// process.hpp
+#pragma once
+
+#include "resilience.hpp"
+
+#include <functional>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// Runs the external tools (gsutil, identify, convert) with posix_spawn and
+// an explicit argv: no /bin/sh, so paths never need quoting. stdout and
+// stderr are drained through non-blocking pipes. Each child gets its own
+// process group, which is killed when the wall-clock limit or the request
+// deadline passes. At most PUBLISHER_<TOOL>_SLOTS copies of a tool run at
+// once (PUBLISHER_TOOL_SLOTS when unset), and PUBLISHER_TOOL_MEMORY_MB /
+// PUBLISHER_TOOL_CPU_S become the child's address-space and CPU rlimits.
+
+struct ProcessOptions {
+  // Fills the child's stdin: returns bytes written to buf, 0 at the end,
+  // -1 to abort the run. stdin is /dev/null when unset.
+  std::function<long long(char *, size_t)> input;
+  // Wall-clock limit; 0 uses PUBLISHER_TOOL_TIMEOUT_MS
+  long long timeout_ms = 0;
+  // How a non-zero exit is reported; timeouts and signals are Transient
+  CallStatus on_failure = CallStatus::Permanent;
+};
+
+// Deadline for one tool run: timeout_ms from now (PUBLISHER_TOOL_TIMEOUT_MS
+// when 0), or the request deadline if that comes first
+Deadline tool_deadline(long long timeout_ms = 0);
+
+// value holds stdout; error describes a failure and ends with stderr
+CallResult run_process(const std::vector<std::string> &argv,
+                       const ProcessOptions &options = {});
+
+// A long-lived tool that takes requests on stdin and answers on stdout, so
+// starting it is paid once instead of per operation. The caller owns the
+// protocol. Spawned like run_process() (own process group, rlimits), but
+// without the slot cap: the number of CoProcess objects is the cap. One
+// caller at a time; after a failed call the child's state is unknown and
+// it should be stopped.
+class CoProcess {
+public:
+  CoProcess() = default;
+  ~CoProcess() { stop(); }
+  CoProcess(const CoProcess &) = delete;
+  CoProcess &operator=(const CoProcess &) = delete;
+
+  CallResult start(const std::vector<std::string> &argv);
+  bool running() const { return pid > 0; }
+  // Writes text to stdin, reading output meanwhile so neither side blocks
+  CallResult send(const std::string &text, Deadline deadline);
+  // Next stdout line, without the newline
+  CallResult read_line(Deadline deadline);
+  // stderr received so far, cleared by the call
+  std::string take_errors();
+  // Kills the process group and reaps the child
+  void stop();
+
+private:
+  // Moves bytes until done() holds, the deadline passes or the child exits
+  CallResult pump(Deadline deadline, const std::function<bool()> &done);
+
+  std::string tool;
+  pid_t pid = -1;
+  int in_fd = -1, out_fd = -1, err_fd = -1;
+  std::string pending, out, err;
+  size_t pending_pos = 0;
+};
@@ -0,0 +1,31 @@
+// publisher.hpp
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Shared configuration and helpers for the publisher translation units.
+// Definitions of the helpers live in article_publisher.cpp.
+
+inline const std::string DB_PATH = "/var/lib/grabbiel-db/content.db";
+inline const std::string STORAGE_ROOT = "/var/lib/article-content/";
+inline const std::string GCS_PUBLIC_BUCKET = "grabbiel-media-public";
+inline const std::string GCS_PUBLIC_URL = "https://storage.googleapis.com/";
+inline const std::string LOG_FILE = "/tmp/article-publisher.log";
+inline const std::unordered_set<std::string> VM_ALLOWED = {"html", "css",
+                                                           "js"};
+inline const std::unordered_set<std::string> IMAGE_EXTENSIONS = {
+    ".jpg", ".jpeg", ".png", ".gif", ".webp", ".heic", ".bmp", ".tiff"};
+inline const std::unordered_set<std::string> VIDEO_EXTENSIONS = {
+    ".mp4", ".mov", ".webm", ".avi", ".mkv"};
+void log_to_file(const std::string &message);
+std::string generate_uuid();
+
+// Milliseconds elapsed since start, for the timings in JSON reports
+double ms_since(std::chrono::steady_clock::time_point start);
+
+// Service settings come from the environment (see README.md)
+std::string env_or(const char *name, const std::string &fallback);
+long long env_or(const char *name, long long fallback);
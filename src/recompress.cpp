@@ -0,0 +1,352 @@
+#include "recompress.hpp"
+#include "images.hpp"
+#include "publisher.hpp"
+
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <zlib.h>
+
+#if __has_include(<jpeglib.h>)
+#include <jpeglib.h>
+#define PUBLISHER_HAVE_JPEG 1
+#endif
+
+#if __has_include(<png.h>)
+#include <png.h>
+#define PUBLISHER_HAVE_PNG 1
+#endif
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// TIFF header, IFD0 with the orientation entry, no next IFD
+const size_t ORIENTATION_EXIF_BYTES = 26;
+
+// Writes an EXIF block (from the TIFF header on) holding only the
+// orientation found in `tiff` to out and returns its size; 0 when tiff has
+// no orientation other than the default to keep
+size_t orientation_exif(const unsigned char *tiff, size_t length,
+                        unsigned char *out) {
+  if (length < 8)
+    return 0;
+  bool little = tiff[0] == 'I' && tiff[1] == 'I';
+  if (!little && !(tiff[0] == 'M' && tiff[1] == 'M'))
+    return 0;
+  auto read16 = [&](size_t at) -> unsigned {
+    return little ? tiff[at] | tiff[at + 1] << 8 : tiff[at] << 8 | tiff[at + 1];
+  };
+  auto read32 = [&](size_t at) -> unsigned long {
+    return little ? read16(at) | (unsigned long)read16(at + 2) << 16
+                  : (unsigned long)read16(at) << 16 | read16(at + 2);
+  };
+
+  unsigned long ifd = read32(4);
+  if (ifd > length - 2)
+    return 0;
+  unsigned entries = read16(ifd);
+  for (unsigned i = 0; i < entries; ++i) {
+    size_t entry = ifd + 2 + 12 * (size_t)i;
+    if (entry + 12 > length)
+      return 0;
+    if (read16(entry) != 0x0112)
+      continue;
+    unsigned orientation = read16(entry + 8);
+    // SHORT, 1 is the default and needs no tag
+    if (read16(entry + 2) != 3 || orientation < 2 || orientation > 8)
+      return 0;
+
+    size_t at = 0;
+    auto write16 = [&](unsigned value) {
+      out[at++] = little ? value & 0xff : value >> 8;
+      out[at++] = little ? value >> 8 : value & 0xff;
+    };
+    auto write32 = [&](unsigned long value) {
+      write16(little ? value & 0xffff : value >> 16);
+      write16(little ? value >> 16 : value & 0xffff);
+    };
+    write16(little ? 0x4949 : 0x4d4d);
+    write16(42);
+    write32(8); // IFD0 follows the header
+    write16(1);
+    write16(0x0112);
+    write16(3);
+    write32(1);
+    write16(orientation);
+    write16(0);
+    write32(0);
+    return at;
+  }
+  return 0;
+}
+
+#ifdef PUBLISHER_HAVE_JPEG
+struct JpegErrors {
+  jpeg_error_mgr mgr;
+  std::jmp_buf jump;
+  char message[JMSG_LENGTH_MAX];
+};
+
+void jpeg_fail(j_common_ptr cinfo) {
+  auto *errors = reinterpret_cast<JpegErrors *>(cinfo->err);
+  cinfo->err->format_message(cinfo, errors->message);
+  std::longjmp(errors->jump, 1);
+}
+
+// A damaged file is never rewritten, so warnings fail as well
+void jpeg_warn(j_common_ptr cinfo, int level) {
+  if (level < 0)
+    jpeg_fail(cinfo);
+}
+
+// libjpeg reports errors with longjmp; nothing here may own resources
+// other than the two codec structs and the output buffer
+bool recompress_jpeg(const std::string &in, unsigned long long max_pixels,
+                     std::string &out, std::string &error) {
+  jpeg_decompress_struct src;
+  jpeg_compress_struct dst;
+  JpegErrors errors;
+  src.err = dst.err = jpeg_std_error(&errors.mgr);
+  errors.mgr.error_exit = jpeg_fail;
+  errors.mgr.emit_message = jpeg_warn;
+  errors.message[0] = '\0';
+  unsigned char *buffer = nullptr;
+  unsigned long size = 0;
+  jpeg_create_decompress(&src);
+  jpeg_create_compress(&dst);
+
+  bool ok = !setjmp(errors.jump);
+  if (ok) {
+    jpeg_mem_src(&src, (unsigned char *)in.data(), in.size());
+    jpeg_save_markers(&src, JPEG_APP0 + 1, 0xffff);
+    jpeg_save_markers(&src, JPEG_APP0 + 2, 0xffff);
+    jpeg_read_header(&src, TRUE);
+    // The coefficients of the whole image are held in memory
+    if ((unsigned long long)src.image_width * src.image_height > max_pixels) {
+      std::snprintf(errors.message, sizeof(errors.message),
+                    "%ux%u is over %llu pixels", src.image_width,
+                    src.image_height, max_pixels);
+      std::longjmp(errors.jump, 1);
+    }
+    jvirt_barray_ptr *coefficients = jpeg_read_coefficients(&src);
+
+    // Same coefficients, so the same pixels
+    jpeg_copy_critical_parameters(&src, &dst);
+    dst.optimize_coding = TRUE;
+    jpeg_simple_progression(&dst);
+    jpeg_mem_dest(&dst, &buffer, &size);
+    jpeg_write_coefficients(&dst, coefficients);
+
+    for (jpeg_saved_marker_ptr marker = src.marker_list; marker;
+         marker = marker->next) {
+      if (marker->marker == JPEG_APP0 + 2 && marker->data_length >= 12 &&
+          std::memcmp(marker->data, "ICC_PROFILE", 12) == 0) {
+        jpeg_write_marker(&dst, marker->marker, marker->data,
+                          marker->data_length);
+      } else if (marker->marker == JPEG_APP0 + 1 &&
+                 marker->data_length > 6 &&
+                 std::memcmp(marker->data, "Exif\0\0", 6) == 0) {
+        unsigned char exif[6 + ORIENTATION_EXIF_BYTES] = {'E', 'x', 'i', 'f'};
+        size_t length = orientation_exif(marker->data + 6,
+                                         marker->data_length - 6, exif + 6);
+        if (length)
+          jpeg_write_marker(&dst, marker->marker, exif, 6 + length);
+      }
+    }
+    jpeg_finish_compress(&dst);
+    jpeg_finish_decompress(&src);
+    out.assign((const char *)buffer, size);
+  } else {
+    error = errors.message;
+  }
+
+  jpeg_destroy_compress(&dst);
+  jpeg_destroy_decompress(&src);
+  std::free(buffer);
+  return ok;
+}
+#endif
+
+#ifdef PUBLISHER_HAVE_PNG
+const size_t PNG_MESSAGE_BYTES = 256;
+
+struct PngInput {
+  const std::string &data;
+  size_t offset;
+};
+
+void png_fail(png_structp png, png_const_charp message) {
+  std::snprintf(static_cast<char *>(png_get_error_ptr(png)), PNG_MESSAGE_BYTES,
+                "%s", message);
+  png_longjmp(png, 1);
+}
+
+// Warnings are about ancillary chunks libpng already dropped
+void png_quiet(png_structp, png_const_charp) {}
+
+void png_read_bytes(png_structp png, png_bytep data, png_size_t length) {
+  auto *input = static_cast<PngInput *>(png_get_io_ptr(png));
+  if (length > input->data.size() - input->offset)
+    png_error(png, "unexpected end of file");
+  std::memcpy(data, input->data.data() + input->offset, length);
+  input->offset += length;
+}
+
+void png_write_bytes(png_structp png, png_bytep data, png_size_t length) {
+  static_cast<std::string *>(png_get_io_ptr(png))
+      ->append((const char *)data, length);
+}
+
+// One encoding of the image read into info; false when libpng fails
+bool encode_png(png_infop info, int filters, int strategy, std::string &out,
+                char *message) {
+  png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, message,
+                                            png_fail, png_quiet);
+  if (!png)
+    return false;
+  bool ok = !setjmp(png_jmpbuf(png));
+  if (ok) {
+    png_set_write_fn(png, &out, png_write_bytes, nullptr);
+    png_set_compression_level(png, Z_BEST_COMPRESSION);
+    png_set_compression_mem_level(png, MAX_MEM_LEVEL);
+    png_set_compression_strategy(png, strategy);
+    png_set_filter(png, PNG_FILTER_TYPE_BASE, filters);
+    png_write_png(png, info, PNG_TRANSFORM_IDENTITY, nullptr);
+  }
+  png_destroy_write_struct(&png, nullptr);
+  return ok;
+}
+
+// Decodes the whole image, then keeps the smaller of two encodings: libpng
+// picking a filter per row suits photos, no filter suits palette and
+// low-depth images. libpng reports errors with longjmp, like libjpeg.
+bool recompress_png(const std::string &in, unsigned long long max_pixels,
+                    std::string &out, std::string &error) {
+  // The size is in IHDR, always the first chunk; the decoded rows of the
+  // whole image are held in memory
+  if (in.size() >= 24 && std::memcmp(in.data() + 12, "IHDR", 4) == 0) {
+    auto read32 = [&](size_t at) {
+      const auto *p = reinterpret_cast<const unsigned char *>(in.data()) + at;
+      return (unsigned long long)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    };
+    if (read32(16) * read32(20) > max_pixels) {
+      error = std::to_string(read32(16)) + "x" + std::to_string(read32(20)) +
+              " is over " + std::to_string(max_pixels) + " pixels";
+      return false;
+    }
+  }
+
+  char message[PNG_MESSAGE_BYTES] = "out of memory";
+  PngInput input{in, 0};
+  std::string unfiltered;
+  png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, message,
+                                           png_fail, png_quiet);
+  png_infop info = png ? png_create_info_struct(png) : nullptr;
+  if (!info) {
+    png_destroy_read_struct(&png, nullptr, nullptr);
+    error = message;
+    return false;
+  }
+
+  bool ok = !setjmp(png_jmpbuf(png));
+  if (ok) {
+    png_set_read_fn(png, &input, png_read_bytes);
+    // libpng checks the IHDR it parses as well
+    png_uint_32 max_edge = (png_uint_32)std::min<unsigned long long>(
+        max_pixels, PNG_USER_WIDTH_MAX);
+    png_set_user_limits(png, max_edge, max_edge);
+    png_read_png(png, info, PNG_TRANSFORM_IDENTITY, nullptr);
+
+    png_free_data(png, info, PNG_FREE_TEXT, -1);
+    png_set_invalid(png, info, PNG_INFO_tIME);
+#ifdef PNG_eXIf_SUPPORTED
+    png_uint_32 exif_length = 0;
+    png_bytep exif = nullptr;
+    if (png_get_eXIf_1(png, info, &exif_length, &exif)) {
+      unsigned char orientation[ORIENTATION_EXIF_BYTES];
+      size_t length = orientation_exif(exif, exif_length, orientation);
+      png_free_data(png, info, PNG_FREE_EXIF, -1);
+      if (length)
+        png_set_eXIf_1(png, info, (png_uint_32)length, orientation);
+    }
+#endif
+    // Interlacing only costs bytes once the rows are decoded
+    png_uint_32 width, height;
+    int depth, color, interlace, compression, filter;
+    png_get_IHDR(png, info, &width, &height, &depth, &color, &interlace,
+                 &compression, &filter);
+    png_set_IHDR(png, info, width, height, depth, color, PNG_INTERLACE_NONE,
+                 compression, filter);
+
+    bool filtered_ok =
+        encode_png(info, PNG_ALL_FILTERS, Z_FILTERED, out, message);
+    bool unfiltered_ok = encode_png(info, PNG_FILTER_NONE, Z_DEFAULT_STRATEGY,
+                                    unfiltered, message);
+    if (unfiltered_ok && (!filtered_ok || unfiltered.size() < out.size()))
+      out.swap(unfiltered);
+    ok = filtered_ok || unfiltered_ok;
+  }
+  if (!ok)
+    error = message;
+
+  png_destroy_read_struct(&png, &info, nullptr);
+  return ok;
+}
+#endif
+
+} // namespace
+
+fs::path recompress_original(const fs::path &source) {
+  if (env_or("PUBLISHER_RECOMPRESS_ORIGINALS", 1LL) <= 0)
+    return {};
+  std::string mime = sniff_image_mime(source);
+  bool (*recompress)(const std::string &, unsigned long long, std::string &,
+                     std::string &) = nullptr;
+#ifdef PUBLISHER_HAVE_JPEG
+  if (mime == "image/jpeg")
+    recompress = recompress_jpeg;
+#endif
+#ifdef PUBLISHER_HAVE_PNG
+  // libpng reads only the first frame of an APNG
+  if (mime == "image/png" && !is_animated_png(source))
+    recompress = recompress_png;
+#endif
+  if (!recompress)
+    return {};
+  unsigned long long max_pixels = (unsigned long long)std::max(
+      1LL, env_or("PUBLISHER_RECOMPRESS_MAX_PIXELS", 50000000LL));
+
+  std::ifstream in(source, std::ios::binary);
+  std::string original((std::istreambuf_iterator<char>(in)),
+                       std::istreambuf_iterator<char>());
+  std::string smaller, error;
+  if (!in.is_open() || !recompress(original, max_pixels, smaller, error)) {
+    log_to_file("Cannot recompress " + source.string() +
+                ", uploaded as it is: " + (error.empty() ? "unreadable" : error));
+    return {};
+  }
+  if (smaller.size() >= original.size())
+    return {};
+
+  fs::path target = "/tmp/" + generate_uuid() + source.extension().string();
+  std::ofstream out(target, std::ios::binary);
+  out.write(smaller.data(), smaller.size());
+  out.close();
+  if (!out) {
+    std::error_code ec;
+    fs::remove(target, ec);
+    log_to_file("Cannot write " + target.string() + ", " + source.string() +
+                " uploaded as it is");
+    return {};
+  }
+  log_to_file("Recompressed " + source.string() + ": " +
+              std::to_string(original.size()) + " -> " +
+              std::to_string(smaller.size()) + " bytes");
+  return target;
+}
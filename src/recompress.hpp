@@ -0,0 +1,22 @@
+// recompress.hpp
+#pragma once
+
+#include <filesystem>
+
+// Lossless size reduction of JPEG and PNG originals before upload. A JPEG
+// is rewritten from its DCT coefficients as a progressive JPEG with
+// optimised Huffman tables, so no pixel changes. A PNG is decoded and
+// deflated again at the highest zlib level, once with a filter chosen per
+// row and once unfiltered, without interlacing. Metadata pages do not need
+// is dropped: comments, XMP, text and time chunks, and every EXIF field but
+// the orientation. Colour profiles (ICC, sRGB, gamma, chromaticities) are
+// kept. Animated PNGs are left alone, as libpng reads only their first
+// frame, and so are images of more than PUBLISHER_RECOMPRESS_MAX_PIXELS,
+// checked from the header before anything is decoded. Needs libjpeg and
+// libpng at build time; without one of them files of that format are
+// uploaded as they are, as they are with PUBLISHER_RECOMPRESS_ORIGINALS=0.
+
+// File to upload in place of source: a smaller temporary copy the caller
+// removes, or an empty path when source is not a JPEG or PNG, cannot be
+// read losslessly, or is already as small
+std::filesystem::path recompress_original(const std::filesystem::path &source);
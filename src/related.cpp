@@ -0,0 +1,309 @@
+#include "related.hpp"
+#include "content_api.hpp"
+#include "db.hpp"
+#include "publisher.hpp"
+
+#include <algorithm>
+#include <optional>
+#include <unordered_set>
+
+namespace {
+
+const long long MAX_RELATED = 50;
+
+// Jaccard index |a & b| / |a | b| of two tag bitsets
+double jaccard(const std::vector<uint64_t> &a, const std::vector<uint64_t> &b) {
+  const std::vector<uint64_t> &longer = a.size() >= b.size() ? a : b;
+  size_t common = std::min(a.size(), b.size());
+  size_t intersection = 0;
+  size_t union_count = 0;
+  for (size_t i = 0; i < common; ++i) {
+    intersection += __builtin_popcountll(a[i] & b[i]);
+    union_count += __builtin_popcountll(a[i] | b[i]);
+  }
+  for (size_t i = common; i < longer.size(); ++i)
+    union_count += __builtin_popcountll(longer[i]);
+  return union_count ? (double)intersection / union_count : 0.0;
+}
+
+// Higher score first; newer content breaks ties
+bool ranks_before(const RelatedIndex::Neighbour &a,
+                  const RelatedIndex::Neighbour &b) {
+  return a.score != b.score ? a.score > b.score : a.id > b.id;
+}
+
+bool same_list(const std::vector<RelatedIndex::Neighbour> &a,
+               const std::vector<RelatedIndex::Neighbour> &b) {
+  return a.size() == b.size() &&
+         std::equal(a.begin(), a.end(), b.begin(), [](auto &x, auto &y) {
+           return x.id == y.id && x.score == y.score;
+         });
+}
+
+bool write_related(WriteTxn &txn, long long content_id,
+                   const std::vector<RelatedIndex::Neighbour> &related) {
+  if (!txn.exec("DELETE FROM related_content WHERE content_id = ?",
+                {content_id}))
+    return false;
+  if (related.empty())
+    return true;
+
+  std::string sql = "INSERT INTO related_content (content_id, rank, "
+                    "related_id, score) VALUES ";
+  std::vector<SqlParam> params;
+  for (size_t i = 0; i < related.size(); ++i) {
+    sql += i ? ", (?, ?, ?, ?)" : "(?, ?, ?, ?)";
+    params.emplace_back(content_id);
+    params.emplace_back((long long)i + 1);
+    params.emplace_back(related[i].id);
+    params.emplace_back(related[i].score);
+  }
+  return txn.exec(sql, params);
+}
+
+} // namespace
+
+std::vector<uint64_t> RelatedIndex::bits_for(const std::vector<long long> &tags) {
+  std::vector<uint64_t> bits;
+  for (long long tag : tags) {
+    size_t bit = bit_of_tag.emplace(tag, bit_of_tag.size()).first->second;
+    if (bits.size() <= bit / 64)
+      bits.resize(bit / 64 + 1, 0);
+    bits[bit / 64] |= uint64_t(1) << (bit % 64);
+  }
+  return bits;
+}
+
+// Scores every item sharing a tag with `item`. `overlay`, when given,
+// replaces the committed state of overlay_id (the item being published).
+std::vector<RelatedIndex::Neighbour>
+RelatedIndex::top_k(long long self, const Item &item, long long overlay_id,
+                    const Item *overlay) {
+  std::unordered_set<long long> seen{self, overlay_id};
+  std::vector<Neighbour> scored;
+  for (long long tag : item.tags) {
+    auto it = contents_by_tag.find(tag);
+    if (it == contents_by_tag.end())
+      continue;
+    for (long long other : it->second) {
+      if (seen.insert(other).second)
+        scored.push_back({other, jaccard(item.bits, items.at(other).bits)});
+    }
+  }
+  if (overlay && overlay_id != self) {
+    double score = jaccard(item.bits, overlay->bits);
+    if (score > 0)
+      scored.push_back({overlay_id, score});
+  }
+
+  size_t keep = std::min(k, scored.size());
+  std::partial_sort(scored.begin(), scored.begin() + keep, scored.end(),
+                    ranks_before);
+  scored.resize(keep);
+  return scored;
+}
+
+bool RelatedIndex::warm(sqlite3 *db) {
+  std::unordered_map<long long, std::vector<long long>> tags_by_content;
+  if (!query_rows(db,
+                  "SELECT ct.content_id, ct.tag_id FROM content_tags ct "
+                  "JOIN content_blocks cb ON cb.id = ct.content_id "
+                  "WHERE cb.status = 'published'",
+                  {}, [&](sqlite3_stmt *stmt) {
+                    tags_by_content[sqlite3_column_int64(stmt, 0)].push_back(
+                        sqlite3_column_int64(stmt, 1));
+                  }))
+    return false;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  k = (size_t)std::clamp(env_or("PUBLISHER_RELATED_K", 8LL), 1LL,
+                         MAX_RELATED);
+  bit_of_tag.clear();
+  items.clear();
+  contents_by_tag.clear();
+  for (auto &[id, tags] : tags_by_content) {
+    for (long long tag : tags)
+      contents_by_tag[tag].push_back(id);
+    items[id] = {bits_for(tags), std::move(tags), {}};
+  }
+
+  bool ok = query_rows(
+      db,
+      "SELECT content_id, related_id, score FROM related_content "
+      "ORDER BY content_id, rank",
+      {}, [&](sqlite3_stmt *stmt) {
+        auto it = items.find(sqlite3_column_int64(stmt, 0));
+        if (it != items.end())
+          it->second.related.push_back(
+              {sqlite3_column_int64(stmt, 1), sqlite3_column_double(stmt, 2)});
+      });
+  log_to_file("Related index warmed with " + std::to_string(items.size()) +
+              " tagged items and " + std::to_string(bit_of_tag.size()) +
+              " tags");
+  return ok;
+}
+
+bool RelatedIndex::needs_rebuild() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return !items.empty() &&
+         std::none_of(items.begin(), items.end(),
+                      [](auto &entry) { return !entry.second.related.empty(); });
+}
+
+bool RelatedIndex::rebuild(WriteTxn &txn) {
+  std::unordered_map<long long, std::vector<Neighbour>> lists;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &[id, item] : items)
+      lists[id] = top_k(id, item, id, nullptr);
+  }
+
+  if (!txn.exec("DELETE FROM related_content", {}))
+    return false;
+  for (const auto &[id, related] : lists) {
+    if (!related.empty() && !write_related(txn, id, related))
+      return false;
+  }
+
+  log_to_file("Related content rebuilt for " + std::to_string(lists.size()) +
+              " items");
+  txn.on_commit.push_back([this, lists = std::move(lists)] {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &[id, related] : lists) {
+      auto it = items.find(id);
+      if (it != items.end())
+        it->second.related = related;
+    }
+  });
+  return true;
+}
+
+void RelatedIndex::put(long long content_id, const Item *item) {
+  auto current = items.find(content_id);
+  if (current != items.end()) {
+    for (long long tag : current->second.tags) {
+      auto &ids = contents_by_tag[tag];
+      ids.erase(std::remove(ids.begin(), ids.end(), content_id), ids.end());
+    }
+    items.erase(current);
+  }
+  if (item) {
+    for (long long tag : item->tags)
+      contents_by_tag[tag].push_back(content_id);
+    items[content_id] = *item;
+  }
+}
+
+bool RelatedIndex::update(WriteTxn &txn, long long content_id) {
+  // Only the writer thread calls update(), so data_version needs no lock.
+  // The first update reloads too: the server may have warmed the index
+  // before another process wrote.
+  long long version;
+  bool found = false;
+  if (!txn.query_int("PRAGMA data_version", {}, version, found))
+    return false;
+  if (found && version != data_version) {
+    if (!warm(txn.db))
+      return false;
+    data_version = version;
+  }
+
+  long long unused;
+  bool published = false;
+  std::vector<long long> tags;
+  if (!txn.query_int("SELECT 1 FROM content_blocks WHERE id = ? AND "
+                     "status = 'published'",
+                     {content_id}, unused, published))
+    return false;
+  if (published &&
+      !txn.query("SELECT tag_id FROM content_tags WHERE content_id = ?",
+                 {content_id}, [&](sqlite3_stmt *stmt) {
+                   tags.push_back(sqlite3_column_int64(stmt, 0));
+                 }))
+    return false;
+
+  Item next;
+  std::unordered_map<long long, std::vector<Neighbour>> changed;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    next.bits = bits_for(tags);
+    next.tags = tags;
+    next.related = top_k(content_id, next, content_id, nullptr);
+
+    // Items that shared a tag before or share one now
+    std::unordered_set<long long> affected;
+    auto current = items.find(content_id);
+    for (const auto *tag_list :
+         {current != items.end() ? &current->second.tags : nullptr, &tags}) {
+      if (!tag_list)
+        continue;
+      for (long long tag : *tag_list) {
+        auto it = contents_by_tag.find(tag);
+        if (it != contents_by_tag.end())
+          affected.insert(it->second.begin(), it->second.end());
+      }
+    }
+    affected.erase(content_id);
+
+    for (long long other : affected) {
+      const Item &item = items.at(other);
+      bool listed = std::any_of(
+          item.related.begin(), item.related.end(),
+          [&](const Neighbour &n) { return n.id == content_id; });
+      Neighbour candidate{content_id, jaccard(item.bits, next.bits)};
+      bool enters = candidate.score > 0 &&
+                    (item.related.size() < k ||
+                     ranks_before(candidate, item.related.back()));
+      if (!listed && !enters)
+        continue;
+      auto related = top_k(other, item, content_id, &next);
+      if (!same_list(related, item.related))
+        changed[other] = std::move(related);
+    }
+
+    // Applied now so that items published in the same group commit score
+    // against each other; undone if this publish is rolled back
+    std::optional<Item> previous;
+    if (current != items.end())
+      previous = current->second;
+    std::unordered_map<long long, std::vector<Neighbour>> previous_lists;
+    put(content_id, published && !tags.empty() ? &next : nullptr);
+    for (const auto &[id, related] : changed) {
+      auto &item = items.at(id);
+      previous_lists[id] = std::move(item.related);
+      item.related = related;
+    }
+    txn.on_rollback.push_back([this, content_id,
+                               previous = std::move(previous),
+                               previous_lists = std::move(previous_lists)] {
+      std::lock_guard<std::mutex> lock(mutex);
+      put(content_id, previous ? &*previous : nullptr);
+      for (const auto &[id, related] : previous_lists) {
+        auto it = items.find(id);
+        if (it != items.end())
+          it->second.related = related;
+      }
+    });
+  }
+
+  if (!write_related(txn, content_id, next.related))
+    return false;
+  for (const auto &[id, related] : changed) {
+    if (!write_related(txn, id, related))
+      return false;
+  }
+
+  std::vector<long long> invalidated;
+  for (const auto &entry : changed)
+    invalidated.push_back(entry.first);
+  txn.on_commit.push_back([invalidated = std::move(invalidated)] {
+    for (long long id : invalidated)
+      content_cache().invalidate(id);
+  });
+  return true;
+}
+
+RelatedIndex &related_index() {
+  static RelatedIndex index;
+  return index;
+}
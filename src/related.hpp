@@ -0,0 +1,66 @@
+// related.hpp
+#pragma once
+
+#include "db_writer.hpp"
+
+#include <cstdint>
+#include <mutex>
+#include <sqlite3.h>
+#include <unordered_map>
+#include <vector>
+
+// "Related posts" precomputed at publish time into related_content (schema
+// migration 4). Every published item's tag set is held in memory as a
+// bitset; similarity is the Jaccard index of two bitsets, computed with
+// word-wise AND/OR popcounts. Only items sharing a tag can score above zero,
+// so a publish rescores the new item against the items reachable through
+// its tags, and rewrites another item's list only when the new item enters,
+// leaves or moves within it.
+struct RelatedIndex {
+  struct Neighbour {
+    long long id;
+    double score;
+  };
+
+  // Loads tag sets of published content and the stored neighbour lists.
+  bool warm(sqlite3 *db);
+
+  // True when content is tagged but no lists were ever stored (first start
+  // after the migration).
+  bool needs_rebuild();
+
+  // Recomputes and stores every list.
+  bool rebuild(WriteTxn &txn);
+
+  // Refreshes content_id and the lists it affects, reading its new tags and
+  // status inside the publish transaction. Memory is updated right away, so
+  // later publishes of the same group commit score against it, and
+  // restored when the publish is rolled back. When another connection has
+  // committed since the last update (a CLI publish or reindex running next
+  // to the server, seen through PRAGMA data_version), memory is loaded
+  // from the database again first.
+  bool update(WriteTxn &txn, long long content_id);
+
+private:
+  struct Item {
+    std::vector<uint64_t> bits;
+    std::vector<long long> tags;
+    std::vector<Neighbour> related;
+  };
+
+  std::vector<uint64_t> bits_for(const std::vector<long long> &tags);
+  // Replaces content_id's entry, or removes it when item is null
+  void put(long long content_id, const Item *item);
+  std::vector<Neighbour> top_k(long long self, const Item &item,
+                               long long overlay_id, const Item *overlay);
+
+  std::mutex mutex;
+  // PRAGMA data_version of the writer connection at the last update
+  long long data_version = -1;
+  size_t k = 8;
+  std::unordered_map<long long, size_t> bit_of_tag;
+  std::unordered_map<long long, Item> items;
+  std::unordered_map<long long, std::vector<long long>> contents_by_tag;
+};
+
+RelatedIndex &related_index();
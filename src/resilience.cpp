@@ -0,0 +1,150 @@
+#include "resilience.hpp"
+#include "publisher.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+thread_local Deadline thread_deadline = Deadline::max();
+
+long long ms_until(Clock::time_point when) {
+  if (when == Clock::time_point::max())
+    return LLONG_MAX;
+  return std::max<long long>(
+      0, std::chrono::duration_cast<std::chrono::milliseconds>(when -
+                                                              Clock::now())
+             .count());
+}
+
+// Closed until `threshold` transient failures in a row, then open for the
+// cooldown; the first call after it is a trial that closes or reopens it
+class CircuitBreaker {
+public:
+  // False while open; otherwise the caller may make one attempt
+  bool allow() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (failures < threshold())
+      return true;
+    auto now = Clock::now();
+    if (now < open_until || trial_running)
+      return false;
+    trial_running = true;
+    return true;
+  }
+
+  void record(CallStatus status) {
+    std::lock_guard<std::mutex> lock(mutex);
+    trial_running = false;
+    if (status != CallStatus::Transient) {
+      failures = 0;
+      return;
+    }
+    if (++failures >= threshold())
+      open_until =
+          Clock::now() + std::chrono::milliseconds(std::max(
+                             0LL, env_or("PUBLISHER_BREAKER_COOLDOWN_MS",
+                                         30000LL)));
+  }
+
+private:
+  static long long threshold() {
+    return std::max(1LL, env_or("PUBLISHER_BREAKER_FAILURES", 5LL));
+  }
+
+  std::mutex mutex;
+  long long failures = 0;
+  Clock::time_point open_until;
+  bool trial_running = false;
+};
+
+CircuitBreaker &breaker_for(const std::string &destination) {
+  static std::mutex mutex;
+  static std::map<std::string, std::unique_ptr<CircuitBreaker>> breakers;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &breaker = breakers[destination];
+  if (!breaker)
+    breaker = std::make_unique<CircuitBreaker>();
+  return *breaker;
+}
+
+} // namespace
+
+const char *call_status_name(CallStatus status) {
+  switch (status) {
+  case CallStatus::Ok:
+    return "ok";
+  case CallStatus::Transient:
+    return "transient";
+  case CallStatus::Permanent:
+    return "permanent";
+  case CallStatus::CircuitOpen:
+    return "circuit open";
+  case CallStatus::DeadlineExceeded:
+    return "deadline exceeded";
+  }
+  return "unknown";
+}
+
+Deadline request_deadline() {
+  long long ms = env_or("PUBLISHER_REQUEST_DEADLINE_MS", 600000LL);
+  if (ms <= 0)
+    return Deadline::max();
+  return Clock::now() + std::chrono::milliseconds(ms);
+}
+
+DeadlineScope::DeadlineScope(Deadline deadline) : previous(thread_deadline) {
+  thread_deadline = std::min(previous, deadline);
+}
+
+DeadlineScope::~DeadlineScope() { thread_deadline = previous; }
+
+Deadline current_deadline() { return thread_deadline; }
+
+long long deadline_remaining_ms() { return ms_until(thread_deadline); }
+
+// Exponential backoff from PUBLISHER_RETRY_BASE_MS, capped at
+// PUBLISHER_RETRY_MAX_MS, with +/-50% jitter so workers that failed
+// together do not retry together
+CallResult call_with_retry(const std::string &destination,
+                           const std::function<CallResult()> &attempt) {
+  static thread_local std::mt19937 gen(std::random_device{}());
+  long long attempts = std::max(1LL, env_or("PUBLISHER_RETRY_ATTEMPTS", 2LL));
+  long long base_ms = std::max(1LL, env_or("PUBLISHER_RETRY_BASE_MS", 250LL));
+  long long max_ms = std::max(base_ms, env_or("PUBLISHER_RETRY_MAX_MS", 5000LL));
+  CircuitBreaker &breaker = breaker_for(destination);
+
+  CallResult result;
+  for (long long n = 0; n < attempts; ++n) {
+    if (deadline_remaining_ms() == 0)
+      return CallResult::failed(CallStatus::DeadlineExceeded,
+                                destination + ": request deadline exceeded");
+    if (!breaker.allow()) {
+      log_to_file("Circuit open for " + destination + ", failing fast");
+      return CallResult::failed(CallStatus::CircuitOpen,
+                                destination + ": circuit open");
+    }
+    result = attempt();
+    breaker.record(result.status);
+    if (result.status != CallStatus::Transient)
+      return result;
+
+    log_to_file(destination + " attempt " + std::to_string(n + 1) + "/" +
+                std::to_string(attempts) + " failed: " + result.error);
+    if (n + 1 == attempts)
+      break;
+    long long backoff = std::min(max_ms, base_ms << std::min(n, 20LL));
+    std::uniform_int_distribution<long long> jitter(backoff / 2,
+                                                    backoff + backoff / 2);
+    long long sleep_ms = std::min(jitter(gen), deadline_remaining_ms());
+    std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));
+  }
+  return result;
+}
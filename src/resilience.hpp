@@ -0,0 +1,68 @@
+// resilience.hpp
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <string>
+
+// Shared failure handling for calls that leave the process: gsutil uploads
+// and the image tools. Every call returns a CallResult that says whether a
+// failure is worth retrying. call_with_retry() retries transient failures
+// with jittered exponential backoff, inside the deadline of the request
+// being served, and keeps one circuit breaker per destination. After
+// PUBLISHER_BREAKER_FAILURES transient failures in a row a destination
+// fails fast for PUBLISHER_BREAKER_COOLDOWN_MS, then lets one trial call
+// through.
+
+enum class CallStatus {
+  Ok,
+  Transient,        // worth another attempt: network, 5xx, timeouts
+  Permanent,        // retrying cannot help: bad input, missing file, 4xx
+  CircuitOpen,      // not attempted, the destination is failing
+  DeadlineExceeded, // not attempted, the request ran out of time
+};
+
+struct CallResult {
+  CallStatus status = CallStatus::Ok;
+  std::string value; // command output, or the URL of an upload
+  std::string error;
+
+  explicit operator bool() const { return status == CallStatus::Ok; }
+  static CallResult ok(std::string value = "") {
+    return {CallStatus::Ok, std::move(value), ""};
+  }
+  static CallResult failed(CallStatus status, std::string error) {
+    return {status, "", std::move(error)};
+  }
+};
+
+const char *call_status_name(CallStatus status);
+
+using Deadline = std::chrono::steady_clock::time_point;
+
+// Deadline for a request arriving now: PUBLISHER_REQUEST_DEADLINE_MS ahead
+Deadline request_deadline();
+
+// Makes `deadline` the current thread's deadline until the scope ends.
+// Threads started on behalf of a request open their own scope with the
+// deadline of the thread that started them.
+class DeadlineScope {
+public:
+  explicit DeadlineScope(Deadline deadline);
+  ~DeadlineScope();
+  DeadlineScope(const DeadlineScope &) = delete;
+  DeadlineScope &operator=(const DeadlineScope &) = delete;
+
+private:
+  Deadline previous;
+};
+
+// Deadline of the current thread; time_point::max() outside any request
+Deadline current_deadline();
+// Milliseconds left before the current deadline, never negative
+long long deadline_remaining_ms();
+
+// Runs attempt until it succeeds, fails permanently, runs out of attempts
+// (PUBLISHER_RETRY_ATTEMPTS in total) or the deadline passes
+CallResult call_with_retry(const std::string &destination,
+                           const std::function<CallResult()> &attempt);
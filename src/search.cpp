@@ -0,0 +1,247 @@
+#include "search.hpp"
+#include "db.hpp"
+#include "json.hpp"
+#include "publisher.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <unordered_map>
+
+namespace {
+
+const long long DEFAULT_RESULTS = 20;
+const long long MAX_RESULTS = 50;
+const size_t MAX_QUERY_TERMS = 16;
+
+// Elements whose content is never shown
+const char *const HIDDEN_ELEMENTS[] = {"script", "style", "noscript",
+                                       "template"};
+
+bool starts_with_icase(const std::string &s, size_t pos, const char *prefix) {
+  size_t n = strlen(prefix);
+  if (pos + n > s.size())
+    return false;
+  for (size_t i = 0; i < n; ++i) {
+    if (std::tolower((unsigned char)s[pos + i]) != prefix[i])
+      return false;
+  }
+  return true;
+}
+
+// Appends the UTF-8 encoding of an entity's code point
+void append_code_point(std::string &out, unsigned long cp) {
+  if (cp == 0 || cp > 0x10FFFF) {
+    out += ' ';
+  } else if (cp < 0x80) {
+    out += static_cast<char>(cp);
+  } else if (cp < 0x800) {
+    out += static_cast<char>(0xC0 | (cp >> 6));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    out += static_cast<char>(0xE0 | (cp >> 12));
+    out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  } else {
+    out += static_cast<char>(0xF0 | (cp >> 18));
+    out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+    out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  }
+}
+
+// Decodes the entity starting at html[pos] == '&'; returns the number of
+// bytes consumed, or 0 when it is not a recognised entity.
+size_t decode_entity(const std::string &html, size_t pos, std::string &out) {
+  static const std::unordered_map<std::string, const char *> named = {
+      {"amp", "&"},  {"lt", "<"},   {"gt", ">"},   {"quot", "\""},
+      {"apos", "'"}, {"nbsp", " "}, {"mdash", "\xE2\x80\x94"},
+      {"ndash", "\xE2\x80\x93"}, {"hellip", "\xE2\x80\xA6"},
+      {"aacute", "\xC3\xA1"}, {"eacute", "\xC3\xA9"},
+      {"iacute", "\xC3\xAD"}, {"oacute", "\xC3\xB3"},
+      {"uacute", "\xC3\xBA"}, {"ntilde", "\xC3\xB1"},
+      {"uuml", "\xC3\xBC"},   {"iexcl", "\xC2\xA1"},
+      {"iquest", "\xC2\xBF"}};
+
+  size_t end = html.find(';', pos);
+  if (end == std::string::npos || end - pos > 10)
+    return 0;
+  std::string name = html.substr(pos + 1, end - pos - 1);
+  if (name.size() > 1 && name[0] == '#') {
+    bool hex = name[1] == 'x' || name[1] == 'X';
+    std::string digits = name.substr(hex ? 2 : 1);
+    if (digits.empty() ||
+        !std::all_of(digits.begin(), digits.end(), [&](unsigned char c) {
+          return hex ? std::isxdigit(c) : std::isdigit(c);
+        }))
+      return 0;
+    append_code_point(out, std::stoul(digits, nullptr, hex ? 16 : 10));
+    return end - pos + 1;
+  }
+  auto it = named.find(name);
+  if (it == named.end())
+    return 0;
+  out += it->second;
+  return end - pos + 1;
+}
+
+// FTS5 query from free text: each word becomes a quoted string so operators
+// typed by users are matched literally.
+std::string build_match_query(const std::string &q) {
+  std::vector<std::string> terms;
+  std::string term;
+  for (unsigned char c : q) {
+    if (std::isalnum(c) || c >= 0x80) {
+      term += static_cast<char>(c);
+    } else if (!term.empty()) {
+      terms.push_back(term);
+      term.clear();
+    }
+  }
+  // Single-character prefixes would scan most of the index
+  bool prefix = term.size() >= 2;
+  if (!term.empty())
+    terms.push_back(term);
+  if (terms.size() > MAX_QUERY_TERMS)
+    terms.resize(MAX_QUERY_TERMS);
+
+  std::string match;
+  for (size_t i = 0; i < terms.size(); ++i) {
+    if (i)
+      match += " ";
+    match += "\"" + terms[i] + "\"";
+    if (prefix && i + 1 == terms.size())
+      match += "*";
+  }
+  return match;
+}
+
+void handle_search_request(const HttpRequest &req, HttpResponse &res) {
+  std::string match = build_match_query(req.param("q"));
+  long long site_id = -1;
+  long long limit = DEFAULT_RESULTS;
+  if (match.empty() ||
+      (!req.param("site_id").empty() &&
+       !parse_id(req.param("site_id"), site_id)) ||
+      (!req.param("limit").empty() && !parse_id(req.param("limit"), limit)) ||
+      limit < 1) {
+    res.send(400, "Missing or invalid q, site_id or limit parameter");
+    return;
+  }
+  limit = std::min(limit, MAX_RESULTS);
+
+  // ORDER BY rank (the weighted bm25 configured by the migration) lets FTS5
+  // sort before the LIMIT, so snippets are only built for the returned rows.
+  std::string sql = "SELECT f.id, f.site_id, f.type_id, f.title, f.slug, "
+                    "f.thumbnail_url, hit.snippet FROM (SELECT rowid AS id, "
+                    "snippet(search_index, -1, '', '', '...', 12) AS snippet, "
+                    "rank FROM search_index WHERE search_index MATCH ?";
+  std::vector<SqlParam> params{match};
+  if (site_id >= 0) {
+    sql += " AND rowid IN (SELECT id FROM feed WHERE site_id = ?)";
+    params.emplace_back(site_id);
+  }
+  sql += " ORDER BY rank LIMIT ?) hit JOIN feed f ON f.id = hit.id "
+         "ORDER BY hit.rank";
+  params.emplace_back(limit);
+
+  std::string items;
+  PooledDb db(db_pool());
+  bool ok = db && query_rows(db, sql, params, [&](sqlite3_stmt *stmt) {
+              if (!items.empty())
+                items += ",";
+              items += "{\"id\":" + json_column(stmt, 0) +
+                       ",\"site_id\":" + json_column(stmt, 1) +
+                       ",\"type_id\":" + json_column(stmt, 2) +
+                       ",\"title\":" + json_column(stmt, 3) +
+                       ",\"slug\":" + json_column(stmt, 4) +
+                       ",\"thumbnail_url\":" + json_column(stmt, 5) +
+                       ",\"snippet\":" + json_column(stmt, 6) + "}";
+            });
+  if (!ok) {
+    res.send(500, "Search failed");
+    return;
+  }
+  res.content_type = "application/json";
+  res.send(200, "{\"items\":[" + items + "]}");
+}
+
+} // namespace
+
+std::string extract_visible_text(const std::string &html) {
+  std::string text;
+  text.reserve(html.size() / 2);
+  size_t i = 0;
+  while (i < html.size()) {
+    char c = html[i];
+    if (c == '<') {
+      if (html.compare(i, 4, "<!--") == 0) {
+        size_t end = html.find("-->", i + 4);
+        i = end == std::string::npos ? html.size() : end + 3;
+        text += ' ';
+        continue;
+      }
+      const char *hidden = nullptr;
+      for (const char *name : HIDDEN_ELEMENTS) {
+        size_t n = strlen(name);
+        if (starts_with_icase(html, i + 1, name) &&
+            (i + 1 + n == html.size() ||
+             !std::isalnum((unsigned char)html[i + 1 + n])))
+          hidden = name;
+      }
+      if (hidden) {
+        // Skip to the matching close tag
+        std::string close = std::string("</") + hidden;
+        size_t end = html.find('<', i + 1);
+        while (end != std::string::npos &&
+               !starts_with_icase(html, end, close.c_str()))
+          end = html.find('<', end + 1);
+        i = end == std::string::npos ? html.size() : end;
+      }
+      size_t end = html.find('>', i);
+      i = end == std::string::npos ? html.size() : end + 1;
+      text += ' ';
+      continue;
+    }
+    if (c == '&') {
+      size_t used = decode_entity(html, i, text);
+      if (used) {
+        i += used;
+        continue;
+      }
+    }
+    text += c;
+    ++i;
+  }
+
+  // Collapse whitespace runs
+  std::string out;
+  out.reserve(text.size());
+  bool space = false;
+  for (char ch : text) {
+    if (std::isspace(static_cast<unsigned char>(ch))) {
+      space = !out.empty();
+    } else {
+      if (space)
+        out += ' ';
+      space = false;
+      out += ch;
+    }
+  }
+  return out;
+}
+
+bool index_search_document(WriteTxn &txn, long long content_id,
+                           const SearchDocument &doc) {
+  return txn.exec("DELETE FROM search_index WHERE rowid = ?", {content_id}) &&
+         txn.exec("INSERT INTO search_index (rowid, title, tags, body, "
+                  "caption, location) SELECT ?, ?, ?, ?, ?, ? WHERE EXISTS "
+                  "(SELECT 1 FROM content_blocks WHERE id = ? AND status = "
+                  "'published')",
+                  {content_id, doc.title, doc.tags, doc.body, doc.caption,
+                   doc.location, content_id});
+}
+
+void register_search_routes(HttpServer &server) {
+  server.route("/search", handle_search_request);
+}
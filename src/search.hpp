@@ -0,0 +1,32 @@
+// search.hpp
+#pragma once
+
+#include "db_writer.hpp"
+#include "http_server.hpp"
+
+#include <string>
+
+// Columns of the search_index FTS5 table (schema migration 3). The table's
+// rowid is the content id.
+struct SearchDocument {
+  std::string title;
+  std::string tags; // space separated
+  std::string body; // visible text of index.html
+  std::string caption;
+  std::string location;
+};
+
+// Text a reader would see: drops tags, comments and the contents of
+// script/style blocks, decodes common entities and collapses whitespace.
+std::string extract_visible_text(const std::string &html);
+
+// Replaces the index row of content_id inside the publish transaction.
+// Content that is not published is removed from the index instead.
+bool index_search_document(WriteTxn &txn, long long content_id,
+                           const SearchDocument &doc);
+
+// GET /search?q=&site_id=&limit=
+// Every word must match; the last one also matches as a prefix so
+// search-as-you-type works. Results are ranked by BM25 with title and tag
+// hits weighted above body text.
+void register_search_routes(HttpServer &server);
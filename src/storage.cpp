@@ -0,0 +1,524 @@
+#include "storage.hpp"
+#include "process.hpp"
+#include "publisher.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Bytes read from the source per pread while sending a chunk
+const size_t SEND_BUFFER_BYTES = 1 << 20;
+// gsutil compose takes at most 32 source objects per call
+const size_t COMPOSE_MAX_SOURCES = 32;
+
+// CRC32C (Castagnoli), the checksum GCS keeps for every object
+const std::array<uint32_t, 256> CRC32C_TABLE = [] {
+  std::array<uint32_t, 256> table{};
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; ++bit)
+      crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    table[i] = crc;
+  }
+  return table;
+}();
+
+uint32_t crc32c_update(uint32_t crc, const char *data, size_t n) {
+  crc = ~crc;
+  for (size_t i = 0; i < n; ++i)
+    crc = CRC32C_TABLE[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+std::string crc_hex(uint32_t crc) {
+  char buf[9];
+  snprintf(buf, sizeof(buf), "%08x", crc);
+  return buf;
+}
+
+// `gsutil stat` prints "Hash (crc32c): yZRlqg==", the big-endian value in
+// base64
+bool parse_stat_crc32c(const std::string &output, uint32_t &crc) {
+  static const std::string BASE64 =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  const std::string label = "Hash (crc32c):";
+  size_t pos = output.find(label);
+  if (pos == std::string::npos)
+    return false;
+  std::istringstream in(output.substr(pos + label.size()));
+  std::string encoded;
+  in >> encoded;
+
+  uint32_t bits = 0;
+  int pending = 0;
+  std::string bytes;
+  for (char c : encoded) {
+    if (c == '=')
+      break;
+    size_t value = BASE64.find(c);
+    if (value == std::string::npos)
+      return false;
+    bits = (bits << 6) | (uint32_t)value;
+    pending += 6;
+    if (pending >= 8) {
+      pending -= 8;
+      bytes += (char)((bits >> pending) & 0xff);
+    }
+  }
+  if (bytes.size() != 4)
+    return false;
+  crc = 0;
+  for (char byte : bytes)
+    crc = (crc << 8) | (unsigned char)byte;
+  return true;
+}
+
+// Objects go to a local directory instead of the bucket when
+// PUBLISHER_STORAGE_DIR is set; used as a fake store in development
+fs::path local_store() {
+  return env_or("PUBLISHER_STORAGE_DIR", std::string());
+}
+
+std::string object_url(const std::string &key) {
+  return "gs://" + GCS_PUBLIC_BUCKET + "/" + key;
+}
+
+std::string public_url(const std::string &key) {
+  return GCS_PUBLIC_URL + GCS_PUBLIC_BUCKET + "/" + key;
+}
+
+// gsutil exits 1 for everything; errors that retrying cannot fix are told
+// apart by their message
+CallStatus classify_gsutil_error(const std::string &output) {
+  static const char *PERMANENT[] = {
+      "AccessDeniedException", "BadRequestException", "NotFoundException",
+      "No URLs matched",       "401 ",                "403 ",
+      "404 ",                  "No such file"};
+  for (const char *marker : PERMANENT) {
+    if (output.find(marker) != std::string::npos)
+      return CallStatus::Permanent;
+  }
+  return CallStatus::Transient;
+}
+
+CallResult run_gsutil(std::vector<std::string> args,
+                      const ProcessOptions &options = {}) {
+  args.insert(args.begin(), "gsutil");
+  CallResult result = run_process(args, options);
+  if (!result && result.status == CallStatus::Permanent)
+    result.status = classify_gsutil_error(result.error);
+  return result;
+}
+
+// Sends length bytes at offset of fd to key, computing their CRC32C on the
+// way. gsutil reads the chunk from stdin, so no chunk file is written.
+CallResult put_range(int fd, unsigned long long offset,
+                     unsigned long long length, const std::string &key,
+                     uint32_t &crc) {
+  crc = 0;
+  bool short_read = false;
+  auto read_chunk = [&](char *buf, size_t n) -> long long {
+    if (length == 0)
+      return 0;
+    ssize_t got = pread(fd, buf, (size_t)std::min<unsigned long long>(n, length),
+                        (off_t)offset);
+    if (got <= 0) {
+      short_read = true;
+      return -1;
+    }
+    crc = crc32c_update(crc, buf, (size_t)got);
+    offset += (unsigned long long)got;
+    length -= (unsigned long long)got;
+    return got;
+  };
+
+  CallResult result;
+  fs::path store = local_store();
+  if (store.empty()) {
+    ProcessOptions options;
+    options.input = read_chunk;
+    result = run_gsutil({"-q", "cp", "-", object_url(key)}, options);
+  } else {
+    fs::create_directories((store / key).parent_path());
+    std::ofstream out(store / key, std::ios::binary | std::ios::trunc);
+    std::vector<char> buffer(SEND_BUFFER_BYTES);
+    long long n;
+    while (out && (n = read_chunk(buffer.data(), buffer.size())) > 0)
+      out.write(buffer.data(), n);
+    out.close();
+    if (!out)
+      result = CallResult::failed(CallStatus::Transient, "writing " + key);
+  }
+  // The source shrank or cannot be read; sending again will not help
+  if (short_read)
+    return CallResult::failed(CallStatus::Permanent,
+                              "short read at offset " + std::to_string(offset));
+  return result;
+}
+
+// CRC32C of the stored object, as the store reports it
+CallResult stored_crc32c(const std::string &key, uint32_t &crc) {
+  fs::path store = local_store();
+  if (store.empty()) {
+    CallResult stat = run_gsutil({"stat", object_url(key)});
+    if (stat && !parse_stat_crc32c(stat.value, crc))
+      return CallResult::failed(CallStatus::Transient,
+                                "no crc32c in stat of " + key);
+    return stat;
+  }
+  std::ifstream in(store / key, std::ios::binary);
+  if (!in)
+    return CallResult::failed(CallStatus::Transient, key + " not stored");
+  std::vector<char> buffer(SEND_BUFFER_BYTES);
+  crc = 0;
+  while (in.read(buffer.data(), buffer.size()) || in.gcount() > 0)
+    crc = crc32c_update(crc, buffer.data(), (size_t)in.gcount());
+  return CallResult::ok();
+}
+
+// gsutil compose arguments that concatenate parts, in order, into key.
+// gsutil composes 32 objects at a time, so longer lists are folded into
+// the destination in rounds: 32 parts first, then key and 31 more.
+std::vector<std::vector<std::string>>
+compose_rounds(const std::vector<std::string> &parts, const std::string &key) {
+  std::vector<std::vector<std::string>> rounds;
+  size_t done = 0;
+  while (done < parts.size()) {
+    std::vector<std::string> args = {"-q", "compose"};
+    size_t room = COMPOSE_MAX_SOURCES;
+    if (done > 0) {
+      args.push_back(object_url(key));
+      room--;
+    }
+    size_t end = std::min(parts.size(), done + room);
+    for (size_t i = done; i < end; ++i)
+      args.push_back(object_url(parts[i]));
+    args.push_back(object_url(key));
+    rounds.push_back(std::move(args));
+    done = end;
+  }
+  return rounds;
+}
+
+// Concatenates parts, in order, into key
+CallResult compose_parts(const std::vector<std::string> &parts,
+                         const std::string &key) {
+  fs::path store = local_store();
+  if (!store.empty()) {
+    fs::path dest = store / key;
+    fs::path partial = dest.string() + ".compose";
+    fs::create_directories(dest.parent_path());
+    std::ofstream out(partial, std::ios::binary | std::ios::trunc);
+    for (const auto &part : parts) {
+      std::ifstream in(store / part, std::ios::binary);
+      if (!in || !(out << in.rdbuf()))
+        return CallResult::failed(CallStatus::Transient, part + " missing");
+    }
+    out.close();
+    if (!out)
+      return CallResult::failed(CallStatus::Transient, "writing " + key);
+    fs::rename(partial, dest);
+    return CallResult::ok();
+  }
+
+  for (const auto &args : compose_rounds(parts, key)) {
+    CallResult round =
+        call_with_retry("gcs", [&] { return run_gsutil(args); });
+    if (!round)
+      return round;
+  }
+  return CallResult::ok();
+}
+
+void remove_objects(const std::vector<std::string> &keys) {
+  fs::path store = local_store();
+  std::error_code ec;
+  for (size_t i = 0; i < keys.size(); i += 100) {
+    std::vector<std::string> args = {"-m", "-q", "rm"};
+    for (size_t j = i; j < std::min(keys.size(), i + 100); ++j) {
+      if (!store.empty()) {
+        fs::remove(store / keys[j], ec);
+        fs::remove((store / keys[j]).parent_path(), ec); // once empty
+      }
+      args.push_back(object_url(keys[j]));
+    }
+    // Leftover parts only cost storage; no retry
+    if (store.empty())
+      run_gsutil(args);
+  }
+}
+
+// A chunked upload in progress. Its state file lives under
+// PUBLISHER_UPLOAD_STATE_DIR, named after the source path, size and mtime,
+// so publishing the same unchanged file again picks the session back up.
+// Each line after the header records one chunk whose stored CRC32C matched.
+class UploadSession {
+public:
+  UploadSession(const fs::path &file, const struct stat &st,
+                unsigned long long chunk_bytes)
+      : size((unsigned long long)st.st_size), chunk_bytes(chunk_bytes) {
+    // FNV-1a; stable across restarts, unlike std::hash
+    std::string identity = fs::absolute(file).string() + "\n" +
+                           std::to_string(st.st_size) + "\n" +
+                           std::to_string(st.st_mtim.tv_sec) + "." +
+                           std::to_string(st.st_mtim.tv_nsec);
+    uint64_t hash = 1469598103934665603ULL;
+    for (char c : identity)
+      hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+    state_file = fs::path(env_or("PUBLISHER_UPLOAD_STATE_DIR",
+                                 STORAGE_ROOT + ".uploads")) /
+                 name;
+  }
+
+  // Resumes the saved session for this file, or starts one writing to key
+  bool open(const std::string &key) {
+    std::ifstream in(state_file);
+    std::string line;
+    std::map<std::string, std::string> header;
+    while (in && std::getline(in, line)) {
+      size_t eq = line.find('=');
+      if (line.rfind("chunk ", 0) == 0) {
+        std::istringstream fields(line.substr(6));
+        size_t index;
+        std::string crc;
+        if (fields >> index >> crc)
+          committed[index] = crc;
+      } else if (eq != std::string::npos) {
+        header[line.substr(0, eq)] = line.substr(eq + 1);
+      }
+    }
+    if (!header["key"].empty() && header["size"] == std::to_string(size) &&
+        header["chunk_bytes"] == std::to_string(chunk_bytes)) {
+      object_key = header["key"];
+      id = header["id"];
+      log_to_file("Resuming upload of " + object_key + " with " +
+                  std::to_string(committed.size()) + " chunks committed");
+      return true;
+    }
+
+    committed.clear();
+    object_key = key;
+    id = generate_uuid();
+    std::error_code ec;
+    fs::create_directories(state_file.parent_path(), ec);
+    std::ofstream out(state_file, std::ios::trunc);
+    out << "key=" << object_key << "\nid=" << id << "\nsize=" << size
+        << "\nchunk_bytes=" << chunk_bytes << "\n";
+    return (bool)out.flush();
+  }
+
+  size_t chunk_count() const {
+    return (size_t)((size + chunk_bytes - 1) / chunk_bytes);
+  }
+
+  std::string part_key(size_t index) const {
+    char name[24];
+    snprintf(name, sizeof(name), "%06zu", index);
+    return "uploads/" + id + "/" + name;
+  }
+
+  bool is_committed(size_t index) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return committed.count(index) > 0;
+  }
+
+  void commit(size_t index, uint32_t crc) {
+    std::lock_guard<std::mutex> lock(mutex);
+    committed[index] = crc_hex(crc);
+    std::ofstream out(state_file, std::ios::app);
+    out << "chunk " << index << " " << crc_hex(crc) << "\n";
+  }
+
+  size_t committed_count() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return committed.size();
+  }
+
+  void finish() {
+    std::error_code ec;
+    fs::remove(state_file, ec);
+  }
+
+  std::string object_key;
+  unsigned long long size;
+  unsigned long long chunk_bytes;
+
+private:
+  fs::path state_file;
+  std::string id;
+  std::map<size_t, std::string> committed;
+  std::mutex mutex;
+};
+
+// Uploads file in chunks of PUBLISHER_UPLOAD_CHUNK_BYTES, up to
+// PUBLISHER_UPLOAD_PARALLEL at once, then composes them into one object
+CallResult upload_chunked(const fs::path &file, const struct stat &st,
+                          const std::string &key) {
+  unsigned long long chunk_bytes = (unsigned long long)std::max(
+      1LL << 20, env_or("PUBLISHER_UPLOAD_CHUNK_BYTES", 16LL << 20));
+  UploadSession session(file, st, chunk_bytes);
+  if (!session.open(key))
+    return CallResult::failed(CallStatus::Permanent,
+                              "cannot save upload state for " + file.string());
+
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return CallResult::failed(CallStatus::Permanent,
+                              "cannot open " + file.string());
+
+  size_t chunks = session.chunk_count();
+  std::atomic<size_t> next{0};
+  std::atomic<bool> failed{false};
+  std::mutex error_mutex;
+  CallResult error;
+  Deadline deadline = current_deadline();
+  auto send_chunks = [&] {
+    DeadlineScope scope(deadline);
+    for (size_t i = next++; i < chunks && !failed; i = next++) {
+      if (session.is_committed(i))
+        continue;
+      unsigned long long offset = i * chunk_bytes;
+      unsigned long long length = std::min(chunk_bytes, session.size - offset);
+      uint32_t sent = 0;
+      CallResult chunk = call_with_retry("gcs", [&] {
+        uint32_t stored = 0;
+        CallResult step = put_range(fd, offset, length, session.part_key(i), sent);
+        if (step)
+          step = stored_crc32c(session.part_key(i), stored);
+        if (step && sent != stored)
+          return CallResult::failed(CallStatus::Transient,
+                                    "chunk " + std::to_string(i) +
+                                        " stored with crc32c " +
+                                        crc_hex(stored) + ", sent " +
+                                        crc_hex(sent));
+        return step;
+      });
+      if (!chunk) {
+        log_to_file("Chunk " + std::to_string(i) + " of " + file.string() +
+                    " failed: " + chunk.error);
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!failed)
+          error = chunk;
+        failed = true;
+        return;
+      }
+      session.commit(i, sent);
+      log_to_file("Uploaded chunk " + std::to_string(i + 1) + "/" +
+                  std::to_string(chunks) + " of " + file.string() + " (" +
+                  std::to_string(session.committed_count()) + " committed)");
+    }
+  };
+
+  size_t workers = (size_t)std::max(
+      1LL, std::min((long long)chunks,
+                    env_or("PUBLISHER_UPLOAD_PARALLEL", 4LL)));
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < workers; ++i)
+    threads.emplace_back(send_chunks);
+  send_chunks();
+  for (auto &thread : threads)
+    thread.join();
+  close(fd);
+
+  if (failed) {
+    error.error = "chunked upload of " + file.string() + " stopped with " +
+                  std::to_string(session.committed_count()) + " of " +
+                  std::to_string(chunks) + " chunks committed: " + error.error;
+    return error;
+  }
+
+  std::vector<std::string> parts;
+  for (size_t i = 0; i < chunks; ++i)
+    parts.push_back(session.part_key(i));
+  CallResult composed = compose_parts(parts, session.object_key);
+  if (!composed)
+    return composed;
+  remove_objects(parts);
+  session.finish();
+  log_to_file("Composed " + session.object_key + " from " +
+              std::to_string(chunks) + " chunks");
+  return CallResult::ok(public_url(session.object_key));
+}
+
+} // namespace
+
+CallResult upload_public_file(const fs::path &file, const std::string &key) {
+  struct stat st;
+  if (VIDEO_EXTENSIONS.count(file.extension().string()) &&
+      stat(file.c_str(), &st) == 0 &&
+      st.st_size >= env_or("PUBLISHER_CHUNKED_UPLOAD_BYTES", 64LL << 20))
+    return upload_chunked(file, st, key);
+
+  std::string url = public_url(key);
+  fs::path store = local_store();
+  if (!store.empty()) {
+    std::error_code ec;
+    fs::create_directories((store / key).parent_path(), ec);
+    if (!fs::copy_file(file, store / key, fs::copy_options::overwrite_existing,
+                       ec))
+      return CallResult::failed(CallStatus::Permanent,
+                                "storing " + key + ": " + ec.message());
+    return CallResult::ok(url);
+  }
+
+  log_to_file("Uploading " + file.string() + " to " + object_url(key));
+  CallResult result = call_with_retry("gcs", [&] {
+    return run_gsutil({"cp", file.string(), object_url(key)});
+  });
+  if (!result)
+    return result;
+  return CallResult::ok(url);
+}
+
+CallResult copy_public_object(const std::string &from_key,
+                              const std::string &key) {
+  fs::path store = local_store();
+  if (!store.empty()) {
+    std::error_code ec;
+    fs::create_directories((store / key).parent_path(), ec);
+    if (!fs::copy_file(store / from_key, store / key,
+                       fs::copy_options::overwrite_existing, ec))
+      return CallResult::failed(CallStatus::Permanent,
+                                "copying " + from_key + ": " + ec.message());
+    return CallResult::ok(public_url(key));
+  }
+
+  // A cp between two gs:// URLs is a rewrite inside GCS
+  log_to_file("Copying " + object_url(from_key) + " to " + object_url(key));
+  CallResult result = call_with_retry("gcs", [&] {
+    return run_gsutil({"cp", object_url(from_key), object_url(key)});
+  });
+  if (!result)
+    return result;
+  return CallResult::ok(public_url(key));
+}
+
+void remove_public_objects(const std::vector<std::string> &urls) {
+  std::string prefix = public_url("");
+  std::vector<std::string> keys;
+  for (const auto &url : urls) {
+    if (url.size() > prefix.size() && url.compare(0, prefix.size(), prefix) == 0)
+      keys.push_back(url.substr(prefix.size()));
+  }
+  if (keys.empty())
+    return;
+  log_to_file("Removing " + std::to_string(keys.size()) +
+              " unreferenced objects");
+  remove_objects(keys);
+}
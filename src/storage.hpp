@@ -0,0 +1,35 @@
+// storage.hpp
+#pragma once
+
+#include "resilience.hpp"
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Uploads to the public media bucket. gsutil is started without a shell
+// (see process.hpp) and reads each file where it already is.
+//
+// Videos of PUBLISHER_CHUNKED_UPLOAD_BYTES or more are sent as chunks in
+// parallel, each checked against the CRC32C the store reports, and then
+// composed into the final object. Committed chunks are recorded on disk,
+// so publishing the same unchanged file after a failure or restart only
+// sends the chunks that are missing. PUBLISHER_STORAGE_DIR swaps the
+// bucket for a local directory, which serves as a fake store in tests.
+
+// Uploads file as gs://GCS_PUBLIC_BUCKET/key; the result's value is the
+// public URL. A resumed chunked upload keeps the key of its first attempt.
+// gsutil calls go through call_with_retry() under the "gcs" breaker.
+CallResult upload_public_file(const std::filesystem::path &file,
+                              const std::string &key);
+
+// Creates key as a copy of the stored object from_key. The bucket copies
+// it server-side, so no bytes are sent from this machine again. The
+// result's value is the public URL of key.
+CallResult copy_public_object(const std::string &from_key,
+                              const std::string &key);
+
+// Deletes the objects behind these public URLs, e.g. uploads of a publish
+// that failed. URLs outside the bucket are ignored; a failed delete only
+// leaves the object behind.
+void remove_public_objects(const std::vector<std::string> &urls);
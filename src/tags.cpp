@@ -0,0 +1,183 @@
+#include "tags.hpp"
+#include "publisher.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_set>
+
+namespace {
+
+// Stay well under SQLITE_MAX_VARIABLE_NUMBER (999 on older builds).
+const size_t MAX_ROWS_PER_STATEMENT = 400;
+
+std::string placeholders(size_t rows, const std::string &row) {
+  std::string sql;
+  for (size_t i = 0; i < rows; ++i) {
+    if (i)
+      sql += ", ";
+    sql += row;
+  }
+  return sql;
+}
+
+std::string trim(const std::string &s, const char *chars) {
+  size_t start = s.find_first_not_of(chars);
+  if (start == std::string::npos)
+    return "";
+  size_t end = s.find_last_not_of(chars);
+  return s.substr(start, end - start + 1);
+}
+
+std::vector<std::string> split_tags(const std::string &text, char delimiter,
+                                    const char *trim_chars) {
+  std::vector<std::string> names;
+  std::unordered_set<std::string> seen;
+  size_t start = 0;
+  while (start <= text.size()) {
+    size_t end = text.find(delimiter, start);
+    if (end == std::string::npos)
+      end = text.size();
+    std::string name = trim(text.substr(start, end - start), trim_chars);
+    if (!name.empty() && seen.insert(name).second)
+      names.push_back(name);
+    start = end + 1;
+  }
+  return names;
+}
+
+} // namespace
+
+bool TagDictionary::warm(sqlite3 *db) {
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, "SELECT id, name FROM tags", -1, &stmt,
+                         nullptr) != SQLITE_OK) {
+    log_to_file("Failed to load tags: " + std::string(sqlite3_errmsg(db)));
+    return false;
+  }
+
+  std::unordered_map<std::string, long long> loaded;
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    const unsigned char *name = sqlite3_column_text(stmt, 1);
+    if (name)
+      loaded[reinterpret_cast<const char *>(name)] =
+          sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+
+  std::unique_lock<std::shared_mutex> lock(mutex);
+  ids_by_name = std::move(loaded);
+  log_to_file("Tag dictionary warmed with " +
+              std::to_string(ids_by_name.size()) + " tags");
+  return true;
+}
+
+bool TagDictionary::resolve(WriteTxn &txn,
+                            const std::vector<std::string> &names,
+                            std::vector<long long> &ids) {
+  ids.assign(names.size(), -1);
+  std::vector<std::string> missing;
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    for (size_t i = 0; i < names.size(); ++i) {
+      auto it = ids_by_name.find(names[i]);
+      if (it != ids_by_name.end())
+        ids[i] = it->second;
+      else
+        missing.push_back(names[i]);
+    }
+  }
+  if (missing.empty())
+    return true;
+
+  std::unordered_map<std::string, long long> created;
+  for (size_t offset = 0; offset < missing.size();
+       offset += MAX_ROWS_PER_STATEMENT) {
+    size_t count = std::min(MAX_ROWS_PER_STATEMENT, missing.size() - offset);
+    std::vector<SqlParam> params(missing.begin() + offset,
+                                 missing.begin() + offset + count);
+
+    if (!txn.exec("INSERT OR IGNORE INTO tags (name) VALUES " +
+                      placeholders(count, "(?)"),
+                  params))
+      return false;
+    if (!txn.query("SELECT id, name FROM tags WHERE name IN (" +
+                       placeholders(count, "?") + ")",
+                   params, [&](sqlite3_stmt *stmt) {
+                     created[reinterpret_cast<const char *>(
+                         sqlite3_column_text(stmt, 1))] =
+                         sqlite3_column_int64(stmt, 0);
+                   }))
+      return false;
+  }
+
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (ids[i] != -1)
+      continue;
+    auto it = created.find(names[i]);
+    if (it != created.end()) {
+      ids[i] = it->second;
+      continue;
+    }
+    // The column collation matched an existing spelling of the name
+    bool found = false;
+    if (!txn.query_int("SELECT id FROM tags WHERE name = ?", {names[i]},
+                       ids[i], found))
+      return false;
+    if (!found) {
+      txn.result.error = "Tag could not be resolved: " + names[i];
+      return false;
+    }
+  }
+
+  txn.on_commit.push_back([this, created = std::move(created)] {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    ids_by_name.insert(created.begin(), created.end());
+  });
+  return true;
+}
+
+size_t TagDictionary::size() {
+  std::shared_lock<std::shared_mutex> lock(mutex);
+  return ids_by_name.size();
+}
+
+TagDictionary &tag_dictionary() {
+  static TagDictionary dictionary;
+  return dictionary;
+}
+
+std::vector<std::string> parse_tag_list(const std::string &tags) {
+  return split_tags(tags, ',', " \t\r");
+}
+
+std::vector<std::string> parse_hashtags(const std::string &hashtags) {
+  return split_tags(hashtags, '#', " \t\r,");
+}
+
+bool write_content_tags(WriteTxn &txn, long long content_id,
+                        const std::vector<std::string> &names) {
+  if (!txn.exec("DELETE FROM content_tags WHERE content_id = ?", {content_id}))
+    return false;
+  if (names.empty())
+    return true;
+
+  std::vector<long long> tag_ids;
+  if (!tag_dictionary().resolve(txn, names, tag_ids))
+    return false;
+
+  for (size_t offset = 0; offset < tag_ids.size();
+       offset += MAX_ROWS_PER_STATEMENT) {
+    size_t count = std::min(MAX_ROWS_PER_STATEMENT, tag_ids.size() - offset);
+    std::vector<SqlParam> params;
+    params.reserve(count * 2);
+    for (size_t i = offset; i < offset + count; ++i) {
+      params.emplace_back(content_id);
+      params.emplace_back(tag_ids[i]);
+    }
+    if (!txn.exec("INSERT INTO content_tags (content_id, tag_id) VALUES " +
+                      placeholders(count, "(?, ?)"),
+                  params))
+      return false;
+  }
+  return true;
+}
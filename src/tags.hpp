@@ -0,0 +1,42 @@
+// tags.hpp
+#pragma once
+
+#include "db_writer.hpp"
+
+#include <shared_mutex>
+#include <sqlite3.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Process-wide tag name -> id cache. Warmed once at startup; ids created by
+// a publish are added only after its transaction commits, so the cache never
+// holds a rowid that was rolled back.
+struct TagDictionary {
+  bool warm(sqlite3 *db);
+
+  // Resolves names to tag ids inside a write batch (ids[i] matches
+  // names[i]). Names missing from the cache are inserted with one
+  // multi-row INSERT OR IGNORE and read back with one SELECT.
+  bool resolve(WriteTxn &txn, const std::vector<std::string> &names,
+               std::vector<long long> &ids);
+
+  size_t size();
+
+private:
+  std::shared_mutex mutex;
+  std::unordered_map<std::string, long long> ids_by_name;
+};
+
+TagDictionary &tag_dictionary();
+
+// "a, b,c" -> {"a", "b", "c"}; trims whitespace, drops empties and repeats
+std::vector<std::string> parse_tag_list(const std::string &tags);
+
+// "#sun #beach,#sun" -> {"sun", "beach"}
+std::vector<std::string> parse_hashtags(const std::string &hashtags);
+
+// Replaces the tag set of content_id with names, using one batched
+// content_tags insert.
+bool write_content_tags(WriteTxn &txn, long long content_id,
+                        const std::vector<std::string> &names);
@@ -0,0 +1,274 @@
+#include "watcher.hpp"
+#include "publisher.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const uint32_t WATCH_EVENTS = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE |
+                              IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO |
+                              IN_DELETE | IN_ONLYDIR;
+// Re-check interval while a due directory waits for its previous publish
+const long long BLOCKED_POLL_MS = 250;
+
+class DropWatcher {
+public:
+  DropWatcher(int fd, fs::path root, std::chrono::milliseconds quiet,
+              std::string marker, PublishDirs publish)
+      : fd(fd), root(std::move(root)), quiet(quiet), marker(std::move(marker)),
+        publish(std::move(publish)) {}
+
+  bool watch_root() {
+    if (!add_watch(root, ""))
+      return false;
+    std::error_code ec;
+    for (const auto &entry : fs::directory_iterator(root, ec)) {
+      std::string name = entry.path().filename().string();
+      if (entry.is_directory(ec) && name[0] != '.')
+        watch_tree(entry.path(), entry.path().string());
+    }
+    return true;
+  }
+
+  // Reads events and moves directories whose deadline passed to `ready`
+  void watch_loop() {
+    alignas(inotify_event) char buf[64 * 1024];
+    while (true) {
+      pollfd pfd{fd, POLLIN, 0};
+      if (poll(&pfd, 1, next_timeout_ms()) < 0 && errno != EINTR) {
+        log_to_file("Drop watcher stopped: poll failed");
+        return;
+      }
+      if (pfd.revents & POLLIN) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        for (ssize_t pos = 0; pos < len;) {
+          const auto *event = reinterpret_cast<inotify_event *>(buf + pos);
+          handle(*event);
+          pos += sizeof(inotify_event) + event->len;
+        }
+      }
+      dispatch_due();
+    }
+  }
+
+  // Publishes ready directories one batch at a time
+  void publish_loop() {
+    while (true) {
+      std::vector<std::string> batch;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready_cv.wait(lock, [&] { return !ready.empty(); });
+        batch.swap(ready);
+      }
+      log_to_file("Drop watcher publishing " + std::to_string(batch.size()) +
+                  " directories");
+      publish(batch);
+      std::lock_guard<std::mutex> lock(mutex);
+      for (const auto &dir : batch)
+        in_flight.erase(dir);
+    }
+  }
+
+private:
+  bool add_watch(const fs::path &dir, const std::string &article) {
+    int wd = inotify_add_watch(fd, dir.c_str(), WATCH_EVENTS);
+    if (wd < 0) {
+      log_to_file("Drop watcher cannot watch " + dir.string() + ": " +
+                  std::string(strerror(errno)));
+      return false;
+    }
+    watches[wd] = {dir, article};
+    return true;
+  }
+
+  // Watches a directory and everything already below it; files copied in
+  // before the watch existed are covered by the quiet period
+  void watch_tree(const fs::path &dir, const std::string &article) {
+    add_watch(dir, article);
+    std::error_code ec;
+    for (auto it = fs::recursive_directory_iterator(dir, ec);
+         !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+      if (it->is_directory(ec))
+        add_watch(it->path(), article);
+    }
+  }
+
+  void handle(const inotify_event &event) {
+    if (event.mask & IN_Q_OVERFLOW) {
+      // Some edits went unseen; republish everything being copied
+      log_to_file("Drop watcher event queue overflowed");
+      std::unordered_set<std::string> articles;
+      for (const auto &entry : watches) {
+        if (!entry.second.article.empty())
+          articles.insert(entry.second.article);
+      }
+      for (const auto &article : articles)
+        touch(article, false);
+      return;
+    }
+    auto it = watches.find(event.wd);
+    if (it == watches.end())
+      return;
+    if (event.mask & IN_IGNORED) {
+      watches.erase(it);
+      return;
+    }
+    std::string name = event.len ? event.name : "";
+    fs::path dir = it->second.dir;
+    std::string article = it->second.article;
+    bool created = event.mask & (IN_CREATE | IN_MOVED_TO);
+
+    if (article.empty()) {
+      // Top level: only directories not hidden by rsync and friends count
+      if (!(event.mask & IN_ISDIR) || name.empty() || name[0] == '.')
+        return;
+      article = (dir / name).string();
+      if (!created) {
+        pending.erase(article);
+        marker_seen.erase(article);
+        return;
+      }
+      watch_tree(dir / name, article);
+      touch(article, false);
+      return;
+    }
+
+    if (created && (event.mask & IN_ISDIR))
+      watch_tree(dir / name, article);
+    if (!marker.empty() && name == marker && dir.string() == article) {
+      // Only finished writes count, and one touch raises several of
+      // those; trigger once per marker mtime
+      if (!(event.mask & (IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO)))
+        return;
+      std::error_code ec;
+      auto written = fs::last_write_time(dir / name, ec);
+      auto &seen = marker_seen[article];
+      if (ec || written == seen)
+        return;
+      seen = written;
+      touch(article, true);
+      return;
+    }
+    touch(article, false);
+  }
+
+  void touch(const std::string &article, bool marker_written) {
+    std::error_code ec;
+    if (!fs::is_directory(article, ec)) {
+      pending.erase(article);
+      return;
+    }
+    auto &due = pending.try_emplace(article, Clock::time_point::max())
+                    .first->second;
+    if (marker_written)
+      due = Clock::now();
+    else if (quiet.count() > 0)
+      due = Clock::now() + quiet;
+  }
+
+  void dispatch_due() {
+    auto now = Clock::now();
+    std::lock_guard<std::mutex> lock(mutex);
+    bool queued = false;
+    for (auto it = pending.begin(); it != pending.end();) {
+      if (it->second <= now && !in_flight.count(it->first)) {
+        in_flight.insert(it->first);
+        ready.push_back(it->first);
+        it = pending.erase(it);
+        queued = true;
+      } else {
+        ++it;
+      }
+    }
+    if (queued)
+      ready_cv.notify_one();
+  }
+
+  int next_timeout_ms() {
+    auto next = Clock::time_point::max();
+    for (const auto &entry : pending)
+      next = std::min(next, entry.second);
+    if (next == Clock::time_point::max())
+      return -1;
+    auto now = Clock::now();
+    // Still due after dispatch_due: waiting for its previous publish
+    if (next <= now)
+      return (int)BLOCKED_POLL_MS;
+    return (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+               next - now)
+               .count() +
+           1;
+  }
+
+  struct Watch {
+    fs::path dir;
+    std::string article; // top-level directory, empty for the root itself
+  };
+
+  int fd;
+  fs::path root;
+  std::chrono::milliseconds quiet;
+  std::string marker;
+  PublishDirs publish;
+  // Owned by the watch thread
+  std::unordered_map<int, Watch> watches;
+  std::unordered_map<std::string, Clock::time_point> pending;
+  std::unordered_map<std::string, fs::file_time_type> marker_seen;
+  // Shared with the publish thread
+  std::mutex mutex;
+  std::condition_variable ready_cv;
+  std::unordered_set<std::string> in_flight;
+  std::vector<std::string> ready;
+};
+
+} // namespace
+
+bool start_drop_watcher(PublishDirs publish) {
+  std::string root = env_or("PUBLISHER_WATCH_ROOT", std::string());
+  if (root.empty())
+    return false;
+  std::error_code ec;
+  if (!fs::is_directory(root, ec)) {
+    log_to_file("Drop watcher disabled: " + root + " is not a directory");
+    return false;
+  }
+  int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0) {
+    log_to_file("Drop watcher disabled: inotify_init1 failed: " +
+                std::string(strerror(errno)));
+    return false;
+  }
+
+  auto quiet = std::chrono::milliseconds(
+      std::max(0LL, env_or("PUBLISHER_WATCH_QUIET_MS", 5000LL)));
+  auto watcher = std::make_shared<DropWatcher>(
+      fd, fs::absolute(root), quiet,
+      env_or("PUBLISHER_WATCH_MARKER", std::string(".publish-ready")),
+      std::move(publish));
+  if (!watcher->watch_root()) {
+    close(fd);
+    return false;
+  }
+  std::thread([watcher] { watcher->publish_loop(); }).detach();
+  std::thread([watcher] { watcher->watch_loop(); }).detach();
+  log_to_file("Drop watcher watching " + root + " (quiet " +
+              std::to_string(quiet.count()) + " ms)");
+  return true;
+}
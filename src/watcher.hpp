@@ -0,0 +1,22 @@
+// watcher.hpp
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Optional drop folder (PUBLISHER_WATCH_ROOT). Authors copy one directory
+// per article or sochee under the root and it is published without a
+// /publish call. inotify watches the root and every directory below it;
+// each event pushes back the publish of the top-level directory it belongs
+// to, so a directory is published once it has been quiet for
+// PUBLISHER_WATCH_QUIET_MS, or as soon as its marker file
+// (PUBLISHER_WATCH_MARKER) is written. Events for a directory whose publish
+// is in flight are coalesced into one follow-up publish.
+
+using PublishDirs = std::function<void(const std::vector<std::string> &)>;
+
+// Starts the watcher threads; false when no root is configured or inotify
+// could not be set up. `publish` runs on the watcher's own publish thread
+// with every directory that became ready since the previous call.
+bool start_drop_watcher(PublishDirs publish);
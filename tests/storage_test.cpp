@@ -0,0 +1,396 @@
+// storage_test.cpp
+//
+// Drives the chunked upload path of storage.cpp through the real gsutil
+// code (stat parsing, compose rounds, error classification) against a fake
+// gsutil backed by a directory. The test binary is the fake as well: a
+// symlink named gsutil to it is put first on PATH. Run by
+// scripts/run_tests.sh.
+
+#include "../src/storage.cpp"
+
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <sys/file.h>
+
+namespace {
+
+std::mutex log_mutex;
+std::vector<std::string> log_lines;
+
+int failures = 0;
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition        \
+                << ") failed\n";                                               \
+      ++failures;                                                              \
+    }                                                                          \
+  } while (0)
+
+bool logged(const std::string &text) {
+  std::lock_guard<std::mutex> lock(log_mutex);
+  return std::any_of(log_lines.begin(), log_lines.end(), [&](auto &line) {
+    return line.find(text) != std::string::npos;
+  });
+}
+
+std::string base64(const std::string &bytes) {
+  static const char *ALPHABET =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  for (size_t i = 0; i < bytes.size(); i += 3) {
+    size_t n = std::min<size_t>(3, bytes.size() - i);
+    uint32_t group = 0;
+    for (size_t j = 0; j < 3; ++j)
+      group = group << 8 | (j < n ? (unsigned char)bytes[i + j] : 0);
+    for (size_t j = 0; j < 4; ++j)
+      out += j <= n ? ALPHABET[(group >> (18 - 6 * j)) & 63] : '=';
+  }
+  return out;
+}
+
+std::string read_file(const fs::path &path) {
+  std::ifstream in(path, std::ios::binary);
+  return std::string((std::istreambuf_iterator<char>(in)),
+                     std::istreambuf_iterator<char>());
+}
+
+void write_file(const fs::path &path, const std::string &data) {
+  fs::create_directories(path.parent_path());
+  std::ofstream(path, std::ios::binary | std::ios::trunc) << data;
+}
+
+// Fake gsutil
+
+// Number of this cp call, counted across processes in the fake's root
+long long next_cp(const fs::path &root) {
+  int fd = ::open((root / ".cp_count").c_str(), O_RDWR | O_CREAT, 0644);
+  flock(fd, LOCK_EX);
+  char buf[32] = {};
+  ssize_t got = pread(fd, buf, sizeof(buf) - 1, 0);
+  long long count = (got > 0 ? std::atoll(buf) : 0) + 1;
+  std::string text = std::to_string(count);
+  if (ftruncate(fd, 0) != 0 ||
+      pwrite(fd, text.data(), text.size(), 0) != (ssize_t)text.size())
+    count = -1;
+  flock(fd, LOCK_UN);
+  ::close(fd);
+  return count;
+}
+
+long long env_number(const char *name) {
+  const char *value = std::getenv(name);
+  return value ? std::atoll(value) : 0;
+}
+
+// gs://bucket/key -> <root>/bucket/key
+fs::path object_path(const fs::path &root, const std::string &url) {
+  return root / url.substr(std::string("gs://").size());
+}
+
+// FAKE_GCS_ROOT holds the objects. FAKE_GCS_KILL_CP=n makes the n-th cp
+// store half its data and fail like an interrupted transfer;
+// FAKE_GCS_CORRUPT_CP=n makes it store one flipped byte and succeed.
+int fake_gsutil(int argc, char **argv) {
+  fs::path root = std::getenv("FAKE_GCS_ROOT");
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; ++i) {
+    if (std::string(argv[i]) != "-q" && std::string(argv[i]) != "-m")
+      args.push_back(argv[i]);
+  }
+  if (args.empty())
+    return 2;
+
+  if (args[0] == "cp" && args.size() == 3) {
+    std::string data = args[1] == "-" ? std::string(
+                                            std::istreambuf_iterator<char>(
+                                                std::cin),
+                                            std::istreambuf_iterator<char>())
+                       : args[1].rfind("gs://", 0) == 0
+                           ? read_file(object_path(root, args[1]))
+                           : read_file(args[1]);
+    long long count = next_cp(root);
+    if (count == env_number("FAKE_GCS_KILL_CP")) {
+      write_file(object_path(root, args[2]), data.substr(0, data.size() / 2));
+      std::cerr << "ServiceException: 503 Backend Error\n";
+      return 1;
+    }
+    if (count == env_number("FAKE_GCS_CORRUPT_CP") && !data.empty())
+      data[0] ^= 1;
+    write_file(object_path(root, args[2]), data);
+    return 0;
+  }
+
+  if (args[0] == "stat" && args.size() == 2) {
+    fs::path path = object_path(root, args[1]);
+    if (!fs::exists(path)) {
+      std::cerr << "No URLs matched: " << args[1] << "\n";
+      return 1;
+    }
+    std::string data = read_file(path);
+    uint32_t crc = crc32c_update(0, data.data(), data.size());
+    std::string bytes = {(char)(crc >> 24), (char)(crc >> 16), (char)(crc >> 8),
+                         (char)crc};
+    std::cout << args[1] << ":\n    Content-Length:         " << data.size()
+              << "\n    Hash (crc32c):          " << base64(bytes)
+              << "\n    Hash (md5):             AAAAAAAAAAAAAAAAAAAAAA==\n";
+    return 0;
+  }
+
+  if (args[0] == "compose" && args.size() >= 3) {
+    size_t sources = args.size() - 2;
+    if (sources > COMPOSE_MAX_SOURCES) {
+      std::cerr << "BadRequestException: 400 too many source objects\n";
+      return 1;
+    }
+    std::string data;
+    for (size_t i = 1; i + 1 < args.size(); ++i) {
+      fs::path path = object_path(root, args[i]);
+      if (!fs::exists(path)) {
+        std::cerr << "NotFoundException: 404 " << args[i] << "\n";
+        return 1;
+      }
+      data += read_file(path);
+    }
+    write_file(object_path(root, args.back()), data);
+    std::ofstream(root / ".compose_log", std::ios::app) << sources << "\n";
+    return 0;
+  }
+
+  if (args[0] == "rm") {
+    for (size_t i = 1; i < args.size(); ++i)
+      fs::remove(object_path(root, args[i]));
+    return 0;
+  }
+
+  std::cerr << "fake gsutil: unsupported command " << args[0] << "\n";
+  return 2;
+}
+
+// Tests
+
+void test_parse_stat_crc32c() {
+  uint32_t crc = 0;
+  // CRC32C check value of "123456789" is 0xe3069283
+  CHECK(crc32c_update(0, "123456789", 9) == 0xe3069283);
+  CHECK(parse_stat_crc32c("gs://b/k:\n    Hash (crc32c):          4waSgw==\n"
+                          "    Hash (md5):   x==\n",
+                          crc));
+  CHECK(crc == 0xe3069283);
+  CHECK(parse_stat_crc32c("Hash (crc32c): AAAAAA==", crc) && crc == 0);
+  CHECK(parse_stat_crc32c("Hash (crc32c): /////w==", crc) &&
+        crc == 0xffffffff);
+  CHECK(!parse_stat_crc32c("Hash (md5): 4waSgw==", crc));
+  CHECK(!parse_stat_crc32c("Hash (crc32c): 4waS", crc));
+  CHECK(!parse_stat_crc32c("Hash (crc32c): 4waSgwAA", crc));
+  CHECK(!parse_stat_crc32c("Hash (crc32c): 4w*Sgw==", crc));
+}
+
+void test_compose_rounds() {
+  auto parts_of = [](size_t n) {
+    std::vector<std::string> parts;
+    for (size_t i = 0; i < n; ++i)
+      parts.push_back("p" + std::to_string(i));
+    return parts;
+  };
+  CHECK(compose_rounds({}, "k").empty());
+
+  auto rounds = compose_rounds(parts_of(32), "k");
+  CHECK(rounds.size() == 1 && rounds[0].size() == 2 + 32 + 1);
+
+  // 70 parts: 32, then k + 31, then k + 7
+  std::vector<std::string> parts = parts_of(70);
+  rounds = compose_rounds(parts, "k");
+  CHECK(rounds.size() == 3);
+  std::vector<std::string> order;
+  for (size_t r = 0; r < rounds.size(); ++r) {
+    const auto &args = rounds[r];
+    CHECK(args[0] == "-q" && args[1] == "compose");
+    CHECK(args.back() == object_url("k"));
+    CHECK(args.size() - 3 <= COMPOSE_MAX_SOURCES);
+    size_t first = 2;
+    if (r > 0) {
+      CHECK(args[2] == object_url("k"));
+      first = 3;
+    }
+    for (size_t i = first; i + 1 < args.size(); ++i)
+      order.push_back(args[i]);
+  }
+  CHECK(rounds[0].size() - 3 == 32 && rounds[1].size() - 3 == 32 &&
+        rounds[2].size() - 3 == 8);
+  bool in_order = order.size() == parts.size();
+  for (size_t i = 0; in_order && i < parts.size(); ++i)
+    in_order = order[i] == object_url(parts[i]);
+  CHECK(in_order);
+}
+
+void test_classify_gsutil_error() {
+  CHECK(classify_gsutil_error("ServiceException: 503 Backend Error") ==
+        CallStatus::Transient);
+  CHECK(classify_gsutil_error("AccessDeniedException: 403 Forbidden") ==
+        CallStatus::Permanent);
+  CHECK(classify_gsutil_error("No URLs matched: gs://b/k") ==
+        CallStatus::Permanent);
+}
+
+struct ChunkedUpload {
+  fs::path root;
+  fs::path source;
+  std::string data;
+
+  ChunkedUpload(const fs::path &dir, const std::string &name, size_t chunks)
+      : root(dir / "gcs"), source(dir / name) {
+    fs::remove_all(root);
+    fs::create_directories(root);
+    setenv("FAKE_GCS_ROOT", root.c_str(), 1);
+    unsetenv("FAKE_GCS_KILL_CP");
+    unsetenv("FAKE_GCS_CORRUPT_CP");
+
+    std::mt19937 random(42);
+    data.resize(chunks * (1 << 20) - 12345);
+    for (auto &byte : data)
+      byte = (char)random();
+    write_file(source, data);
+  }
+
+  CallResult run(const std::string &key) {
+    return upload_public_file(source, key);
+  }
+
+  std::string stored(const std::string &key) {
+    return read_file(root / GCS_PUBLIC_BUCKET / key);
+  }
+
+  long long cp_calls() { return std::atoll(read_file(root / ".cp_count").c_str()); }
+
+  bool parts_left() {
+    fs::path uploads = root / GCS_PUBLIC_BUCKET / "uploads";
+    if (!fs::exists(uploads))
+      return false;
+    for (const auto &entry : fs::recursive_directory_iterator(uploads)) {
+      if (entry.is_regular_file())
+        return true;
+    }
+    return false;
+  }
+};
+
+void test_many_parts(const fs::path &dir) {
+  ChunkedUpload upload(dir, "many.mp4", 40);
+  setenv("PUBLISHER_UPLOAD_PARALLEL", "4", 1);
+  CallResult result = upload.run("videos/many.mp4");
+  CHECK(result);
+  CHECK(result.value == public_url("videos/many.mp4"));
+  CHECK(upload.stored("videos/many.mp4") == upload.data);
+  CHECK(upload.cp_calls() == 40);
+  CHECK(read_file(upload.root / ".compose_log") == "32\n9\n");
+  CHECK(!upload.parts_left());
+}
+
+void test_resume_after_killed_chunk(const fs::path &dir) {
+  ChunkedUpload upload(dir, "resume.mp4", 6);
+  setenv("PUBLISHER_UPLOAD_PARALLEL", "1", 1);
+  setenv("PUBLISHER_RETRY_ATTEMPTS", "1", 1);
+  setenv("FAKE_GCS_KILL_CP", "4", 1);
+  CallResult first = upload.run("videos/resume.mp4");
+  CHECK(!first);
+  CHECK(first.status == CallStatus::Transient);
+  CHECK(first.error.find("3 of 6 chunks committed") != std::string::npos);
+  CHECK(!fs::exists(upload.root / GCS_PUBLIC_BUCKET / "videos/resume.mp4"));
+
+  // The second attempt sends only the chunks that were not committed, to
+  // the key of the first attempt
+  unsetenv("FAKE_GCS_KILL_CP");
+  CallResult second = upload.run("videos/other-key.mp4");
+  CHECK(second);
+  CHECK(second.value == public_url("videos/resume.mp4"));
+  CHECK(logged("Resuming upload of videos/resume.mp4 with 3 chunks"));
+  CHECK(upload.cp_calls() == 4 + 3);
+  CHECK(upload.stored("videos/resume.mp4") == upload.data);
+  CHECK(!upload.parts_left());
+  unsetenv("PUBLISHER_RETRY_ATTEMPTS");
+}
+
+void test_crc_mismatch(const fs::path &dir) {
+  ChunkedUpload upload(dir, "corrupt.mp4", 4);
+  setenv("PUBLISHER_UPLOAD_PARALLEL", "1", 1);
+  setenv("PUBLISHER_RETRY_ATTEMPTS", "2", 1);
+  setenv("FAKE_GCS_CORRUPT_CP", "2", 1);
+  CallResult result = upload.run("videos/corrupt.mp4");
+  CHECK(result);
+  CHECK(logged("stored with crc32c"));
+  // The corrupted chunk is sent once more
+  CHECK(upload.cp_calls() == 4 + 1);
+  CHECK(upload.stored("videos/corrupt.mp4") == upload.data);
+
+  // A chunk that never arrives intact fails the upload
+  ChunkedUpload failing(dir, "corrupt2.mp4", 2);
+  setenv("PUBLISHER_RETRY_ATTEMPTS", "1", 1);
+  setenv("FAKE_GCS_CORRUPT_CP", "1", 1);
+  CallResult failed = failing.run("videos/corrupt2.mp4");
+  CHECK(!failed);
+  CHECK(failed.error.find("stored with crc32c") != std::string::npos);
+  unsetenv("PUBLISHER_RETRY_ATTEMPTS");
+}
+
+} // namespace
+
+// publisher.hpp helpers, defined by article_publisher.cpp in the service
+void log_to_file(const std::string &message) {
+  std::lock_guard<std::mutex> lock(log_mutex);
+  log_lines.push_back(message);
+}
+
+std::string generate_uuid() {
+  static std::mutex mutex;
+  static std::mt19937_64 random(std::random_device{}());
+  std::lock_guard<std::mutex> lock(mutex);
+  char text[33];
+  snprintf(text, sizeof(text), "%016llx%016llx",
+           (unsigned long long)random(), (unsigned long long)random());
+  return text;
+}
+
+std::string env_or(const char *name, const std::string &fallback) {
+  const char *value = std::getenv(name);
+  return value && *value ? value : fallback;
+}
+
+long long env_or(const char *name, long long fallback) {
+  const char *value = std::getenv(name);
+  return value && *value ? std::atoll(value) : fallback;
+}
+
+int main(int argc, char **argv) {
+  if (fs::path(argv[0]).filename() == "gsutil")
+    return fake_gsutil(argc, argv);
+
+  fs::path dir = fs::temp_directory_path() /
+                 ("storage_test-" + std::to_string(getpid()));
+  fs::create_directories(dir / "bin");
+  fs::create_symlink(fs::canonical("/proc/self/exe"), dir / "bin" / "gsutil");
+  setenv("PATH", ((dir / "bin").string() + ":" + std::getenv("PATH")).c_str(),
+         1);
+  setenv("PUBLISHER_UPLOAD_STATE_DIR", (dir / "state").c_str(), 1);
+  setenv("PUBLISHER_CHUNKED_UPLOAD_BYTES", "1", 1);
+  setenv("PUBLISHER_UPLOAD_CHUNK_BYTES", "1048576", 1);
+  setenv("PUBLISHER_RETRY_BASE_MS", "1", 1);
+  unsetenv("PUBLISHER_STORAGE_DIR");
+
+  test_parse_stat_crc32c();
+  test_compose_rounds();
+  test_classify_gsutil_error();
+  test_many_parts(dir);
+  test_resume_after_killed_chunk(dir);
+  test_crc_mismatch(dir);
+
+  fs::remove_all(dir);
+  if (failures) {
+    std::cerr << failures << " checks failed\n";
+    return 1;
+  }
+  std::cout << "storage_test: all checks passed\n";
+  return 0;
+}